@@ -0,0 +1,200 @@
+// Benchmark: failover time of a pre-warmed recovery versus a cold one,
+// end to end, against a stand-in coordinator.
+//
+// This process plays the coordinator, and runs the immortal in a
+// forked child.  The immortal's state is a block of memory that each
+// call updates, after some simulated work; its checkpoint is that
+// block.  Failover time is measured from the moment the primary is
+// given up for dead until the first RPC the new primary sends (from
+// its becomingPrimary callback) arrives:
+//
+//  * prewarmed: the recovering immortal was started beforehand, and
+//    loaded the checkpoint and replayed the log as it arrived; now it
+//    is sent BecomingPrimary.
+//  * cold:      the immortal is only started now, and is sent the
+//    checkpoint, the whole log, and BecomingPrimary.
+//
+// Both run the same recovery (their load and replay times match): the
+// difference is only in when it starts, which is up to the coordinator.
+//
+//   make bench && bin/failover_bench.exe [calls] [stateMB] [workNs]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ambrosia/client.h"
+#include "standin.h"
+
+#define METHOD_UPDATE   1
+#define METHOD_PROMOTED 2
+#define ARGS 64
+
+static long g_calls;
+static int64_t g_state_bytes;
+static int64_t g_work_ns;
+
+// Shared with the immortal's process:
+struct shared {
+  volatile long applied;
+  struct amb_replay_stats stats;
+};
+static struct shared* g_shared;
+
+// The immortal
+// ------------------------------------------------------------
+
+static char* g_state;
+
+static void update(int32_t methodID, void* args, int argsLen)
+{
+  int64_t key;
+  if (methodID != METHOD_UPDATE || argsLen != ARGS) abort();
+  memcpy(&key, args, 8);
+  int64_t until = now_ns() + g_work_ns;
+  while (now_ns() < until) ;
+  memcpy(g_state + (key * ARGS) % (g_state_bytes - ARGS), args, ARGS);
+  g_shared->applied++;
+}
+
+static void checkpoint(int upfd)
+{
+  (void)upfd;
+  amb_checkpoint_writer* w = amb_checkpoint_begin(g_state_bytes, 0);
+  amb_checkpoint_write(w, g_state, g_state_bytes);
+  amb_checkpoint_end(w);
+}
+
+static void load(int downfd, int64_t len)
+{
+  if (len != g_state_bytes) abort();
+  for (int64_t got = 0; got < len; ) {
+    ssize_t n = recv(downfd, g_state + got, len - got, 0);
+    if (n <= 0) abort();
+    got += n;
+  }
+}
+
+static void promoted(void)
+{
+  amb_get_replay_stats(&g_shared->stats);
+  char arg = 0;
+  struct amb_iovec iov = { &arg, 1 };
+  amb_send_rpc_iov("", 0, METHOD_PROMOTED, 1, &iov, 1, NULL, NULL);
+}
+
+static void immortal(int upport, int downport)
+{
+  g_state = (char*)malloc(g_state_bytes);
+  struct amb_client_options o;
+  amb_default_client_options(&o);
+  o.dispatch = update;
+  o.checkpoint = checkpoint;
+  o.load = load;
+  o.becomingPrimary = promoted;
+  amb_initialize_client_runtime_opts(upport, downport, &o);
+  amb_normal_processing_loop();
+  exit(0);
+}
+
+// The stand-in coordinator
+// ------------------------------------------------------------
+
+static int64_t g_record_seq = 0;
+
+static void send_checkpoint(int fd, const char* state)
+{
+  char rec[32];
+  char* p = put_msg(rec, Checkpoint, &g_state_bytes, 8);
+  send_record(fd, rec, p - rec, ++g_record_seq);
+  send_all(fd, state, g_state_bytes);
+}
+
+// The log since the checkpoint, in records of about 64KB.
+static void send_log(int fd)
+{
+  static char rec[64 * 1024 + 128];
+  char* p = rec;
+  for (long i = 0; i < g_calls; i++) {
+    char call[ARGS + 16];
+    char* c = call;
+    *c++ = RetNone;
+    c = (char*)write_zigzag_int(c, METHOD_UPDATE);
+    *c++ = 1;
+    int64_t key = i * 7919;
+    memcpy(c, &key, 8);
+    memset(c + 8, (char)i, ARGS - 8);
+    c += ARGS;
+    p = put_msg(p, RPC, call, c - call);
+    if (p - rec > 64 * 1024) { send_record(fd, rec, p - rec, ++g_record_seq); p = rec; }
+  }
+  if (p > rec) send_record(fd, rec, p - rec, ++g_record_seq);
+}
+
+static void send_promotion(int fd)
+{
+  char rec[8];
+  char* p = put_msg(rec, BecomingPrimary, NULL, 0);
+  send_record(fd, rec, p - rec, ++g_record_seq);
+}
+
+static struct standin_in g_in;
+
+// Read messages from the immortal until its first RPC.
+static void await_rpc(int fd)
+{
+  standin_open(&g_in, fd);
+  while (next_message(&g_in, NULL, 0, NULL) != RPC) ;
+}
+
+static void report(const char* name, int64_t ns)
+{
+  struct amb_replay_stats* st = & g_shared->stats;
+  printf("%-10s %12.3f %10.3f %10ld %10.3f\n", name, ns / 1e6,
+         st->loadNs / 1e6, (long)st->replayed, st->replayNs / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+  g_calls = argc > 1 ? atol(argv[1]) : 200000;
+  g_state_bytes = (argc > 2 ? atol(argv[2]) : 256) << 20;
+  g_work_ns = argc > 3 ? atol(argv[3]) : 2000;
+  g_shared = (struct shared*)mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  char* state = (char*)malloc(g_state_bytes);
+  memset(state, 1, g_state_bytes);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%ld calls since the checkpoint, %lld MB of state, %lld ns of work per call\n",
+         g_calls, (long long)(g_state_bytes >> 20), (long long)g_work_ns);
+  printf("%-10s %12s %10s %10s %10s\n", "", "failover ms", "load ms", "replayed", "replay ms");
+
+  // Pre-warmed: caught up before the failure.
+  memset(g_shared, 0, sizeof(*g_shared));
+  struct standin_conn c = standin_launch(immortal);
+  send_checkpoint(c.down, state);
+  send_log(c.down);
+  while (g_shared->applied < g_calls) usleep(1000);
+  int64_t t0 = now_ns();
+  send_promotion(c.down);
+  await_rpc(c.up);
+  int64_t hot = now_ns() - t0;
+  standin_stop(&c);
+  report("prewarmed", hot);
+
+  // Cold recovery: started after the failure.
+  memset(g_shared, 0, sizeof(*g_shared));
+  t0 = now_ns();
+  c = standin_launch(immortal);
+  send_checkpoint(c.down, state);
+  send_log(c.down);
+  send_promotion(c.down);
+  await_rpc(c.up);
+  int64_t cold = now_ns() - t0;
+  standin_stop(&c);
+  report("cold", cold);
+  return 0;
+}
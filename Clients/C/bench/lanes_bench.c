@@ -0,0 +1,190 @@
+// Benchmark: round-trip latency of small calls while bulk calls keep
+// the outbound ring busy, with and without priority lanes
+// (amb_client_options.lanes), against a stand-in coordinator.
+//
+// This process plays the coordinator, and runs the immortal in a
+// forked child, once per configuration.  The immortal calls itself
+// (ping), and each call, looped back through the coordinator as a log
+// record, makes the next one.  Meanwhile it keeps a backlog of bulk
+// calls queued on lane 0, topped up as each ping arrives, which the
+// coordinator counts and drops.  With lanes, the pings go through
+// lane 1.  The last configuration also shrinks the socket's send
+// buffer, where bulk already sent from the lanes still queues ahead
+// of a ping.
+//
+//   make bench && bin/lanes_bench.exe [roundTrips] [bulkBytes] [backlogBytes]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ambrosia/client.h"
+#include "standin.h"
+
+#define METHOD_PING 1
+#define METHOD_BULK 2
+
+static long g_round_trips;
+static int g_bulk_bytes, g_backlog_bytes;
+
+// The immortal
+// ------------------------------------------------------------
+
+static char g_ping[64];
+static char* g_bulk;
+static int g_bulk_on, g_ping_lane;
+
+static void call(int32_t method, char* arg, int len)
+{
+  struct amb_iovec iov = { arg, len };
+  amb_send_rpc_iov("", 0, method, 1, &iov, 1, NULL, NULL);
+}
+
+// Queue bulk calls on lane 0 until the backlog is full.
+static void top_up()
+{
+  struct amb_ring_occupancy occ;
+  if (!g_bulk_on) return;
+  for (amb_get_ring_occupancy(&occ); occ.usedBytes < g_backlog_bytes; amb_get_ring_occupancy(&occ))
+    call(METHOD_BULK, g_bulk, g_bulk_bytes);
+}
+
+static void ping()
+{
+  amb_set_lane(g_ping_lane);
+  call(METHOD_PING, g_ping, sizeof(g_ping));
+  amb_set_lane(0);
+  top_up();
+}
+
+static void dispatch(int32_t methodID, void* args, int argsLen)
+{
+  (void)args; (void)argsLen;
+  if (methodID == METHOD_PING) ping();
+}
+
+// The run's configuration, for the immortal:
+static const struct amb_client_options* g_config;
+
+static void immortal(int upport, int downport)
+{
+  struct amb_client_options o = *g_config;
+  o.dispatch = dispatch;
+  o.checkpoint = standin_checkpoint;
+  o.socketProfile = AMB_SOCKETS_LATENCY;
+  amb_initialize_client_runtime_opts(upport, downport, &o);
+
+  g_bulk = (char*)calloc(1, g_bulk_bytes);
+  g_ping_lane = o.lanes > 0 ? 1 : 0;
+  ping();
+  amb_normal_processing_loop(); // Until killed.
+  exit(0);
+}
+
+// The stand-in coordinator
+// ------------------------------------------------------------
+
+static struct standin_in g_in;
+
+// Read the immortal's next ping, counting the bulk bytes that arrive
+// before it.  Writes the ping's body (after the tag) to body, and
+// returns its size.
+static int next_ping(char* body, int max, int64_t* bulk)
+{
+  while (1) {
+    int size;
+    if (next_message(&g_in, body, max, &size) != RPC) continue;
+    if (size <= max) return size;
+    *bulk += size;
+  }
+}
+
+static int cmp_ns(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+struct result {
+  int64_t median_ns, p99_ns;
+  double bulk_mbs;
+};
+
+// Loop each ping back as the next log record, timing each round trip.
+static struct result ping_pong(int up, int down)
+{
+  static char body[256], msg[256 + 16];
+  int64_t* trips = (int64_t*)malloc(g_round_trips * sizeof(int64_t));
+  int64_t bulk = 0, start = 0, sent = 0;
+  for (long i = 0; i <= g_round_trips; i++) {
+    int len = next_ping(body, sizeof(body), &bulk);
+    int64_t now = now_ns();
+    if (i == 0) { start = now; bulk = 0; } // After connecting and checkpointing.
+    else trips[i - 1] = now - sent;
+    int32_t destLen;
+    char* rest = (char*)read_zigzag_int(body, &destLen) + destLen;
+    int restLen = len - (int)(rest - body);
+    char* p = (char*)write_zigzag_int(msg, restLen + 1);
+    *p++ = RPC;
+    memcpy(p, rest, restLen);
+    sent = now_ns();
+    send_record(down, msg, (int)(p - msg) + restLen, i);
+  }
+  struct result r;
+  r.bulk_mbs = bulk / ((now_ns() - start) / 1e9) / (1 << 20);
+  qsort(trips, g_round_trips, sizeof(int64_t), cmp_ns);
+  r.median_ns = trips[g_round_trips / 2];
+  r.p99_ns = trips[g_round_trips * 99 / 100];
+  free(trips);
+  return r;
+}
+
+static struct result run(const struct amb_client_options* config, int bulk)
+{
+  g_config = config;
+  g_bulk_on = bulk;
+  struct standin_conn c = standin_launch(immortal);
+  send_start(c.down);
+  standin_open(&g_in, c.up);
+  struct result r = ping_pong(c.up, c.down);
+  standin_stop(&c);
+  return r;
+}
+
+static void report(const char* name, const struct amb_client_options* config, int bulk)
+{
+  struct result r = run(config, bulk);
+  printf("%-14s %12.1f %12.1f %10.1f\n", name, r.median_ns / 1e3, r.p99_ns / 1e3, r.bulk_mbs);
+}
+
+int main(int argc, char** argv)
+{
+  g_round_trips = argc > 1 ? atol(argv[1]) : 1000;
+  g_bulk_bytes = argc > 2 ? atoi(argv[2]) : 64 * 1024;
+  g_backlog_bytes = argc > 3 ? atoi(argv[3]) : 4 * 1024 * 1024;
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%ld round trips; bulk calls of %d bytes, %d bytes of them kept queued\n",
+         g_round_trips, g_bulk_bytes, g_backlog_bytes);
+  printf("%-14s %12s %12s %10s\n", "lanes", "median us", "p99 us", "bulk MB/s");
+
+  struct amb_client_options o;
+  amb_default_client_options(&o);
+  report("idle", &o, 0);
+  report("one ring", &o, 1);
+
+  o.lanes = 1;
+  report("strict", &o, 1);
+
+  o.laneWeights[0] = o.laneWeights[1] = 1;
+  report("weighted 1:1", &o, 1);
+
+  o.laneWeights[0] = 8;
+  report("weighted 8:1", &o, 1);
+
+  o.laneWeights[0] = o.laneWeights[1] = 0;
+  o.socketBufBytes = 256 * 1024;
+  report("strict, 256K", &o, 1);
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Benchmark: outbound throughput for each placement of the runtime's
+// threads and ring (amb_client_options.appCpu, progressCpu, ringNode,
+// realtimePriority), against a stand-in coordinator.
+//
+// This process plays the coordinator, and runs the immortal in a
+// forked child, once per placement.  The immortal's thread sends a
+// stream of fire-and-forget RPCs to itself as fast as the ring takes
+// them; throughput is measured from the first call to arrive until
+// the last.  Placements that need more CPUs or NUMA nodes than this
+// machine offers are skipped.
+//
+//   make bench && bin/placement_bench.exe [calls] [argBytes]
+
+#define _GNU_SOURCE // sched_getaffinity
+
+#include <dirent.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ambrosia/client.h"
+#include "standin.h"
+
+#define METHOD_SINK 1
+
+static long g_calls;
+static int g_arg_bytes;
+
+// The machine
+// ------------------------------------------------------------
+
+static int g_cpus[CPU_SETSIZE];
+static int g_ncpus;
+
+static void find_cpus()
+{
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set)) { perror("sched_getaffinity"); exit(1); }
+  for (int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &set)) g_cpus[g_ncpus++] = c;
+}
+
+// The NUMA node a CPU belongs to (0 if unknown).
+static int cpu_node(int cpu)
+{
+  char path[64];
+  int node = 0;
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* d = opendir(path);
+  if (d == NULL) return 0;
+  for (struct dirent* e; (e = readdir(d)) != NULL; )
+    if (strncmp(e->d_name, "node", 4) == 0 && sscanf(e->d_name + 4, "%d", &node) == 1) break;
+  closedir(d);
+  return node;
+}
+
+// A node other than the given one, or -1.
+static int other_node(int node)
+{
+  DIR* d = opendir("/sys/devices/system/node");
+  int other = -1, n;
+  if (d == NULL) return -1;
+  for (struct dirent* e; (e = readdir(d)) != NULL; )
+    if (sscanf(e->d_name, "node%d", &n) == 1 && n != node) { other = n; break; }
+  closedir(d);
+  return other;
+}
+
+// The immortal
+// ------------------------------------------------------------
+
+static void sink(int32_t methodID, void* args, int argsLen)
+{
+  (void)methodID; (void)args; (void)argsLen;
+}
+
+// The run's placement, for the immortal:
+static const struct amb_client_options* g_placement;
+
+static void immortal(int upport, int downport)
+{
+  struct amb_client_options o = *g_placement;
+  o.dispatch = sink;
+  o.checkpoint = standin_checkpoint;
+  amb_initialize_client_runtime_opts(upport, downport, &o);
+
+  char* arg = (char*)calloc(1, g_arg_bytes);
+  struct amb_iovec iov = { arg, g_arg_bytes };
+  for (long i = 0; i < g_calls; i++) {
+    memcpy(arg, &i, sizeof(i) < (size_t)g_arg_bytes ? sizeof(i) : (size_t)g_arg_bytes);
+    amb_send_rpc_iov("", 0, METHOD_SINK, 1, &iov, 1, NULL, NULL);
+  }
+  amb_normal_processing_loop(); // Until killed.
+  exit(0);
+}
+
+// The stand-in coordinator
+// ------------------------------------------------------------
+
+// Count the immortal's calls as they arrive; return the nanoseconds
+// from the first to the last.
+static int64_t consume(int fd)
+{
+  static struct standin_in in;
+  standin_open(&in, fd);
+  int64_t first = 0;
+  for (long calls = 0; calls < g_calls; )
+    if (next_message(&in, NULL, 0, NULL) == RPC && calls++ == 0) first = now_ns();
+  return now_ns() - first;
+}
+
+static int64_t run(const struct amb_client_options* placement)
+{
+  g_placement = placement;
+  struct standin_conn c = standin_launch(immortal);
+  send_start(c.down);
+  int64_t ns = consume(c.up);
+  standin_stop(&c);
+  return ns;
+}
+
+static void report(const char* name, const struct amb_client_options* o)
+{
+  char where[96];
+  snprintf(where, sizeof(where), "app %d, progress %d, ring node %d%s",
+           o->appCpu, o->progressCpu, o->ringNode,
+           o->realtimePriority > 0 ? ", SCHED_FIFO" : "");
+  int64_t ns = run(o);
+  printf("%-12s %-44s %10.3f %10.1f\n", name, where,
+         g_calls / (ns / 1e9) / 1e6, (double)g_calls * g_arg_bytes / (ns / 1e9) / (1 << 20));
+}
+
+int main(int argc, char** argv)
+{
+  g_calls = argc > 1 ? atol(argv[1]) : 2000000;
+  g_arg_bytes = argc > 2 ? atoi(argv[2]) : 64;
+  signal(SIGPIPE, SIG_IGN);
+  find_cpus();
+
+  // The coordinator gets a CPU of its own where there are enough.
+  int app = g_cpus[0];
+  int progress = g_ncpus > 1 ? g_cpus[1] : -1;
+  if (g_ncpus > 2) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(g_cpus[g_ncpus - 1], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+  int node = cpu_node(app), remote = other_node(node);
+
+  printf("%ld calls of %d bytes, %d CPUs\n", g_calls, g_arg_bytes, g_ncpus);
+  printf("%-12s %-44s %10s %10s\n", "placement", "", "Mcalls/s", "MB/s");
+
+  struct amb_client_options o;
+  amb_default_client_options(&o);
+  report("default", &o);
+
+  o.appCpu = o.progressCpu = app;
+  report("one CPU", &o);
+
+  if (progress < 0) {
+    printf("(skipping placements that need 2 CPUs)\n");
+    return 0;
+  }
+  o.progressCpu = progress;
+  report("split", &o);
+
+  o.ringNode = node;
+  report("split+local", &o);
+
+  if (remote >= 0) {
+    o.ringNode = remote;
+    report("split+remote", &o);
+    o.ringNode = node;
+  } else {
+    printf("(skipping the remote ring: 1 NUMA node)\n");
+  }
+
+  o.realtimePriority = 10;
+  report("split+fifo", &o);
+  return 0;
+}
@@ -0,0 +1,203 @@
+// Microbenchmark: schema-driven argument layouts (tools/ambidl.c,
+// bench/bench.idl) versus the usual zig-zag + memcpy encoding.
+//
+// Encoding writes the arguments of each RPC straight into the ring
+// (drained by a consumer thread, as the network progress thread
+// would).  Decoding reads them back from a log record: the baseline
+// parses into a struct, copying the variable-size fields; the schema
+// side verifies the message and then reads its fields in place.
+//
+//   make bench && bin/schema_bench.exe [messages]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ambrosia/client.h"
+#include "ambrosia/internal/spsc_rring.h"
+#include "bench.h" // Generated from bench/bench.idl
+
+static volatile int64_t g_sink = 0;
+static volatile int g_stop = 0;
+
+#define SYMBOL "MSFT.O"
+#define PAYLOAD 64
+static char g_payload[PAYLOAD];
+
+// The baseline encoding of Order: integers as zig-zag varints,
+// doubles bytewise, strings and bytes length-prefixed.
+struct order {
+  uint8_t side; int64_t id; int32_t qty; double price;
+  char symbol[16]; int32_t symbol_len;
+  char payload[PAYLOAD]; int32_t payload_len;
+  uint16_t venue;
+};
+
+static int zz_order_size(const struct order* o)
+{
+  return 1 + zigzag_long_size(o->id) + zigzag_int_size(o->qty) + 8
+       + zigzag_int_size(o->symbol_len) + o->symbol_len
+       + zigzag_int_size(o->payload_len) + o->payload_len
+       + zigzag_int_size(o->venue);
+}
+
+static char* zz_order_write(char* p, uint8_t side, int64_t id, int32_t qty, double price,
+                            const char* symbol, int32_t symbol_len,
+                            const void* payload, int32_t payload_len, uint16_t venue)
+{
+  *p++ = side;
+  p = write_zigzag_long(p, id);
+  p = write_zigzag_int(p, qty);
+  memcpy(p, &price, 8); p += 8;
+  p = write_zigzag_int(p, symbol_len);
+  memcpy(p, symbol, symbol_len); p += symbol_len;
+  p = write_zigzag_int(p, payload_len);
+  memcpy(p, payload, payload_len); p += payload_len;
+  return write_zigzag_int(p, venue);
+}
+
+static char* zz_order_read(char* p, struct order* o)
+{
+  int32_t v;
+  o->side = (uint8_t)*p++;
+  p = read_zigzag_long(p, &o->id);
+  p = read_zigzag_int(p, &o->qty);
+  memcpy(&o->price, p, 8); p += 8;
+  p = read_zigzag_int(p, &o->symbol_len);
+  memcpy(o->symbol, p, o->symbol_len); p += o->symbol_len;
+  p = read_zigzag_int(p, &o->payload_len);
+  memcpy(o->payload, p, o->payload_len); p += o->payload_len;
+  p = read_zigzag_int(p, &v);
+  o->venue = (uint16_t)v;
+  return p;
+}
+
+// Drain the ring, as the network thread does (minus the socket).
+static void* consumer(void* arg)
+{
+  (void)arg;
+  while (!g_stop) {
+    int n = 0;
+    char* p = peek_buffer(&n);
+    if (n > 0) { g_sink += p[0]; pop_buffer(n); }
+    else sched_yield();
+  }
+  return NULL;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+enum { ORDER_ID = 33 };
+
+static double run_encode(int schema, long n)
+{
+  int symLen = (int)strlen(SYMBOL);
+  double t0 = now();
+  for (long i = 0; i < n; i++) {
+    int argsLen;
+    if (schema) {
+      argsLen = Order_size(symLen, PAYLOAD);
+    } else {
+      struct order o = { .side = 1, .id = i, .qty = (int32_t)(i & 1023), .symbol_len = symLen,
+                         .payload_len = PAYLOAD, .venue = 7 };
+      argsLen = zz_order_size(&o);
+    }
+    char* start = reserve_buffer(5 + 1 + 5 + 0 + 1 + 5 + 1 + argsLen);
+    char* cur = amb_write_outgoing_rpc_hdr(start, "", 0, RetNone, ORDER_ID, RpcFireAndForget, argsLen);
+    if (schema)
+      cur += Order_write(cur, 1, i, (int32_t)(i & 1023), 101.25, SYMBOL, symLen, g_payload, PAYLOAD, 7);
+    else
+      cur = zz_order_write(cur, 1, i, (int32_t)(i & 1023), 101.25, SYMBOL, symLen, g_payload, PAYLOAD, 7);
+    release_buffer((int)(cur - start));
+  }
+  return (now() - t0) * 1e9 / n;
+}
+
+// A log record of n Orders in the given encoding, as the coordinator
+// would deliver them.
+static char* build_record(int schema, long n, long* size)
+{
+  char* rec = malloc((size_t)n * 160);
+  char* cur = rec;
+  char args[160];
+  int symLen = (int)strlen(SYMBOL);
+  for (long i = 0; i < n; i++) {
+    int len;
+    if (schema)
+      len = Order_write(args, 1, i, (int32_t)(i & 1023), 101.25, SYMBOL, symLen, g_payload, PAYLOAD, 7);
+    else
+      len = (int)(zz_order_write(args, 1, i, (int32_t)(i & 1023), 101.25, SYMBOL, symLen,
+                                 g_payload, PAYLOAD, 7) - args);
+    cur = amb_write_incoming_rpc(cur, ORDER_ID, RpcFireAndForget, args, len);
+  }
+  *size = cur - rec;
+  return rec;
+}
+
+// Read every field of every Order, as a handler would.
+static double run_decode(int schema, char* rec, long size, long n)
+{
+  char* cur = rec;
+  char* end = rec + size;
+  double t0 = now();
+  while (cur < end) {
+    int32_t size;
+    cur = read_zigzag_int(cur, &size);
+    cur++; // Type
+    struct amb_rpc_desc desc;
+    cur = amb_decode_rpc(cur, size - 1, &desc);
+    if (schema) {
+      const void* m = desc.args;
+      int32_t symLen, payloadLen;
+      if (!Order_verify(m, desc.argsLen)) abort();
+      const char* sym = Order_symbol(m, &symLen);
+      const char* payload = Order_payload(m, &payloadLen);
+      g_sink += Order_side(m) + Order_id(m) + Order_qty(m) + (int64_t)Order_price(m)
+              + sym[0] + symLen + payload[payloadLen - 1] + Order_venue(m);
+    } else {
+      struct order o;
+      zz_order_read(desc.args, &o);
+      g_sink += o.side + o.id + o.qty + (int64_t)o.price
+              + o.symbol[0] + o.symbol_len + o.payload[o.payload_len - 1] + o.venue;
+    }
+  }
+  return (now() - t0) * 1e9 / n;
+}
+
+int main(int argc, char** argv)
+{
+  long n = argc > 1 ? atol(argv[1]) : 2000000;
+  memset(g_payload, 7, PAYLOAD);
+
+  new_buffer(4 * 1024 * 1024);
+  pthread_t th;
+  pthread_create(&th, NULL, consumer, NULL);
+  long sizes[2];
+  char* recs[2] = { build_record(0, n, &sizes[0]), build_record(1, n, &sizes[1]) };
+
+  // Alternate, keeping the best of several runs of each:
+  double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+  for (int rep = 0; rep < 5; rep++) {
+    double r[4] = { run_encode(0, n), run_encode(1, n),
+                    run_decode(0, recs[0], sizes[0], n), run_decode(1, recs[1], sizes[1], n) };
+    for (int k = 0; k < 4; k++) if (r[k] < best[k]) best[k] = r[k];
+  }
+  g_stop = 1;
+  pthread_join(th, NULL);
+
+  printf("%-22s %10s %10s\n", "ns/Order", "zig-zag", "schema");
+  printf("%-22s %10.2f %10.2f\n", "encode (into ring)", best[0], best[1]);
+  printf("%-22s %10.2f %10.2f\n", "decode + read fields", best[2], best[3]);
+  printf("%-22s %10.1f %10.1f\n", "bytes of args", (double)sizes[0] / n, (double)sizes[1] / n);
+  free(recs[0]);
+  free(recs[1]);
+  return 0;
+}
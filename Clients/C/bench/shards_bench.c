@@ -0,0 +1,197 @@
+// Benchmark: aggregate call throughput of a sharded service
+// (ambrosia/shards.h) as the number of shards grows, against stand-in
+// coordinators, one per shard.
+//
+// This process plays the coordinators, and the client of the service:
+// it routes each call by its key to the shard that owns it
+// (amb_shard_of), and sends each shard its calls in log records of
+// batch calls, a few records ahead.  The service runs in a forked
+// child, in which each call spins for workNs (its handler's CPU time)
+// on its shard's state, and the last call of each record sends a call
+// back, which lets the stand-in send the next record.  Throughput
+// scales with shards only as far as there are CPUs to pin them to.
+//
+//   make bench && bin/shards_bench.exe [maxShards] [callsPerShard] [workNs] [batch]
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "ambrosia/client.h"
+#include "ambrosia/shards.h"
+#include "standin.h"
+
+#define METHOD_WORK 1
+#define METHOD_DONE 2
+
+#define MAX_SHARDS 64
+#define WINDOW 4 // Records in flight per shard.
+
+static long g_calls;
+static int g_work_ns, g_batch, g_nshards;
+
+// The service
+// ------------------------------------------------------------
+
+// Each shard's state, touched only by its own thread.
+static struct {
+  uint64_t sum;
+  char pad[56];
+} g_state[MAX_SHARDS];
+
+static void dispatch(int32_t methodID, void* args, int argsLen)
+{
+  int shard = amb_current_shard();
+  if (methodID == METHOD_DONE) {
+    struct amb_iovec iov = { args, argsLen };
+    amb_send_rpc_iov("", 0, METHOD_DONE, 1, &iov, 1, NULL, NULL);
+    return;
+  }
+  if (amb_shard_of(args, argsLen, g_nshards) != shard) {
+    fprintf(stderr, "ERROR: shard %d got a call on another shard's key\n", shard);
+    abort();
+  }
+  int64_t until = now_ns() + g_work_ns;
+  do g_state[shard].sum += *(uint64_t*)args; while (now_ns() < until);
+}
+
+static void checkpoint(int upfd)
+{
+  (void)upfd;
+  int shard = amb_current_shard();
+  amb_checkpoint_writer* w = amb_checkpoint_begin(sizeof(g_state[0].sum), 0);
+  amb_checkpoint_write(w, &g_state[shard].sum, sizeof(g_state[0].sum));
+  amb_checkpoint_end(w);
+}
+
+static void service(int n, const int* upports, const int* downports)
+{
+  struct amb_client_options o;
+  amb_default_client_options(&o);
+  g_nshards = n;
+  o.dispatch = dispatch;
+  o.checkpoint = checkpoint;
+  struct amb_shard_options so;
+  amb_default_shard_options(&so);
+  so.shards = n;
+  so.service = "bench";
+  so.upports = upports;
+  so.downports = downports;
+  amb_shards_join(amb_shards_start(&so, &o)); // Until killed.
+  exit(0);
+}
+
+// The stand-in coordinators
+// ------------------------------------------------------------
+
+struct coord {
+  int shard, nshards;
+  int up, down;
+  struct standin_in in;
+  pthread_t th;
+};
+
+// Wait for the shard's next call (a METHOD_DONE).
+static void next_done(struct coord* c)
+{
+  while (next_message(&c->in, NULL, 0, NULL) != RPC) ;
+}
+
+static char* write_call(char* p, int32_t method, uint64_t key)
+{
+  char body[16], *q = body;
+  *q++ = RetNone;
+  q = (char*)write_zigzag_int(q, method);
+  *q++ = RpcFireAndForget;
+  memcpy(q, &key, sizeof(key));
+  q += sizeof(key);
+  return put_msg(p, RPC, body, (int)(q - body));
+}
+
+// Send the shard its calls, batch by batch: each a log record of
+// calls on keys it owns, the last one asking for a call back.
+static void* coordinate(void* arg)
+{
+  struct coord* c = (struct coord*)arg;
+  char* rec = (char*)malloc(AMBROSIA_HEADERSIZE + (size_t)g_batch * 24);
+  uint64_t key = 0;
+  long records = (g_calls + g_batch - 1) / g_batch;
+  for (long r = 0; r < records + WINDOW; r++) {
+    if (r >= WINDOW) next_done(c);
+    if (r >= records) continue;
+    char* p = rec + AMBROSIA_HEADERSIZE;
+    for (int i = 0; i < g_batch; i++) {
+      do key++; while (amb_shard_of(&key, sizeof(key), c->nshards) != c->shard);
+      p = write_call(p, i == g_batch - 1 ? METHOD_DONE : METHOD_WORK, key);
+    }
+    struct log_hdr hdr = { 0, (int32_t)(p - rec), 0, r };
+    memcpy(rec, &hdr, AMBROSIA_HEADERSIZE);
+    send_all(c->down, rec, p - rec);
+  }
+  free(rec);
+  return NULL;
+}
+
+// RETURN: nanoseconds for all n shards to handle their calls.
+static int64_t run(int n)
+{
+  static struct coord coords[MAX_SHARDS];
+  int listeners[MAX_SHARDS], upports[MAX_SHARDS], downports[MAX_SHARDS];
+  for (int i = 0; i < n; i++) {
+    listeners[i] = standin_listen(&upports[i]);
+    downports[i] = upports[i] + 1;
+  }
+  pid_t pid = standin_fork();
+  if (pid == 0) {
+    for (int i = 0; i < n; i++) close(listeners[i]);
+    service(n, upports, downports);
+  }
+  for (int i = 0; i < n; i++) {
+    struct coord* c = &coords[i];
+    c->shard = i;
+    c->nshards = n;
+    standin_connect(listeners[i], downports[i], &c->up, &c->down);
+    standin_open(&c->in, c->up);
+    send_start(c->down);
+  }
+  for (int i = 0; i < n; i++) // The first checkpoints.
+    while (next_message(&coords[i].in, NULL, 0, NULL) != Checkpoint) ;
+
+  int64_t start = now_ns();
+  for (int i = 0; i < n; i++) pthread_create(&coords[i].th, NULL, coordinate, &coords[i]);
+  for (int i = 0; i < n; i++) pthread_join(coords[i].th, NULL);
+  int64_t ns = now_ns() - start;
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  for (int i = 0; i < n; i++) {
+    close(coords[i].up);
+    close(coords[i].down);
+  }
+  return ns;
+}
+
+int main(int argc, char** argv)
+{
+  int max = argc > 1 ? atoi(argv[1]) : 4;
+  g_calls = argc > 2 ? atol(argv[2]) : 200000;
+  g_work_ns = argc > 3 ? atoi(argv[3]) : 1000;
+  g_batch = argc > 4 ? atoi(argv[4]) : 64;
+  if (max > MAX_SHARDS) max = MAX_SHARDS;
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%ld calls per shard of %d ns each, %d per record, %ld CPUs\n",
+         g_calls, g_work_ns, g_batch, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-8s %12s %10s\n", "shards", "Mcalls/s", "speedup");
+  double base = 0;
+  for (int n = 1; n <= max; n *= 2) {
+    int64_t ns = run(n);
+    double rate = (double)g_calls * n / (ns / 1e9);
+    if (n == 1) base = rate;
+    printf("%-8d %12.3f %10.2f\n", n, rate / 1e6, rate / base);
+  }
+  return 0;
+}
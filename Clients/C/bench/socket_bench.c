@@ -0,0 +1,154 @@
+// Benchmark: round-trip latency and outbound throughput under each
+// socket profile (amb_client_options.socketProfile), against a
+// stand-in coordinator.
+//
+// This process plays the coordinator, and runs the immortal in a
+// forked child, twice per profile:
+//
+//  * ping-pong: the immortal calls itself, and each call, looped back
+//    through the coordinator as a log record, makes the next one.
+//  * stream:    the immortal sends a stream of calls to itself as fast
+//    as the ring takes them, timed from the first to arrive until the
+//    last.
+//
+// The stand-in sends with TCP_NODELAY, so that only the immortal's
+// side of the connection varies.
+//
+//   make bench && bin/socket_bench.exe [roundTrips] [streamCalls] [argBytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ambrosia/client.h"
+#include "standin.h"
+
+#define METHOD_PING 1
+#define METHOD_SINK 2
+
+static long g_round_trips, g_stream_calls;
+static int g_arg_bytes;
+
+// The immortal
+// ------------------------------------------------------------
+
+static char* g_arg;
+
+static void call(int32_t method)
+{
+  struct amb_iovec iov = { g_arg, g_arg_bytes };
+  amb_send_rpc_iov("", 0, method, 1, &iov, 1, NULL, NULL);
+}
+
+static void dispatch(int32_t methodID, void* args, int argsLen)
+{
+  (void)args; (void)argsLen;
+  if (methodID == METHOD_PING) call(METHOD_PING);
+}
+
+// The run's settings, for the immortal:
+static int g_profile, g_streaming;
+
+static void immortal(int upport, int downport)
+{
+  struct amb_client_options o;
+  amb_default_client_options(&o);
+  o.dispatch = dispatch;
+  o.checkpoint = standin_checkpoint;
+  o.socketProfile = g_profile;
+  amb_initialize_client_runtime_opts(upport, downport, &o);
+
+  g_arg = (char*)calloc(1, g_arg_bytes);
+  if (g_streaming)
+    for (long i = 0; i < g_stream_calls; i++) call(METHOD_SINK);
+  else
+    call(METHOD_PING);
+  amb_normal_processing_loop(); // Until killed.
+  exit(0);
+}
+
+// The stand-in coordinator
+// ------------------------------------------------------------
+
+static struct standin_in g_in;
+
+// Read the immortal's next RPC, skipping anything else.  With body,
+// write its body (after the tag), and return its size.
+static int next_rpc(char* body, int max)
+{
+  int size;
+  while (next_message(&g_in, body, max, &size) != RPC) ;
+  return size;
+}
+
+// Loop each call back as the next log record.  RETURN: nanoseconds
+// per round trip.
+static int64_t ping_pong(int up, int down)
+{
+  static char body[1 << 15], msg[1 << 15 | 16];
+  int64_t start = 0;
+  for (long i = 0; i <= g_round_trips; i++) {
+    int len = next_rpc(body, sizeof(body));
+    if (i == 0) start = now_ns(); // After connecting and checkpointing.
+    int32_t destLen;
+    char* rest = (char*)read_zigzag_int(body, &destLen) + destLen;
+    int restLen = len - (int)(rest - body);
+    char* p = (char*)write_zigzag_int(msg, restLen + 1);
+    *p++ = RPC;
+    memcpy(p, rest, restLen);
+    send_record(down, msg, (int)(p - msg) + restLen, i);
+  }
+  return (now_ns() - start) / g_round_trips;
+}
+
+// RETURN: nanoseconds from the first streamed call to the last.
+static int64_t stream(int up)
+{
+  int64_t first = 0;
+  for (long i = 0; i < g_stream_calls; i++) {
+    next_rpc(NULL, 0);
+    if (i == 0) first = now_ns();
+  }
+  return now_ns() - first;
+}
+
+static int64_t run(int profile, int streaming)
+{
+  g_profile = profile;
+  g_streaming = streaming;
+  struct standin_conn c = standin_launch(immortal);
+  send_start(c.down);
+  standin_open(&g_in, c.up);
+  int64_t ns = streaming ? stream(c.up) : ping_pong(c.up, c.down);
+  standin_stop(&c);
+  return ns;
+}
+
+int main(int argc, char** argv)
+{
+  g_round_trips = argc > 1 ? atol(argv[1]) : 20000;
+  g_stream_calls = argc > 2 ? atol(argv[2]) : 2000000;
+  g_arg_bytes = argc > 3 ? atoi(argv[3]) : 64;
+  signal(SIGPIPE, SIG_IGN);
+
+  static const struct { int profile; const char* name; const char* sets; } profiles[] = {
+    { AMB_SOCKETS_DEFAULT,    "default",    "kernel defaults: Nagle on, default buffers" },
+    { AMB_SOCKETS_LATENCY,    "latency",    "TCP_NODELAY, TCP_QUICKACK after each record, 50 us SO_BUSY_POLL" },
+    { AMB_SOCKETS_THROUGHPUT, "throughput", "TCP_NODELAY, 4 MB SO_SNDBUF/SO_RCVBUF, MSG_MORE while more is queued" },
+  };
+  int n = sizeof(profiles) / sizeof(profiles[0]);
+
+  printf("%ld round trips, %ld streamed calls, %d byte arguments\n",
+         g_round_trips, g_stream_calls, g_arg_bytes);
+  for (int i = 0; i < n; i++)
+    printf("  %-10s %s\n", profiles[i].name, profiles[i].sets);
+  printf("%-10s %14s %12s %10s\n", "profile", "round trip us", "Mcalls/s", "MB/s");
+  for (int i = 0; i < n; i++) {
+    int64_t rtt = run(profiles[i].profile, 0);
+    int64_t ns = run(profiles[i].profile, 1);
+    printf("%-10s %14.2f %12.3f %10.1f\n", profiles[i].name, rtt / 1e3,
+           g_stream_calls / (ns / 1e9) / 1e6,
+           (double)g_stream_calls * g_arg_bytes / (ns / 1e9) / (1 << 20));
+  }
+  return 0;
+}
@@ -0,0 +1,237 @@
+// The stand-in coordinator the benchmarks run their immortals against:
+// just enough of the coordinator's side of the protocol to start an
+// immortal in a child process, send it log records, and read back what
+// it sends.  All of it is static, and each benchmark uses what it
+// needs.
+
+#ifndef AMB_BENCH_STANDIN_HEADER
+#define AMB_BENCH_STANDIN_HEADER
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ambrosia/client.h"
+
+static inline int64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline void send_all(int fd, const void* buf, int64_t len)
+{
+  for (int64_t sent = 0; sent < len; ) {
+    ssize_t n = send(fd, (const char*)buf + sent, len - sent, 0);
+    if (n <= 0) { perror("send"); exit(1); }
+    sent += n;
+  }
+}
+
+// A checkpoint callback for immortals whose state does not matter.
+static inline void standin_checkpoint(int upfd)
+{
+  (void)upfd;
+  int64_t state = 0;
+  amb_checkpoint_writer* w = amb_checkpoint_begin(sizeof(state), 0);
+  amb_checkpoint_write(w, &state, sizeof(state));
+  amb_checkpoint_end(w);
+}
+
+// Launching immortals
+// ------------------------------------------------------------
+
+// Listen on a free loopback port: the up port of an immortal to be
+// started, whose down port is the next one.
+//
+// RETURN: the listening socket, and the port in *port.
+static inline int standin_listen(int* port)
+{
+  int ls = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+  struct sockaddr_in a;
+  socklen_t alen = sizeof(a);
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(ls, (struct sockaddr*)&a, sizeof(a)) || listen(ls, 1) ||
+      getsockname(ls, (struct sockaddr*)&a, &alen)) {
+    perror("listen");
+    exit(1);
+  }
+  *port = ntohs(a.sin_port);
+  return ls;
+}
+
+// Accept the immortal's up connection on ls (which is then closed),
+// and connect to its down port, retrying until it listens.  Neither
+// connection delays small sends.
+static inline void standin_connect(int ls, int downport, int* up, int* down)
+{
+  int one = 1;
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  a.sin_port = htons(downport);
+  *up = accept(ls, NULL, NULL);
+  close(ls);
+  *down = socket(AF_INET, SOCK_STREAM, 0);
+  while (connect(*down, (struct sockaddr*)&a, sizeof(a))) usleep(1000);
+  setsockopt(*up, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(*down, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Fork, and in the child, discard stdout (the runtime's chatter).
+//
+// RETURN: as fork.
+static inline pid_t standin_fork()
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0 && freopen("/dev/null", "w", stdout) == NULL) exit(1);
+  return pid;
+}
+
+// An immortal running in a child process, and the connections to it.
+struct standin_conn { pid_t pid; int up, down; };
+
+// Start immortal(upport, downport), which must not return, in a child
+// process, and connect to it.
+static inline struct standin_conn standin_launch(void (*immortal)(int upport, int downport))
+{
+  struct standin_conn c;
+  int upport;
+  int ls = standin_listen(&upport);
+  c.pid = standin_fork();
+  if (c.pid == 0) { close(ls); immortal(upport, upport + 1); }
+  standin_connect(ls, upport + 1, &c.up, &c.down);
+  return c;
+}
+
+// Kill the immortal, and close the connections to it.
+static inline void standin_stop(struct standin_conn* c)
+{
+  kill(c->pid, SIGKILL);
+  waitpid(c->pid, NULL, 0);
+  close(c->up);
+  close(c->down);
+}
+
+// Log records
+// ------------------------------------------------------------
+
+// Send len bytes of messages as one log record.  Small ones go in a
+// single send, so that a round trip is not split into two segments.
+static inline void send_record(int fd, const char* msgs, int len, int64_t seq)
+{
+  char rec[1 << 16];
+  struct log_hdr hdr = { 0, AMBROSIA_HEADERSIZE + len, 0, seq };
+  if (len > (int)sizeof(rec) - AMBROSIA_HEADERSIZE) {
+    send_all(fd, &hdr, AMBROSIA_HEADERSIZE);
+    send_all(fd, msgs, len);
+    return;
+  }
+  memcpy(rec, &hdr, AMBROSIA_HEADERSIZE);
+  memcpy(rec + AMBROSIA_HEADERSIZE, msgs, len);
+  send_all(fd, rec, AMBROSIA_HEADERSIZE + len);
+}
+
+// Write a message (its size, tag and body) at p.  RETURN: its end.
+static inline char* put_msg(char* p, char tag, const void* body, int len)
+{
+  p = (char*)write_zigzag_int(p, len + 1);
+  *p++ = tag;
+  memcpy(p, body, len);
+  return p + len;
+}
+
+// Tell a new immortal to start afresh (it then sends its first
+// checkpoint).
+static inline void send_start(int fd)
+{
+  char msg[8];
+  char* p = put_msg(msg, TakeBecomingPrimaryCheckpoint, NULL, 0);
+  send_record(fd, msg, p - msg, -1);
+}
+
+// Reading what the immortal sends
+// ------------------------------------------------------------
+
+// Buffered reads from an immortal.
+struct standin_in {
+  int fd;
+  int pos, len;
+  char buf[1 << 20];
+};
+
+static inline void standin_open(struct standin_in* in, int fd)
+{
+  in->fd = fd;
+  in->pos = in->len = 0;
+}
+
+static inline void fill(struct standin_in* in)
+{
+  if (in->pos < in->len) return;
+  ssize_t n = recv(in->fd, in->buf, sizeof(in->buf), 0);
+  if (n <= 0) { fprintf(stderr, "ERROR: the immortal hung up\n"); exit(1); }
+  in->pos = 0;
+  in->len = n;
+}
+
+static inline unsigned char next_byte(struct standin_in* in)
+{
+  fill(in);
+  return (unsigned char)in->buf[in->pos++];
+}
+
+// Read len bytes to out, or skip them if out is NULL.
+static inline void read_bytes(struct standin_in* in, char* out, int64_t len)
+{
+  while (len > 0) {
+    fill(in);
+    int n = in->len - in->pos < len ? in->len - in->pos : (int)len;
+    if (out != NULL) { memcpy(out, in->buf + in->pos, n); out += n; }
+    in->pos += n;
+    len -= n;
+  }
+}
+
+// Read the immortal's next message, skipping a checkpoint's bytes.
+// Its body (after the tag) is written to body if that holds max bytes
+// or more, and skipped otherwise.
+//
+// RETURN: the message's tag, and with size, its body's size.
+static inline char next_message(struct standin_in* in, char* body, int max, int* size)
+{
+  int32_t n = 0, shift = 0;
+  unsigned char c;
+  do {
+    c = next_byte(in);
+    n |= (int32_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  n = (int32_t)(((uint32_t)n >> 1) ^ -(n & 1));
+  char tag = (char)next_byte(in);
+  if (tag == Checkpoint) {
+    int64_t len = 0;
+    for (int i = 0; i < 8; i++) len |= (int64_t)next_byte(in) << (8 * i);
+    read_bytes(in, NULL, n - 9 + len);
+  } else {
+    read_bytes(in, body != NULL && n - 1 <= max ? body : NULL, n - 1);
+  }
+  if (size != NULL) *size = n - 1;
+  return tag;
+}
+
+#endif
@@ -0,0 +1,166 @@
+// Microbenchmark: typed ambrosia.hpp proxies and dispatch versus the
+// equivalent hand-written C against client.h.
+//
+// Both sides encode the same messages into the same ring (drained by
+// a consumer thread, as the network progress thread would), and
+// decode/dispatch the same log record.  No coordinator is involved.
+//
+//   make bench && bin/typed_bench.exe [messages]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sched.h>
+
+#include "ambrosia/ambrosia.hpp"
+
+static volatile int64_t g_sink = 0;
+static volatile int g_stop = 0;
+
+// The service: a fixed-size method, and one with a payload.
+static void point(int32_t x, int32_t y, int64_t t) { g_sink += x + y + t; }
+static void tput(int64_t seq, double w, ambrosia::bytes payload) {
+  g_sink += seq + (int64_t)w + payload.len + ((const char*)payload.data)[0];
+}
+using Bench = ambrosia::service<33, point, tput>;
+
+// Hand-written equivalents:
+enum { POINT_ID = 33, TPUT_ID = 34 };
+
+static void c_send_point(int32_t x, int32_t y, int64_t t) {
+  int argsLen = 4 + 4 + 8;
+  char* start = reserve_buffer(5 + 1 + 5 + 0 + 1 + 5 + 1 + argsLen);
+  char* cur = (char*)amb_write_outgoing_rpc_hdr(start, (char*)"", 0, 0, POINT_ID, 1, argsLen);
+  memcpy(cur, &x, 4); cur += 4;
+  memcpy(cur, &y, 4); cur += 4;
+  memcpy(cur, &t, 8); cur += 8;
+  release_buffer(cur - start);
+}
+
+static void c_send_tput(int64_t seq, double w, const char* payload, int len) {
+  int argsLen = 8 + 8 + zigzag_int_size(len) + len;
+  char* start = reserve_buffer(5 + 1 + 5 + 0 + 1 + 5 + 1 + argsLen);
+  char* cur = (char*)amb_write_outgoing_rpc_hdr(start, (char*)"", 0, 0, TPUT_ID, 1, argsLen);
+  memcpy(cur, &seq, 8); cur += 8;
+  memcpy(cur, &w, 8); cur += 8;
+  cur = (char*)write_zigzag_int(cur, len);
+  memcpy(cur, payload, len); cur += len;
+  release_buffer(cur - start);
+}
+
+static void c_dispatch(int32_t methodID, void* args, int /*argsLen*/) {
+  char* p = (char*)args;
+  switch (methodID) {
+  case POINT_ID: {
+    int32_t x, y; int64_t t;
+    memcpy(&x, p, 4); memcpy(&y, p + 4, 4); memcpy(&t, p + 8, 8);
+    point(x, y, t);
+    break;
+  }
+  case TPUT_ID: {
+    int64_t seq; double w; int32_t len;
+    memcpy(&seq, p, 8); memcpy(&w, p + 8, 8);
+    char* data = (char*)read_zigzag_int(p + 16, &len);
+    ambrosia::bytes b = { data, len };
+    tput(seq, w, b);
+    break;
+  }
+  default:
+    abort();
+  }
+}
+
+// Drain the ring, as the network thread does (minus the socket).
+static void consumer() {
+  while (!g_stop) {
+    int n = 0;
+    char* p = peek_buffer(&n);
+    if (n > 0) { g_sink += p[0]; pop_buffer(n); }
+    else sched_yield();
+  }
+}
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const int PAYLOAD = 64;
+static char g_payload[PAYLOAD];
+
+static double run_send(bool typed, long n) {
+  ambrosia::proxy<Bench> self("", 0);
+  double t0 = now();
+  for (long i = 0; i < n; i++) {
+    if (typed) {
+      self.send<point>((int32_t)i, (int32_t)(i >> 1), (int64_t)i);
+      self.send<tput>((int64_t)i, 0.5, ambrosia::bytes{ g_payload, PAYLOAD });
+    } else {
+      c_send_point((int32_t)i, (int32_t)(i >> 1), (int64_t)i);
+      c_send_tput(i, 0.5, g_payload, PAYLOAD);
+    }
+  }
+  return (now() - t0) * 1e9 / (2.0 * n);
+}
+
+// A log record of RPCs, as the coordinator would deliver them.
+static std::vector<char> build_record(long n) {
+  std::vector<char> rec((size_t)n * 128);
+  char* cur = rec.data();
+  char args[128];
+  for (long i = 0; i < n; i++) {
+    int32_t x = (int32_t)i, y = (int32_t)(i >> 1); int64_t t = i;
+    memcpy(args, &x, 4); memcpy(args + 4, &y, 4); memcpy(args + 8, &t, 8);
+    cur = (char*)amb_write_incoming_rpc(cur, POINT_ID, 1, args, 16);
+    double w = 0.5;
+    memcpy(args, &t, 8); memcpy(args + 8, &w, 8);
+    char* a = (char*)write_zigzag_int(args + 16, PAYLOAD);
+    memcpy(a, g_payload, PAYLOAD); a += PAYLOAD;
+    cur = (char*)amb_write_incoming_rpc(cur, TPUT_ID, 1, args, (int)(a - args));
+  }
+  rec.resize(cur - rec.data());
+  return rec;
+}
+
+static double run_dispatch(bool typed, const std::vector<char>& rec, long n) {
+  amb_dispatch_fn fn = typed ? Bench::dispatch : c_dispatch;
+  char* cur = (char*)rec.data();
+  char* end = cur + rec.size();
+  double t0 = now();
+  while (cur < end) {
+    int32_t size;
+    cur = (char*)read_zigzag_int(cur, &size);
+    cur++; // Type
+    struct amb_rpc_desc desc;
+    cur = amb_decode_rpc(cur, size - 1, &desc);
+    fn(desc.methodID, desc.args, desc.argsLen);
+  }
+  return (now() - t0) * 1e9 / (2.0 * n);
+}
+
+int main(int argc, char** argv) {
+  long n = argc > 1 ? atol(argv[1]) : 2000000;
+  memset(g_payload, 7, PAYLOAD);
+  static_assert(Bench::id<point> == POINT_ID && Bench::id<tput> == TPUT_ID, "method IDs");
+
+  new_buffer(4 * 1024 * 1024);
+  std::thread th(consumer);
+  std::vector<char> rec = build_record(n);
+
+  // Alternate, keeping the best of several runs of each:
+  double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+  for (int rep = 0; rep < 5; rep++) {
+    double r[4] = { run_send(false, n), run_send(true, n),
+                    run_dispatch(false, rec, n), run_dispatch(true, rec, n) };
+    for (int k = 0; k < 4; k++) if (r[k] < best[k]) best[k] = r[k];
+  }
+  g_stop = 1;
+  th.join();
+
+  printf("%-22s %10s %10s\n", "ns/message", "C", "typed");
+  printf("%-22s %10.2f %10.2f\n", "send (into ring)", best[0], best[1]);
+  printf("%-22s %10.2f %10.2f\n", "decode + dispatch", best[2], best[3]);
+  return 0;
+}
@@ -0,0 +1,268 @@
+// A typed, header-only C++17 layer over the C client (client.h).
+//
+// Declare a service once, as the list of functions implementing its
+// methods:
+//
+//   void startup();
+//   void tput(int64_t seq, ambrosia::bytes payload);
+//   using Throughput = ambrosia::service<32, startup, tput>;
+//
+// Method IDs are consecutive from the first template argument
+// (Throughput::id<tput> == 33).  Throughput::dispatch is an
+// amb_dispatch_fn whose table of methods is built at compile time: it
+// decodes each method's arguments in place and calls it.  A proxy
+// sends to the service:
+//
+//   ambrosia::proxy<Throughput> remote("dest", 4);
+//   remote.send<tput>(seq, payload);
+//
+// which serializes the call straight into the ring (reserve_buffer),
+// sized exactly, and at compile time when every argument has a fixed
+// size.  Proxies send fire-and-forget RPCs.
+//
+// Argument types are encoded by ambrosia::codec.  Trivially copyable
+// types are copied bytewise, in host byte order; ambrosia::bytes and
+// std::string_view are length-prefixed, and decode as views into the
+// received log record (valid until the handler returns).
+// Specialize codec to add types.
+
+#ifndef AMBROSIA_HPP_HEADER
+#define AMBROSIA_HPP_HEADER
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "ambrosia/client.h"
+#include "ambrosia/internal/spsc_rring.h" // reserve_buffer, release_buffer
+
+namespace ambrosia {
+
+// A run of bytes passed by reference.
+struct bytes {
+  const void* data;
+  int32_t     len;
+};
+
+// Encoding of argument types
+// ------------------------------------------------------------
+
+namespace detail {
+[[noreturn]] inline void bad_args(const char* what, int len) {
+  std::fprintf(stderr, "ERROR: ambrosia::service, %s (%d bytes of args)\n", what, len);
+  std::abort();
+}
+}
+
+// The encoding of one argument type:
+//   fixed_size:  the encoded size, or -1 if it varies.
+//   size(v):     the encoded size of v.
+//   write(p, v): encode v at p, returning the byte following it.
+//   read(p, end): decode from p, advancing it.  Variable-size codecs
+//                check end; fixed-size ones are checked by the caller.
+template <class T, class Enable = void>
+struct codec;
+
+template <class T>
+struct codec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+  static constexpr int fixed_size = sizeof(T);
+  static constexpr int size(const T&) { return sizeof(T); }
+  static char* write(char* p, const T& v) {
+    std::memcpy(p, &v, sizeof(T));
+    return p + sizeof(T);
+  }
+  static T read(const char*& p, const char*) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+  }
+};
+
+namespace detail {
+// A zig-zag length prefix, then the bytes.
+struct blob_codec {
+  static constexpr int fixed_size = -1;
+  static int size(const void*, int32_t len) { return zigzag_int_size(len) + len; }
+  static char* write(char* p, const void* data, int32_t len) {
+    p = (char*)write_zigzag_int(p, len);
+    std::memcpy(p, data, len);
+    return p + len;
+  }
+  static const char* read(const char*& p, const char* end, int32_t* len) {
+    const char* start = (const char*)read_zigzag_int((void*)p, len);
+    if (start == NULL || start > end || *len < 0 || *len > end - start)
+      bad_args("length prefix runs past the end of the message", (int)(end - p));
+    p = start + *len;
+    return start;
+  }
+};
+}
+
+template <>
+struct codec<bytes> {
+  static constexpr int fixed_size = -1;
+  static int size(const bytes& v) { return detail::blob_codec::size(v.data, v.len); }
+  static char* write(char* p, const bytes& v) { return detail::blob_codec::write(p, v.data, v.len); }
+  static bytes read(const char*& p, const char* end) {
+    bytes v;
+    v.data = detail::blob_codec::read(p, end, &v.len);
+    return v;
+  }
+};
+
+template <>
+struct codec<std::string_view> {
+  static constexpr int fixed_size = -1;
+  static int size(std::string_view v) { return detail::blob_codec::size(v.data(), (int32_t)v.size()); }
+  static char* write(char* p, std::string_view v) {
+    return detail::blob_codec::write(p, v.data(), (int32_t)v.size());
+  }
+  static std::string_view read(const char*& p, const char* end) {
+    int32_t len;
+    const char* s = detail::blob_codec::read(p, end, &len);
+    return std::string_view(s, len);
+  }
+};
+
+namespace detail {
+
+// The (decayed) parameter types of a method, as a std::tuple.
+template <class F> struct fn_traits;
+template <class R, class... A> struct fn_traits<R (*)(A...)> {
+  using params = std::tuple<std::decay_t<A>...>;
+};
+template <class R, class... A> struct fn_traits<R (*)(A...) noexcept> {
+  using params = std::tuple<std::decay_t<A>...>;
+};
+
+template <class... A>
+constexpr bool all_fixed = ((codec<A>::fixed_size >= 0) && ...);
+
+template <class... A>
+constexpr int fixed_total = (0 + ... + (codec<A>::fixed_size >= 0 ? codec<A>::fixed_size : 0));
+
+// Compares functions (of any type) at compile time.
+template <auto V> struct tag {};
+
+template <auto Fn, auto... Fns>
+constexpr int index_of() {
+  constexpr bool match[] = { std::is_same_v<tag<Fn>, tag<Fns>>... };
+  for (int i = 0; i < (int)sizeof...(Fns); i++)
+    if (match[i]) return i;
+  return -1;
+}
+
+template <bool Checked, class A>
+inline A read_arg(const char*& p, const char* end) {
+  if constexpr (Checked && codec<A>::fixed_size >= 0)
+    if (end - p < codec<A>::fixed_size) bad_args("message too short", (int)(end - p));
+  return codec<A>::read(p, end);
+}
+
+template <auto Fn, class... A>
+inline void invoke(const char* p, const char* end, std::tuple<A...>*) {
+  constexpr bool fixed = all_fixed<A...>;
+  if constexpr (fixed)
+    if (end - p < fixed_total<A...>) bad_args("message too short", (int)(end - p));
+  // Braced initialization evaluates the reads left to right:
+  std::tuple<A...> args{ read_arg<!fixed, A>(p, end)... };
+  std::apply(Fn, args);
+}
+
+// The dispatch table entry for one method.
+template <auto Fn>
+void thunk(void* args, int argsLen) {
+  const char* p = (const char*)args;
+  invoke<Fn>(p, p + argsLen, (typename fn_traits<decltype(Fn)>::params*)nullptr);
+}
+
+} // namespace detail
+
+
+// Services
+// ------------------------------------------------------------
+
+template <int32_t FirstID, auto... Fns>
+struct service {
+  static_assert(sizeof...(Fns) > 0, "a service needs at least one method");
+
+  // The method ID of Fn.
+  template <auto Fn>
+  static constexpr int32_t id = FirstID + detail::index_of<Fn, Fns...>();
+
+  template <auto Fn>
+  static constexpr bool has = detail::index_of<Fn, Fns...>() >= 0;
+
+  // Decode and call the method, as an amb_dispatch_fn.
+  static void dispatch(int32_t methodID, void* args, int argsLen) {
+    uint32_t i = (uint32_t)(methodID - FirstID);
+    if (i >= sizeof...(Fns)) {
+      std::fprintf(stderr, "ERROR: ambrosia::service, unknown method ID %d\n", methodID);
+      std::abort();
+    }
+    table[i](args, argsLen);
+  }
+
+ private:
+  static constexpr void (*table[])(void*, int) = { &detail::thunk<Fns>... };
+};
+
+
+// Proxies
+// ------------------------------------------------------------
+
+template <class Service>
+class proxy {
+ public:
+  // An empty destination ("", 0) sends to ourselves.
+  proxy(const char* dest, int32_t destLen) : dest_((char*)dest), destLen_(destLen) {}
+
+  // Send Fn(args...) to the destination.  The arguments convert to
+  // Fn's parameter types, as for a direct call.
+  template <auto Fn, class... Args>
+  void send(const Args&... args) const {
+    static_assert(Service::template has<Fn>, "not a method of this service");
+    using params = typename detail::fn_traits<decltype(Fn)>::params;
+    send_as<Fn>((params*)nullptr, args...);
+  }
+
+ private:
+  template <auto Fn, class... P, class... Args>
+  void send_as(std::tuple<P...>*, const Args&... args) const {
+    static_assert(sizeof...(P) == sizeof...(Args), "wrong number of arguments");
+    write<Fn, P...>(static_cast<const P&>(args)...);
+  }
+
+  template <auto Fn, class... P>
+  void write(const P&... args) const {
+    if (!attached_ && destLen_ != 0) {
+      attach_if_needed(dest_, destLen_);
+      attached_ = true;
+    }
+    int argsLen;
+    if constexpr (detail::all_fixed<P...>) {
+      constexpr int n = detail::fixed_total<P...>;
+      argsLen = n;
+    } else {
+      argsLen = (0 + ... + codec<P>::size(args));
+    }
+    char* start = reserve_buffer(5 + 1 + 5 + destLen_ + 1 + 5 + 1 + argsLen);
+    char* cur = (char*)amb_write_outgoing_rpc_hdr(start, dest_, destLen_, RetNone,
+                                                  Service::template id<Fn>, RpcFireAndForget, argsLen);
+    ((cur = codec<P>::write(cur, args)), ...);
+    release_buffer((int)(cur - start));
+  }
+
+  char*   dest_;
+  int32_t destLen_;
+  mutable bool attached_ = false;
+};
+
+} // namespace ambrosia
+
+#endif
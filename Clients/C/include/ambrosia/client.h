@@ -13,6 +13,10 @@
 
 // #include "ambrosia/internal/bits.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // -------------------------------------------------
 // Data formats used by the AMBROSIA "wire protocol"
 // -------------------------------------------------
@@ -42,7 +46,24 @@ enum MsgType { RPC=0,                       //
 	       InitialMessage=9,                  // Inner msg.
 	       UpgradeTakeCheckpoint=10,          // no data
 	       TakeBecomingPrimaryCheckpoint=11,  // no data
-	       UpgradeService=12                  // no data
+	       UpgradeService=12,                 // no data
+	       BecomingPrimary=15                 // no data
+};
+
+
+// The fireForget byte of an RPC (RpcType in the C# client).  Only
+// calls of type RpcReturnValue carry a return address.
+enum amb_rpc_type { RpcReturnValue=0,
+                    RpcFireAndForget=1,
+                    RpcImpulse=2
+};
+
+// The RPC_or_RetVal byte of an RPC message (ReturnValueTypes in the
+// C# client): zero for a call, otherwise the kind of return value.
+enum amb_ret_type { RetNone=0,
+                    RetValue=1,
+                    RetEmpty=2,
+                    RetException=3
 };
 
 
@@ -53,6 +74,7 @@ enum MsgType { RPC=0,                       //
 //------------------------------------------------------------------------------
 
 // FIXME: these should become PRIVATE to the library:
+// (The connections of the default runtime, see amb_runtime below.)
 extern int g_to_immortal_coord, g_from_immortal_coord;
 
 
@@ -89,7 +111,64 @@ void* amb_write_outgoing_rpc_hdr(void* buf, char* dest, int32_t destLen, char RP
 void* amb_write_outgoing_rpc(void* buf, char* dest, int32_t destLen, char RPC_or_RetVal,
 			     int32_t methodID, char fireForget, void* args, int argsLen);
 
-// Deprecated:
+// The same for a call that expects a return value: after the method
+// ID, the type byte is RpcReturnValue and the return address (sender,
+// the caller's own instance name) and sequence number follow.
+void* amb_write_outgoing_call_hdr(void* buf, char* dest, int32_t destLen, int32_t methodID,
+                                  char* sender, int32_t senderLen, int64_t seq, int argsLen);
+
+// The header of a return value (retType != RetNone) for call seq,
+// sent back to the caller at dest.  The value bytes follow.
+void* amb_write_return_value_hdr(void* buf, char* dest, int32_t destLen, char retType,
+                                 char* sender, int32_t senderLen, int64_t seq, int valueLen);
+
+// Scatter-gather sends
+// ------------------------------------------------------------
+
+// One fragment of an RPC's arguments.
+struct amb_iovec {
+  void* base;
+  int   len;
+};
+
+// USER DEFINED: called by the network thread once a fragment passed
+// by reference has been written to the socket, after which the
+// application may reuse or free it.
+typedef void (*amb_release_fn)(void* base, int len, void* arg);
+
+// Fragments at least this long are passed by reference, not copied.
+#define AMB_IOV_INLINE_MAX 4096
+
+// OR into fireForget to send this call's arguments uncompressed,
+// whatever amb_client_options.compressArgs says.
+#define AMB_NO_COMPRESS 0x40
+
+// Set in the fireForget byte on the wire (and in amb_rpc_desc, as
+// decoded) when an RPC's arguments are a compressed frame.  The
+// processing loop decompresses them, and clears it, before dispatch.
+// Only C clients of this version know it, so it is only sent to those
+// named in amb_client_options.compressTo.
+#define AMB_ARGS_COMPRESSED 0x20
+
+// Compressed arguments that claim to decompress to more than this
+// are rejected (see amb_compress_stats.rejected).
+#define AMB_MAX_UNPACKED_ARGS (1 << 30)
+
+// Send a fire-and-forget RPC (fireForget: RpcFireAndForget or
+// RpcImpulse) whose arguments are the concatenation of iovcnt
+// fragments, through the current runtime's ring.  Short fragments are
+// copied into the ring along with the header.  The rest are sent from
+// where they are, with no user-space copy, and each is then handed to
+// release(base, len, arg).  Until then it must not be modified.  If
+// release is NULL every fragment is copied, and the call returns with
+// none of them referenced.  Arguments that are compressed (see
+// amb_client_options.compressArgs) are copied in any case, and
+// released before the call returns.
+void amb_send_rpc_iov(char* dest, int32_t destLen, int32_t methodID, char fireForget,
+                      const struct amb_iovec* iov, int iovcnt,
+                      amb_release_fn release, void* arg);
+
+// Deprecated (see amb_send_rpc_iov):
 // Send an RPC without any extra copies of the args.  Performs TWO send syscalls.
 void amb_send_outgoing_rpc(void* tempbuf, char* dest, int32_t destLen, char RPC_or_RetVal,
 			   int32_t methodID, char fireForget, void* args, int argsLen);
@@ -102,13 +181,18 @@ void amb_recv_log_hdr(int sockfd, struct log_hdr* hdr);
 //------------------------------------------------------------------------------
 
 // USER DEFINED: FIXME: REPLACE W CALLBACK
+//
+// Writing the checkpoint into the ring buffer (reserve_buffer /
+// release_buffer) rather than directly to upfd keeps it in order with
+// the outgoing RPCs queued before it.
 extern void send_dummy_checkpoint(int upfd);
 
 // USER-DEFINED: FIXME: turn into a callback (currently defined by application):
 extern void amb_dispatch_method(int32_t methodID, void* args, int argsLen);
 
 
-// TEMP - audit me - need to add a hash table to track attached destinations:
+// Send AttachTo before the first message to a destination (once per
+// destination and runtime):
 void attach_if_needed(char* dest, int destLen);
 
 //------------------------------------------------------------------------------
@@ -130,7 +214,8 @@ void attach_if_needed(char* dest, int destLen);
 //
 // ARG: bufSz: the size of the buffer used to buffer small messages on
 //      their way to the ImmortalCoordinator.  If this is zero, or
-//      negative, a default is used.
+//      negative, a default is used.  Messages too large for this
+//      buffer are still permitted; they are sent out-of-band.
 //
 // ARG: 
 //
@@ -139,6 +224,310 @@ void attach_if_needed(char* dest, int destLen);
 // EFFECTS:
 void amb_initialize_client_runtime(int upport, int downport, int bufSz);
 
+// Flags for amb_client_options.ringFlags:
+//
+// Map the ring's memory twice, back to back, so that no message or
+// send ever straddles the wrap-around point (Linux only).
+#define AMB_RING_MIRRORED  1
+// Back the ring with huge pages: reserved hugetlbfs pages if there
+// are any, otherwise a transparent-huge-page hint (with a warning).
+#define AMB_RING_HUGEPAGES 2
+
+// An incoming RPC, decoded but not yet dispatched.  The args pointer
+// refers into the received log record, and is valid only until the
+// dispatch callback returns.
+struct amb_rpc_desc {
+  int32_t methodID;
+  char    rpcOrRetVal; // An amb_ret_type; RetNone for a call.
+  char    fireForget;  // An amb_rpc_type.
+  int     argsLen;
+  void*   args;
+  // Present only for calls that expect a return value (RpcReturnValue):
+  // where to send it, and the caller's sequence number to echo back.
+  char*   sender;      // NOT null terminated.  Refers into the log record.
+  int32_t senderLen;
+  int64_t seq;
+};
+
+// Decode one RPC message, given the len bytes following its size and
+// type, into desc (without dispatching it).
+//
+// RETURN: a pointer to the byte following the message.
+char* amb_decode_rpc(char* buf, int len, struct amb_rpc_desc* desc);
+
+// USER DEFINED (optional): receives a run of consecutive RPCs from one
+// log record, in log order.  See amb_client_options.dispatchBatch.
+typedef void (*amb_dispatch_batch_fn)(struct amb_rpc_desc* rpcs, int count);
+
+// Per-runtime replacements for amb_dispatch_method and
+// send_dummy_checkpoint (see amb_client_options).
+typedef void (*amb_dispatch_fn)(int32_t methodID, void* args, int argsLen);
+typedef void (*amb_checkpoint_fn)(int upfd);
+
+// USER DEFINED (optional): see amb_client_options.snapshot.
+typedef void (*amb_snapshot_fn)(void);
+
+// USER DEFINED (optional): see amb_client_options.load.
+typedef void (*amb_load_fn)(int downfd, int64_t len);
+
+// USER DEFINED (optional): see amb_client_options.becomingPrimary.
+typedef void (*amb_primary_fn)(void);
+
+// USER DEFINED (optional): see amb_client_options.upgrade.
+struct amb_client_options;
+typedef void (*amb_upgrade_fn)(struct amb_client_options* opts);
+
+// What the network progress thread knows when it decides whether to
+// send (amb_client_options.flushPolicy).
+struct amb_flush_state {
+  int     sliceBytes;  // Ready to go in one system call,
+  int64_t queuedBytes; // of those queued in the ring (at least sliceBytes).
+  int64_t oldestNs;    // How long the oldest of them has waited, at most.
+  int64_t sinceSendNs; // Since the last send.
+  const struct amb_client_options* options; // The runtime's.
+};
+
+// USER DEFINED (optional): see amb_client_options.flushPolicy.
+//
+// RETURN: how many of st->sliceBytes to send now; 0 to wait.
+typedef int (*amb_flush_fn)(const struct amb_flush_state* st);
+
+// Socket option profiles (amb_client_options.socketProfile):
+#define AMB_SOCKETS_DEFAULT    0 // The kernel's defaults (Nagle's algorithm on).
+#define AMB_SOCKETS_LATENCY    1 // Send and acknowledge at once; busy-poll.
+#define AMB_SOCKETS_THROUGHPUT 2 // Large buffers; send full segments.
+
+// Priority lanes (amb_client_options.lanes):
+#define AMB_MAX_LANES 4                // Counting lane 0, the main ring.
+#define AMB_LANE_QUANTUM (16 * 1024)   // Bytes per round, per unit of weight.
+
+// Optional settings for the client runtime.  Always initialize these
+// with amb_default_client_options, then override individual fields.
+struct amb_client_options {
+  int bufSz;     // As in amb_initialize_client_runtime.
+  int ringFlags; // Bitwise OR of AMB_RING_* flags.  Default: 0.
+
+  // Two-phase dispatch: first decode every RPC in a received log
+  // record into an array of descriptors (prefetching their
+  // arguments), then dispatch them.  Non-RPC messages within the
+  // record still take effect in log order.  Default: 0 (off).
+  int twoPhaseDispatch;
+
+  // If non-NULL, implies two-phase dispatch, and each run of decoded
+  // RPCs is handed to this function in one call instead of calling
+  // amb_dispatch_method once per RPC.  Default: NULL.
+  amb_dispatch_batch_fn dispatchBatch;
+
+  // Pipelined receive: a dedicated thread reads log records off the
+  // socket into a queue while the application thread dispatches the
+  // ones before them, overlapping network waits with handler
+  // execution.  Records are still dispatched in log order.
+  int receiveThread;  // Default: 0 (off).
+  int receiveDepth;   // Max records read ahead.  Default (<= 0): 8.
+
+  // Drive both connections from one thread with io_uring (Linux 6.0
+  // or later), instead of the network progress and receive threads:
+  // records are read with a multishot receive into kernel-provided
+  // buffers, and the outbound ring is sent with few, batched
+  // submissions.  Records are queued as with receiveThread (up to
+  // receiveDepth).  Falls back to threads with a warning if io_uring
+  // is unavailable.  Default: 0 (off).
+  int ioUring;
+
+  // Callbacks for this runtime.  Where NULL, the application's global
+  // amb_dispatch_method and send_dummy_checkpoint are used, which a
+  // process hosting several immortals need not define.
+  amb_dispatch_fn   dispatch;   // Default: NULL.
+  amb_checkpoint_fn checkpoint; // Default: NULL.
+  void* userData; // Returned by amb_runtime_user_data.  Default: NULL.
+
+  // Share one network progress thread among all the runtimes created
+  // with this option, instead of starting one per runtime.  It sends
+  // for each of them in turn.  Default: 0 (off).
+  int sharedIoThread;
+
+  // This immortal's registered name, which amb_call_rpc sends as the
+  // return address.  NULL (or "") directs return values to ourselves,
+  // which suffices only for calls to ourselves.  Default: NULL.
+  char* instanceName;
+
+  // Copy-on-write checkpoints: on TakeCheckpoint, fork, and run the
+  // checkpoint callback in the child process, against a frozen copy of
+  // the application's state, while the processing loop carries on.
+  // The checkpoint still reaches the coordinator in order with the
+  // outgoing messages around it.  In the child the callback's upfd is
+  // a local socket, and the ring (reserve_buffer) is the child's own.
+  // It must not rely on other threads, which do not exist there.
+  // Not supported on Windows.  Default: 0 (off).
+  int forkCheckpoint;
+
+  // Called on the processing thread at the moment a TakeCheckpoint's
+  // state is captured: just before the checkpoint callback, or, with
+  // forkCheckpoint, before the fork, in the parent.  This is where
+  // incremental checkpoints reset their record of what has changed
+  // (amb_arena_snapshot).  Default: NULL.
+  amb_snapshot_fn snapshot;
+
+  // Compression (see ambrosia/compress.h).  Arguments of at least
+  // compressArgs bytes sent with amb_send_rpc_iov go as a compressed
+  // frame, unless they do not shrink, or the call says AMB_NO_COMPRESS.
+  // Such RPCs are marked AMB_ARGS_COMPRESSED in their RPC type byte,
+  // which only C clients of this version understand (and decompress,
+  // whatever their own setting): any other immortal, such as a C# one
+  // or an older C client, would take it for an unknown RPC type.  So
+  // only calls to the immortal itself, and to the destinations named
+  // in compressTo, are compressed.  Default: 0 (off).
+  int compressArgs;
+  // The instance names of the destinations that are C clients of this
+  // version, as a NULL-terminated array, which must outlive the
+  // runtime.  Default: NULL (none).
+  const char* const* compressTo;
+
+  // Compress checkpoints written with amb_checkpoint_begin.  Whatever
+  // reads them back must use amb_zreader_open.  Default: 0 (off).
+  int compressCheckpoints;
+
+  // Recovery: when the coordinator starts the immortal from its last
+  // checkpoint, this is called to read it (len bytes, as the
+  // checkpoint callback wrote them) from downfd, before any logged
+  // calls are replayed.  amb_arena_load(downfd, len), for instance.
+  // Without it, recovery fails.  Default: NULL.
+  amb_load_fn load;
+
+  // Called on the processing thread once a recovering immortal becomes
+  // the primary, after the last replayed call and before the first new
+  // one: the place to resume work that only the primary does (timers,
+  // calls the immortal initiates).  Not called on a first start.
+  // Default: NULL.
+  amb_primary_fn becomingPrimary;
+
+  // Live upgrade: the process carries both versions of the service,
+  // and runs the old one (from its checkpoint and logged calls) until
+  // the coordinator says UpgradeService, or UpgradeTakeCheckpoint at
+  // the end of replay.  Then this is called, on the processing thread,
+  // to migrate the state to the new version's layout and switch opts
+  // to the new version's callbacks (dispatch, dispatchBatch,
+  // checkpoint, snapshot, load, becomingPrimary and upgrade itself;
+  // other changes are ignored).  The next logged call runs on the new
+  // code, and on UpgradeTakeCheckpoint the migrated state is
+  // checkpointed and the immortal becomes the primary.  Without it,
+  // an upgrade fails.  Default: NULL.
+  amb_upgrade_fn upgrade;
+
+  // Ride out a lost connection to the coordinator (a restart of it,
+  // say) instead of aborting: wait up to this long for it to come
+  // back, reconnect, and carry on with the state in memory.  The
+  // coordinator recovers as usual, sending the last checkpoint and
+  // replaying the log after it; the checkpoint is skipped, and so is
+  // every call this process already handled, whose outputs are sent
+  // again from a copy kept since the last checkpoint (so that the
+  // coordinator's numbering of them still matches).  Only the calls
+  // that never arrived run.  If that is impossible (the coordinator
+  // lost the last checkpoint, or one was being sent), the process
+  // aborts, and recovers from scratch as before.  Not with ioUring or
+  // sharedIoThread, nor on Windows.  Default: 0 (off).
+  int reconnectTimeoutMs;
+
+  // Let amb_runtime_shutdown, called from another thread, stop the
+  // processing loop while it waits for the next log record.  The loop
+  // then waits on the socket and a wake-up descriptor together: a
+  // system call more per record, when not using receiveThread or
+  // ioUring.  amb_shards_start sets it.  Default: 0 (off).
+  int asyncShutdown;
+
+  // Thread placement: the CPU to pin each of the runtime's threads to,
+  // or -1 to leave it to the scheduler.  progressCpu applies to the
+  // network progress thread, or the io_uring thread standing in for
+  // it, or the shared one (as set by the runtime that starts it).
+  // appCpu applies to the thread that creates the runtime, which
+  // normally goes on to run the processing loop.  Default: -1.
+  int progressCpu;
+  int receiveCpu;
+  int appCpu;
+
+  // The NUMA node to allocate the ring buffer's memory on (Linux),
+  // normally that of progressCpu and appCpu.  -1: the kernel's choice,
+  // usually the node of the first thread to touch each page.
+  // Default: -1.
+  int ringNode;
+
+  // Run the progress and receive threads under SCHED_FIFO at this
+  // priority (1-99; on Windows, at time-critical priority), so that
+  // ordinary threads do not preempt them.  This needs CAP_SYS_NICE or
+  // an RLIMIT_RTPRIO allowance; without it, the runtime warns and
+  // carries on.  These threads spin while waiting, so give each a CPU
+  // of its own, or they starve whatever shares it.  Default: 0 (off).
+  int realtimePriority;
+
+  // How to tune the connections to the coordinator (AMB_SOCKETS_*):
+  //  * LATENCY: TCP_NODELAY, so that small messages leave at once;
+  //    TCP_QUICKACK, renewed after each record received, so that the
+  //    coordinator's sends do not wait on delayed acknowledgments; and
+  //    (Linux) 50 us of SO_BUSY_POLL on the receiving socket, which
+  //    spins on the device queue rather than sleep between records.
+  //  * THROUGHPUT: TCP_NODELAY, 4 MB send and receive buffers, and
+  //    (Linux) the network progress thread sends with MSG_MORE while
+  //    more is queued behind the slice it sends, so that the kernel
+  //    fills whole segments and pushes only the last.
+  // Options the system refuses are skipped with a warning.
+  // Default: AMB_SOCKETS_DEFAULT.
+  int socketProfile;
+
+  // Overrides for the profile's SO_SNDBUF and SO_RCVBUF, and for its
+  // SO_BUSY_POLL (microseconds).  0: the profile's.  Default: 0.
+  int socketBufBytes;
+  int busyPollUs;
+
+  // Flush policy: when the network progress thread sends what the ring
+  // holds.  By default it sends whatever it finds, at once.  With
+  // flushMinBytes, it waits until that much is queued, or until the
+  // oldest of it has waited flushLingerUs, which bounds the added
+  // latency.  With flushMaxBytes, no one send is larger, so that a
+  // burst does not hold up what is queued behind it for long.  Ages
+  // come from timestamps taken as messages are released into the ring
+  // (a clock read per message).  Not with ioUring, which ignores
+  // these (with a warning) and sends whatever it finds.
+  int flushMinBytes; // Default: 0.
+  int flushLingerUs; // Default (<= 0): 100, when flushMinBytes is set.
+  int flushMaxBytes; // Default: 0 (no limit).
+
+  // Or decide each time: this replaces the policy above, and may use
+  // its settings (st->options).  Default: NULL.
+  amb_flush_fn flushPolicy;
+
+  // Priority lanes: this many rings of laneBufSz bytes beside the main
+  // one (lane 0), which the application picks between with
+  // amb_set_lane.  The network progress thread takes turns between
+  // them, switching only between messages, so that urgent traffic
+  // waits for at most one message of bulk traffic, not for all of it.
+  // By default the turns go by strict priority: the highest numbered
+  // lane with something to send goes first.  If any laneWeights are
+  // set, by weighted round robin instead: each lane sends about
+  // laneWeights[lane] (at least 1) times AMB_LANE_QUANTUM bytes per
+  // round.  Messages keep their order within a lane, not across lanes,
+  // so send everything for one destination through one lane.  What
+  // has been sent may still queue in the socket's send buffer, which a
+  // smaller socketBufBytes bounds.  Checkpoints always go through lane
+  // 0, in order with everything: the other lanes are sent up to the
+  // point where it was taken, and then wait until it has been sent.
+  // Not with ioUring, sharedIoThread or reconnectTimeoutMs; the flush
+  // policy is ignored.  Default: 0 (off).
+  int lanes;                      // At most AMB_MAX_LANES - 1.
+  int laneBufSz;                  // Default (<= 0): 1 MB.
+  int laneWeights[AMB_MAX_LANES]; // Default: all 0 (strict priority).
+};
+
+// Fill in the default settings.
+void amb_default_client_options(struct amb_client_options* opts);
+
+// PHASE 1/3 (alternative)
+//
+// The same as amb_initialize_client_runtime, but takes the full set of
+// options.  Requests that are not supported on this platform fall
+// back to the default behavior with a warning.
+void amb_initialize_client_runtime_opts(int upport, int downport,
+                                        const struct amb_client_options* opts);
+
 // PHASE 2/3
 //
 // The heart of the runtime: enter the processing loop.  Read log
@@ -156,9 +545,331 @@ void amb_normal_processing_loop();
 // It does NOT transfer control away from the current function
 // (longjmp), rather it returns to the caller, which is expected to
 // return normally to the event handler loop.
+//
+// The signal is consumed when the loop exits, so that the loop may be
+// entered again later.
 void amb_shutdown_client_runtime();
 
 
+// Multiple runtimes per process
+// ------------------------------------------------------------
+// Each amb_runtime is one immortal: its own coordinator connections,
+// ring buffer, options and callbacks.  The functions above act on the
+// runtime that is current for the calling thread, which is the one
+// whose processing loop (or creation) is running on it, or else the
+// first runtime created with amb_initialize_client_runtime(_opts).
+// So handlers written against the single-instance API, including
+// reserve_buffer/release_buffer, work unchanged under any runtime.
+
+typedef struct amb_runtime amb_runtime;
+
+// Connect to a coordinator and start a runtime, as in
+// amb_initialize_client_runtime_opts, without making it the default.
+amb_runtime* amb_runtime_create(int upport, int downport,
+                                const struct amb_client_options* opts);
+
+// Run the runtime's processing loop on the calling thread, until
+// amb_runtime_shutdown.  Each runtime needs a thread of its own here.
+void amb_runtime_processing_loop(amb_runtime* rt);
+
+// Signal the runtime's processing loop to exit, after the log record
+// it is handling.  From another thread, it stops a loop waiting for
+// the next record only with asyncShutdown (or receiveThread or
+// ioUring); otherwise the loop exits once that record arrives.
+void amb_runtime_shutdown(amb_runtime* rt);
+
+// Attach to a destination before sending to it (once per destination).
+void amb_runtime_attach(amb_runtime* rt, char* dest, int destLen);
+
+// The runtime current for the calling thread, or NULL.
+amb_runtime* amb_current_runtime();
+
+// The options.userData the runtime was created with.
+void* amb_runtime_user_data(amb_runtime* rt);
+
+
+// Whether the current (or default) runtime is replaying: re-executing
+// logged calls after restoring a checkpoint, until the coordinator
+// makes it the primary.  Handlers may skip work whose only effects are
+// outside the immortal's state (metrics, notifications, caches that
+// can be rebuilt), which would otherwise be redone for every replayed
+// call.
+int amb_is_replaying();
+
+struct amb_replay_stats {
+  int64_t loadBytes;   // The checkpoint recovered from,
+  int64_t loadNs;      // and the time the load callback took.
+  int64_t replayed;    // Calls dispatched while replaying,
+  int64_t replayNs;    // over this long, from the end of the load until promotion.
+  int64_t promoteNs;   // Handling the promotion (including becomingPrimary),
+                       // which is all the failover time on this side of a
+                       // recovery that had caught up with the log beforehand.
+};
+
+// A snapshot of the statistics for the current (or default) runtime:
+// all zero on a first start.
+void amb_get_replay_stats(struct amb_replay_stats* out);
+
+struct amb_upgrade_stats {
+  int64_t upgrades;      // UpgradeService and UpgradeTakeCheckpoint messages handled.
+  int64_t lastMigrateNs; // The upgrade callback, for the last one,
+  int64_t lastWindowNs;  // and all of its handling: calls waited this long.
+  int64_t maxWindowNs;
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+void amb_get_upgrade_stats(struct amb_upgrade_stats* out);
+
+struct amb_reconnect_stats {
+  int64_t reconnects;     // Connections lost and resumed.
+  int64_t lastOutageNs;   // From losing the last one until reconnected.
+  int64_t skipped;        // Replayed log records skipped, as already handled,
+  int64_t resentBytes;    // and the bytes of output sent again for them.
+  int64_t retainedBytes;  // Output kept since the last checkpoint, now.
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+void amb_get_reconnect_stats(struct amb_reconnect_stats* out);
+
+
+// Flush statistics
+// ------------------------------------------------------------
+// The sends of the network progress thread, as the flush policy
+// shaped them.
+
+#define AMB_FLUSH_SIZE_BUCKETS 8
+
+struct amb_flush_stats {
+  int64_t sends;        // System calls that sent from the ring,
+  int64_t bytes;        // and the bytes they sent.
+  int64_t maxSendBytes;
+  // Sends by size: under 256 bytes, then under 4 times as many for
+  // each bucket after, up to the last, of 1 MB and more:
+  int64_t sizeHist[AMB_FLUSH_SIZE_BUCKETS];
+  int64_t lastAgeNs;    // How long the oldest bytes of the last send waited,
+  int64_t maxAgeNs;     // at most.  Only with a flush policy set.
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+void amb_get_flush_stats(struct amb_flush_stats* out);
+
+
+// Priority lanes
+// ------------------------------------------------------------
+// (amb_client_options.lanes.)  Everything the application sends goes
+// through the lane last selected: calls, return values, and the
+// AttachTo that precedes the first call to a destination.
+
+// Send what the calling thread sends from now on through the given
+// lane (0 to amb_client_options.lanes) of the current (or default)
+// runtime.  RETURN: the lane it replaces.
+int amb_set_lane(int lane);
+
+struct amb_lane_stats {
+  int64_t sends[AMB_MAX_LANES]; // System calls that sent from each lane,
+  int64_t bytes[AMB_MAX_LANES]; // and the bytes they sent.
+  int64_t switches;             // Sends from another lane than the last.
+  int64_t checkpointHolds;      // Checkpoints the lanes were held back for.
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+void amb_get_lane_stats(struct amb_lane_stats* out);
+
+
+// Flow control
+// ------------------------------------------------------------
+// Sending waits, spinning, while the current runtime's ring is full.
+// An event-driven application can instead reserve with
+// try_reserve_buffer (spsc_rring.h), which returns NULL rather than
+// wait, and then do other work until told that the network progress
+// thread has drained enough of the ring.  Everything else that sends
+// (amb_send_rpc_iov, amb_call_rpc, ...) still waits, as long as it
+// takes; amb_get_ring_occupancy tells beforehand whether it might.
+
+struct amb_ring_occupancy {
+  int64_t usedBytes;   // Released into the ring and not yet sent,
+  int64_t capacity;    // of this many.
+  int     queuedLarge; // Large and by-reference messages queued beside it.
+  int64_t stalls;      // Reservations so far that had to wait.
+};
+
+// A snapshot of the current (or default) runtime's ring (with lanes,
+// that of the lane being sent to).
+void amb_get_ring_occupancy(struct amb_ring_occupancy* out);
+
+// USER DEFINED (optional): see amb_notify_space.
+typedef void (*amb_space_fn)(void* arg);
+
+// Ask to be told, once, when at least freeBytes of the current (or
+// default) runtime's ring (as above) are free (at most its capacity).  Then the
+// network progress thread calls fn(arg), if fn is not NULL, on its own
+// thread, and on Linux adds 1 to an eventfd, which an event loop can
+// poll and read.  Asking again replaces a request not yet answered.
+// A ring that is not mirrored (AMB_RING_MIRRORED) may need up to twice
+// a reservation's size free, since reservations there are contiguous.
+//
+// RETURN: the eventfd, the same one each time; -1 where there is none.
+int amb_notify_space(int64_t freeBytes, amb_space_fn fn, void* arg);
+
+
+// Checkpoint statistics
+// ------------------------------------------------------------
+// Checkpoints requested by TakeCheckpoint are timed twice: how long
+// they stopped the processing loop (the pause), and how long until
+// they were written out in full.
+
+struct amb_checkpoint_stats {
+  int64_t taken;        // Checkpoints started.
+  int64_t completed;    // ... and written out in full.
+  int64_t lastPauseNs;  // Processing loop stopped, for the last one.
+  int64_t maxPauseNs;
+  int64_t totalPauseNs;
+  int64_t lastWriteNs;  // From TakeCheckpoint until completed, for the last one.
+  int64_t lastBytes;    // The size of the last completed checkpoint.
+  int64_t totalBytes;
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+// Without forkCheckpoint, bytes count only what the callback wrote
+// through the ring (reserve_buffer), not to upfd directly.
+void amb_get_checkpoint_stats(struct amb_checkpoint_stats* out);
+
+
+// Checkpoint streams
+// ------------------------------------------------------------
+// A checkpoint callback may write its Checkpoint message (through the
+// current ring) as a stream of len bytes in as many pieces as suits it:
+//
+//   amb_checkpoint_writer* w = amb_checkpoint_begin(len, 0);
+//   amb_checkpoint_write(w, part1, len1);
+//   ...
+//   amb_checkpoint_end(w);
+//
+// The stream is compressed if compressCheckpoints is set, as it
+// arrives, and sent once complete; otherwise it is copied into the
+// ring as it arrives.
+
+typedef struct amb_checkpoint_writer amb_checkpoint_writer;
+
+// Start a checkpoint of len bytes.  flags: 0, or AMB_NO_COMPRESS.
+amb_checkpoint_writer* amb_checkpoint_begin(int64_t len, int flags);
+
+void amb_checkpoint_write(amb_checkpoint_writer* w, const void* p, int64_t len);
+
+// Finish the checkpoint, which must have received exactly its len
+// bytes, and free w.
+//
+// RETURN: the size of the checkpoint as sent.
+int64_t amb_checkpoint_end(amb_checkpoint_writer* w);
+
+
+// Compression statistics
+// ------------------------------------------------------------
+
+struct amb_compress_stats {
+  int64_t frames;          // Frames sent: RPC arguments and checkpoints,
+  int64_t rawBytes;        // their size before compression,
+  int64_t compressedBytes; // and after,
+  int64_t compressNs;      // and the time it took.
+  int64_t incompressible;  // Arguments sent as they were, as they did not shrink.
+  int64_t unpacked;        // Incoming arguments decompressed,
+  int64_t unpackedBytes;   // the bytes they produced,
+  int64_t decompressNs;    // and the time it took.
+  int64_t rejected;        // Incoming RPCs dropped, undispatched, as their
+                           // compressed arguments were malformed or too big.
+};
+
+// A snapshot of the statistics for the current (or default) runtime.
+// Checkpoints written in a forked process (forkCheckpoint) are not
+// counted.
+void amb_get_compress_stats(struct amb_compress_stats* out);
+
+
+// Request/response RPCs
+// ------------------------------------------------------------
+// A call sends an RPC that expects a return value, under a sequence
+// number unique within the runtime, and returns without waiting.
+// Its return value arrives later as an incoming message, which the
+// processing loop matches to the call and completes it, in log order
+// with the RPCs around it.  Many calls may be outstanding at once.
+//
+// Like reserve_buffer, these act on the current (or default) runtime,
+// and must be used from the thread that runs its processing loop (or,
+// before the loop starts, the thread that created it).
+//
+// Across recovery, sequence numbers must match the ones the
+// coordinator logged: the replayed handlers make their calls again,
+// and the logged return values answer them by sequence number.  The
+// runtime cannot write completion callbacks into a checkpoint, so the
+// application's checkpoint saves the counter and the outstanding
+// calls with its state, and its load callback restores them (see
+// amb_get_call_seq).  A return value for a call that is not
+// outstanding is ignored.
+
+// USER DEFINED: receives the return value for call seq.  retType is an
+// amb_ret_type.  The value refers into the received log record, and is
+// valid only until the callback returns.
+typedef void (*amb_result_fn)(int64_t seq, char retType, void* value, int valueLen, void* arg);
+
+// Call methodID at dest (attaching first, if needed) and have the
+// return value delivered to done(..., arg).
+//
+// RETURN: the call's sequence number (positive).
+int64_t amb_call_rpc(char* dest, int32_t destLen, int32_t methodID,
+                     void* args, int argsLen, amb_result_fn done, void* arg);
+
+// The result of a call, filled in when its return value arrives.  The
+// value is copied out of the log record, so it remains valid until
+// amb_future_release.  Other threads may poll done.
+struct amb_future {
+  volatile int done; // Set last, once the other fields are valid.
+  char    retType;
+  int64_t seq;
+  void*   value;
+  int     valueLen;
+};
+
+// The same as amb_call_rpc, but completes the (caller-owned) future.
+int64_t amb_call_rpc_future(char* dest, int32_t destLen, int32_t methodID,
+                            void* args, int argsLen, struct amb_future* fut);
+
+// Free the value held by a completed future.
+void amb_future_release(struct amb_future* fut);
+
+// The number of calls still awaiting their return values.
+int amb_outstanding_calls();
+
+// For the checkpoint callback: the last sequence number issued.
+int64_t amb_get_call_seq();
+
+// For the checkpoint callback: write the sequence numbers of up to max
+// outstanding calls to seqs, in no particular order.
+//
+// RETURN: how many calls are outstanding (which may be more than max).
+int amb_get_outstanding_seqs(int64_t* seqs, int max);
+
+// For the load callback, before any logged calls are replayed: carry
+// on numbering calls after seq, as saved by amb_get_call_seq.
+void amb_set_call_seq(int64_t seq);
+
+// For the load callback: have the return value for call seq, made
+// before the checkpoint, delivered to done(..., arg).
+void amb_expect_return(int64_t seq, amb_result_fn done, void* arg);
+
+// Send the return value for a call: seq and the return address come
+// from its amb_rpc_desc (sender, senderLen).
+void amb_send_return_value(char* dest, int32_t destLen, int64_t seq,
+                           char retType, void* value, int valueLen);
+
+// The call being dispatched on this thread, or NULL.  Within the
+// dispatch callback, a non-NULL sender means a return value is expected.
+const struct amb_rpc_desc* amb_current_call();
+
+// From within the dispatch callback: send the return value for the
+// call being dispatched.  Does nothing for fire-and-forget RPCs.
+void amb_reply(char retType, void* value, int valueLen);
+
+
 // ------------------------------------------------------------
 
 // Variable width, Zig-zag Signed Integer Encodings
@@ -181,6 +892,11 @@ void* read_zigzag_int(void* ptr, int32_t* ret);
 // This is very useful for determining how much space is needed for a size field.
 int zigzag_int_size(int32_t value);
 
+// The same three, for 64-bit integers (1-10 bytes):
+void* write_zigzag_long(void* ptr, int64_t value);
+void* read_zigzag_long(void* ptr, int64_t* ret);
+int zigzag_long_size(int64_t value);
+
 
 // Debugging
 //------------------------------------------------------------------------------
@@ -218,4 +934,8 @@ static inline void amb_debug_log(const char *format, ...)
 // the last error message from a system call.
 char* amb_get_error_string();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
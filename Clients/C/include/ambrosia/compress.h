@@ -0,0 +1,107 @@
+// A fast, LZ4-class compressor, and the self-describing frames the
+// client runtime wraps compressed RPC arguments and checkpoints in
+// (see amb_client_options.compressArgs and compressCheckpoints).
+//
+// A frame is a 16-byte header, a sequence of blocks, and an end mark,
+// all integers in native (little-endian) byte order:
+//
+//   header:  "AMBZ" (AMB_FRAME_MAGIC), version (1 byte), 3 reserved
+//            bytes, and the total uncompressed size (int64).
+//   block:   uncompressed size (uint32, 1..AMB_FRAME_BLOCK),
+//            compressed size (uint32, 0: the block is stored as is),
+//            then that many bytes.  A compressed block is a sequence
+//            in the LZ4 block format, with no references to earlier
+//            blocks, so each decodes on its own.
+//   end:     a uint32 zero.
+//
+// Incompressible blocks are stored, so a frame is never more than
+// AMB_FRAME_OVERHEAD bytes per block (plus the header and end mark)
+// larger than its contents.
+
+#ifndef AMB_COMPRESS_HEADER
+#define AMB_COMPRESS_HEADER
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AMB_FRAME_MAGIC    0x5a424d41 // "AMBZ"
+#define AMB_FRAME_VERSION  1
+#define AMB_FRAME_HEADER   16
+#define AMB_FRAME_OVERHEAD 8          // Per block.
+#define AMB_FRAME_BLOCK    (64*1024)  // Uncompressed bytes per block, at most.
+
+// The largest frame that len bytes can compress to.
+int64_t amb_compress_bound(int64_t len);
+
+// Compress len bytes at src into one frame at dst, which must hold
+// amb_compress_bound(len) bytes.
+//
+// RETURN: the size of the frame.
+int64_t amb_compress(const void* src, int64_t len, void* dst);
+
+// Whether the len bytes at src begin with a frame header.
+//
+// RETURN: the frame's uncompressed size, or -1 if it is not a frame.
+int64_t amb_frame_raw_size(const void* src, int64_t len);
+
+// Decompress the frame of len bytes at src into dst, which must hold
+// amb_frame_raw_size(src, len) bytes.  Fails (aborts) on a malformed
+// frame.
+//
+// RETURN: the number of bytes written to dst.
+int64_t amb_decompress(const void* src, int64_t len, void* dst);
+
+// The same, for frames that may be malformed: never writes past
+// amb_frame_raw_size bytes of dst.
+//
+// RETURN: the number of bytes written to dst, or -1 if the frame is
+// malformed.
+int64_t amb_try_decompress(const void* src, int64_t len, void* dst);
+
+// The most that a well-formed frame of len bytes can decompress to
+// (each block holds at most AMB_FRAME_BLOCK bytes, in at least
+// AMB_FRAME_OVERHEAD), to check a frame's claimed size against before
+// allocating it.  -1 if len is too short to be a frame.
+int64_t amb_frame_max_raw(int64_t len);
+
+
+// Streaming
+// ------------------------------------------------------------
+
+// Builds a frame in memory from input that arrives in pieces, without
+// first gathering it: each block is compressed as soon as it is full.
+typedef struct amb_zstream amb_zstream;
+
+amb_zstream* amb_zstream_begin();
+void amb_zstream_write(amb_zstream* z, const void* p, int64_t len);
+
+// Finish the frame, and free z.
+//
+// RETURN: the frame (free it), whose size is written to *len.
+char* amb_zstream_finish(amb_zstream* z, int64_t* len);
+
+// Reads len bytes on fd that may or may not be a frame, as they were
+// before compression: a checkpoint, for instance, whichever way it
+// was written.
+typedef struct amb_zreader amb_zreader;
+
+amb_zreader* amb_zreader_open(int fd, int64_t len);
+
+// The number of bytes there are to read: the frame's uncompressed
+// size, or len if it is not a frame.
+int64_t amb_zreader_size(amb_zreader* r);
+
+// Read exactly n bytes into dst, or fail (abort).
+void amb_zreader_read(amb_zreader* r, void* dst, int64_t n);
+
+// Free r, first reading the rest of the len bytes off fd.
+void amb_zreader_close(amb_zreader* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
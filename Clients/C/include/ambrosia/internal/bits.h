@@ -27,6 +27,39 @@ void amb_socket_send_all(int sock, const void* buf, size_t len, int flags) {
   }
 }
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+// The same, for a connection that may be lost: report it rather than
+// abort (or be killed by SIGPIPE).
+//
+// RETURN: 0, or -1 if the connection failed.
+static inline
+int amb_socket_try_send_all(int sock, const void* buf, size_t len, int flags) {
+  const char* cur = (const char*)buf;
+  while (len > 0) {
+    int n = send(sock, cur, len, flags | MSG_NOSIGNAL);
+    if (n <= 0) return -1;
+    cur += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Hint that the cache line at ptr will be read soon.
+static inline
+void amb_prefetch(const void* ptr) {
+#ifdef _WIN32
+  PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, ptr);
+#else
+  __builtin_prefetch(ptr, 0, 3);
+#endif
+}
+
 static inline
 void print_hex_bytes(FILE* fd, char* ptr, int len) {
   const int limit = 100; // Only print this many:
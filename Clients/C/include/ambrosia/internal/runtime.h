@@ -0,0 +1,167 @@
+// The state of one client runtime (struct amb_runtime), shared by the
+// library's translation units.  Applications only see it as an
+// opaque pointer.
+
+#ifndef AMB_RUNTIME_HEADER
+#define AMB_RUNTIME_HEADER
+
+#include "ambrosia/client.h"
+#include "ambrosia/internal/spsc_rring.h"
+
+#ifdef _WIN32
+  #define AMB_THREAD_LOCAL __declspec(thread)
+#else
+  #define AMB_THREAD_LOCAL __thread
+#endif
+
+// One received log record, waiting to be processed.
+struct amb_recv_slot {
+  struct log_hdr hdr;
+  char* buf;     // Reused across records, grown as needed.
+  int   bufsize;
+};
+
+// A call awaiting its return value (seq 0 marks a free slot).
+struct amb_call_slot {
+  int64_t seq;
+  amb_result_fn done;
+  void* arg;
+};
+
+// A destination sent AttachTo.
+struct amb_attached {
+  char* name; // Not NUL terminated.
+  int   len;
+  int   compress; // Listed in options.compressTo.
+};
+
+struct amb_runtime {
+  int upfd, downfd; // Connections to this immortal's coordinator.
+
+  // The destinations attached to so far, searched in order (there are
+  // few), starting with the last one found:
+  struct amb_attached* attached;
+  int attached_count, attached_cap;
+  int attached_last;
+
+  // Whether the application signaled the processing loop to exit.
+  volatile int terminating;
+  // With asyncShutdown, what amb_runtime_shutdown writes to, to wake a
+  // loop waiting for a record (a pipe, or on Windows a loopback UDP
+  // socket connected to itself); otherwise -1.
+  int wake_rd, wake_wr;
+
+  // Recovering from a checkpoint, until the coordinator says BecomingPrimary.
+  volatile int replaying;
+
+  // The options the runtime was created with, and the callbacks they
+  // resolve to:
+  struct amb_client_options options;
+  amb_dispatch_fn   dispatch;
+  amb_checkpoint_fn checkpoint;
+
+  // Outgoing messages, drained by this runtime's I/O thread:
+  struct rring ring;
+
+  // Priority lanes (options.lanes): rings beside the main one, which
+  // is lane 0, and the one the processing loop sends to (amb_set_lane).
+  struct rring lanes[AMB_MAX_LANES - 1];
+  struct rring* out;
+  int lane;
+  // The network progress thread's turns: the lane it last sent from,
+  // whether it stopped there within a message, and (weighted) the
+  // lane whose turn it is and each lane's remaining bytes.
+  int lane_last;
+  int lane_midmsg;
+  int lane_turn;
+  int64_t lane_credit[AMB_MAX_LANES];
+  // Set by the processing loop for a checkpoint: each lane sends only
+  // up to its cut, then lane 0 alone, until lane_hold_end.
+  volatile int lane_hold;
+  int64_t lane_cut[AMB_MAX_LANES];
+  volatile int64_t lane_hold_end;
+  struct amb_lane_stats lane_stats;
+
+  // Descriptors decoded from the current log record, reused across
+  // records (two-phase dispatch):
+  struct amb_rpc_desc* pending_rpcs;
+  int pending_count;
+  int pending_capacity;
+
+  // Received log records, filled by the receive thread or the io_uring
+  // engine, drained in log order by the processing loop.  Single
+  // producer, single consumer.  NULL when the loop receives inline.
+  struct amb_recv_slot* recv_slots;
+  int recv_nslots;        // One more than the usable depth.
+  volatile int recv_head; // Next slot to dispatch, written by the application thread.
+  volatile int recv_tail; // Next slot to fill, written by the producer.
+
+  void* uring; // io_uring engine state, if that engine is in use.
+
+  // Outstanding calls, by sequence number: an open-addressing table
+  // with linear probing, kept at most half full.
+  struct amb_call_slot* calls;
+  int calls_mask;  // Capacity - 1 (a power of two).  NULL table before the first call.
+  int calls_count;
+  int64_t next_seq;
+
+  // The RPC being dispatched, for amb_reply:
+  struct amb_rpc_desc* current_call;
+
+  // Written by the processing loop, except that forked checkpoints
+  // complete on the thread that sends them:
+  struct amb_checkpoint_stats ckpt_stats;
+
+  struct amb_compress_stats zstats;
+
+  struct amb_replay_stats replay_stats;
+  int64_t replay_start_ns; // When the checkpoint finished loading.
+
+  struct amb_upgrade_stats upgrade_stats;
+
+  // Resuming after a lost connection (reconnectTimeoutMs).  The network
+  // progress thread reconnects, and keeps a copy of what it sent since
+  // the last checkpoint: the bytes [retained_base, sent) of the
+  // outbound stream, counted as ring->produced counts them.
+  int upport, downport;
+  volatile int link_lost;    // Set by whichever thread sees the connection fail.
+  volatile int link_epoch;   // Advanced once reconnected.
+  int64_t sent;
+  char*   retained;
+  int64_t retained_base, retained_len, retained_cap;
+  volatile int64_t retain_mark;  // Where the last checkpoint ends in the stream,
+  volatile int retain_stream;    // and whether it is a stream still being sent (forkCheckpoint).
+  int64_t resent_mark;           // retain_mark when the connection was last resumed.
+  // The processing loop's position in the log (seqIDs, -1: none):
+  int64_t last_seq;       // The last record handled.
+  int64_t ckpt_next_seq;  // The first record after the last checkpoint.
+  int     resuming;       // Skipping records up to last_seq: 1 before the first, 2 after.
+  struct amb_reconnect_stats reconnect_stats;
+
+  // The flush policy in effect, NULL for none, and its record:
+  amb_flush_fn flush_policy;
+  int64_t flush_last_ns;
+  struct amb_flush_stats flush_stats;
+
+  // A request to be told of free space in the ring (amb_notify_space),
+  // answered by the I/O thread:
+  // The request's generation above AMB_SPACE_BYTES_BITS, and the free
+  // bytes asked for below them (0: none).
+  volatile int64_t space_wanted;
+  int64_t space_gen; // Of the last request; the application's own.
+  struct rring* space_ring;      // Of the lane sent to when asked.
+  amb_space_fn space_fn;
+  void* space_arg;
+  int   space_fd; // eventfd, or -1.
+
+  // Arguments decompressed for the descriptors awaiting dispatch
+  // (two-phase dispatch), freed once they have been dispatched:
+  char** unpacked;
+  int unpacked_count;
+  int unpacked_capacity;
+};
+
+// From the I/O thread: answer amb_notify_space, if the space is free.
+void amb_check_space(struct amb_runtime* rt);
+
+#endif
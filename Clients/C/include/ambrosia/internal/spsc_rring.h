@@ -1,24 +1,149 @@
-
 // Single-producer, single-consumer ring-buffer supporting
 // variable-sized byte range operations.
 
-// Currently, this is a VERY restrictive single-purpose data structure
-// that only supports ONE global ring buffer.
+// Each ring is a "struct rring".  The original, instance-free API is
+// kept at the bottom of this file: it operates on the calling thread's
+// current ring (see rring_set_current), or else the default ring.
 
 #ifndef SPSC_RRING_HEADER
 #define SPSC_RRING_HEADER
 
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Flags for rring_init:
+#define RRING_MIRRORED  1 // Map the ring's pages twice, back to back (Linux).
+#define RRING_HUGEPAGES 2 // Back the ring with huge pages where available.
+                          // Returned only for reserved (hugetlb) pages,
+                          // not for a transparent-huge-page hint.
+
+#define RRING_LARGE_QUEUE_SIZE 32 // Max outstanding large messages.
+#define RRING_STAMPS 64           // Max outstanding release timestamps.
+#define RRING_ENDS 64             // Max outstanding message boundaries.
+
+// Called by the consumer when it has popped all of a message that was
+// passed by reference (rring_release_ref).
+typedef void (*rring_done_fn)(void* ptr, int len, void* arg);
+
+// Called by the consumer at the end of a stream (rring_release_fd),
+// with the number of bytes read from it.
+typedef void (*rring_eof_fn)(int fd, int64_t bytes, void* arg);
+
+#define RRING_STREAM_CHUNK (64*1024) // Bytes read from a stream at a time.
+
+// Out-of-band (large) messages
+// ----------------------------
+// A message that cannot fit in the ring is written into its own heap
+// buffer, and a descriptor for it is queued alongside the ring.  The
+// descriptor records the ring position at which it was released, and
+// the consumer hands it out (by reference, no copy) exactly when
+// everything before that position has been popped.  The producer may
+// also queue bytes of its own this way (rring_release_ref), or the
+// contents of a file descriptor (rring_release_fd).
+struct rring_large {
+  char*   ptr;
+  int     len;
+  int     sent; // Consumer-private progress through ptr.
+  int64_t pos;  // Value of "released" when this was released.
+  rring_done_fn done; // NULL: ptr is ours, free it when popped.
+  void*   done_arg;
+  // A stream (fd >= 0) refills ptr, a buffer of RRING_STREAM_CHUNK
+  // bytes, from fd until end-of-file:
+  int     fd;
+  int64_t streamed;
+  rring_eof_fn eof;
+};
+
+// When the bytes from pos (in "released" coordinates) on were
+// released (see rring_set_stamping).
+struct rring_stamp {
+  int64_t pos;
+  int64_t ns;
+};
+
+// The state of one ring.  Zero-initialize, then call rring_init.
+struct rring {
+  char* buffer;
+  volatile int head; // Byte offset into buffer, written by consumer.
+  volatile int tail; // Byte offset into buffer, written by producer.
+  volatile int end;  // The current capacity, MODIFIED dynamically by PRODUCER.
+  int orig_end;      // Snapshot of the original buffer capacity.
+
+  // How the buffer was allocated, one of the RRING_* flag combinations:
+  int    flags;
+  size_t mapped; // Bytes mapped (not malloc'd), if any.
+
+  int last_reserved; // The number of bytes in the last reserve call (producer-private)
+
+  // Running totals of ring bytes (not counting the skipped space of an
+  // early wrap).  These give the producer and consumer a shared,
+  // never-wrapping coordinate for ordering out-of-band messages:
+  volatile int64_t released; // Written by producer.
+  volatile int64_t popped;   // Written by consumer.
+  int64_t produced; // All bytes released, out-of-band ones too (producer-private).
+
+  struct rring_large large_queue[RRING_LARGE_QUEUE_SIZE];
+  volatile int large_head; // Index of next descriptor, written by consumer.
+  volatile int large_tail; // Index of next free slot, written by producer.
+  char* large_reserved;    // The outstanding large reservation, if any (producer-private).
+  int   peeked_large;      // Did the last peek return a large message? (consumer-private)
+  int64_t stalls;          // Reservations that had to wait (producer-private).
+
+  // Release timestamps, if enabled: a queue written by the producer,
+  // of which the consumer keeps the one covering its position.
+  struct rring_stamp stamps[RRING_STAMPS];
+  volatile int stamp_head; // Written by consumer.
+  volatile int stamp_tail; // Written by producer.
+  int64_t stamp_every;     // Granularity in ns; 0: off (producer-private).
+
+  // Message boundaries, if enabled: a queue of the positions (in
+  // "produced" coordinates) at which messages end, written by the
+  // producer, and the latest of them.
+  int64_t ends[RRING_ENDS];
+  volatile int end_head;     // Written by consumer.
+  volatile int end_tail;     // Written by producer.
+  volatile int64_t last_end; // Written by producer.
+  int64_t end_every;         // Granularity in bytes; 0: off (producer-private).
+  int     open;              // Within rring_begin_message (producer-private).
+  int64_t consumed; // All bytes popped, as "produced" counts them (consumer-private).
+};
+
 // Buffer life cycle
 // ------------------------------------------------------------
 
-// Allocate a new buffer (presently: initialize global buffer)
-void new_buffer(int sz);
+// Allocate the ring's memory, optionally mapped specially.
+//
+// With RRING_MIRRORED, every reservation and every peek is a single
+// contiguous range, even across the wrap-around point, so the ring
+// never wraps early and peek never returns a split range.  The size
+// is rounded up to the (huge) page size.
+//
+// RETURN: the subset of the requested flags actually obtained.
+// Unsupported requests fall back to a plain malloc'd ring.
+int rring_init(struct rring* r, int sz, int flags);
+
+// Clear the buffer for reuse
+void rring_reset(struct rring* r);
 
-// Clear the (global) buffer for reuse
-void reset_buffer();
+// Release the memory used by the buffer.
+void rring_free(struct rring* r);
 
-// Release the memory used by the global buffer.
-void free_buffer();
+// The byte capacity the buffer was allocated with.  Reservations of
+// this size or larger are handled out-of-band (see rring_reserve).
+int rring_capacity(struct rring* r);
+
+// The memory backing the ring (both copies, if mirrored), so that it
+// can be registered with the kernel.  Writes its byte length to len.
+char* rring_region(struct rring* r, size_t* len);
+
+// Move the ring's memory to a NUMA node (Linux), and keep it there:
+// pages not yet touched are allocated there, and any already touched
+// are migrated.  RETURN: 0, or -1 if the kernel refused.
+int rring_bind_node(struct rring* r, int node);
 
 
 // Buffer operations
@@ -26,7 +151,7 @@ void free_buffer();
 
 // (Consumer) Free N bytes from the ring buffer, marking them as consumed and
 // allowing the storage to be reused.
-void  pop_buffer(int numread);
+void  rring_pop(struct rring* r, int numread);
 
 
 // (Consumer) Wait until a number of (contiguous) bytes is available within the
@@ -38,22 +163,143 @@ void  pop_buffer(int numread);
 // RETURN: the pointer P to the available bytes.
 // RETURN(param): set N to the (nonzero) number of bytes read.
 // POSTCOND: the permission to read N bytes from P
-// POSTCOND: the caller must use pop_buffer(N) to actually
+// POSTCOND: the caller must use rring_pop(N) to actually
 //          free these bytes for reuse.
 //
 // IDEMPOTENT! Only pop actually clears the bytes.
-char* peek_buffer(int* numread);
+char* rring_peek(struct rring* r, int* numread);
+
+// (Consumer) After a rring_peek that returned "first" bytes ending
+// at the wrap-around point, return the bytes that continue them from
+// the start of the ring, if any.  The consumer may then send both
+// ranges at once, and afterwards rring_pop each of them, in order.
+//
+// RETURN: the pointer, or NULL (with numread 0) if there is nothing
+// to add, e.g. if the first peek was not torn.
+char* rring_peek_next(struct rring* r, int first, int* numread);
+
+// (Consumer) Whether the last peek returned bytes read from a stream
+// (rring_release_fd), which "produced" does not count.
+int rring_peeked_stream(struct rring* r);
+
+// (Consumer) Whether more has been released behind the numread bytes
+// of the last peek, so that the consumer may hold them back to be sent
+// together.  Not counting streams, which may take a while to fill.
+int rring_peeked_more(struct rring* r, int numread);
 
 
 // (Producer) Grab a cursor for writing an (unspecified) number of bytes to the
 // tail of the buffer.  It's ok to RESERVE more than you ultimately USE.
-char* reserve_buffer(int len); 
+//
+// A request that does not fit in the ring (len >= rring_capacity())
+// is served from a separately allocated buffer instead.  Once
+// released, that message is handed to the consumer by reference, in
+// order with the ring's other contents, and freed when fully popped.
+// Thus the ring need not be sized for the largest message.
+char* rring_reserve(struct rring* r, int len); 
+
+// (Producer) The same, but instead of waiting for room (or for a
+// large-message descriptor), return NULL at once.  A non-NULL result
+// is released as usual.
+char* rring_try_reserve(struct rring* r, int len);
+
+// (Producer) Timestamp releases, so that the consumer can tell how
+// long the oldest of what it has yet to send has waited
+// (rring_oldest_ns).  Releases within everyNs of the last timestamp
+// share it, so ages may be overstated by that much; more than
+// RRING_STAMPS timestamps outstanding overstate them further.  0 turns
+// timestamps off.  Costs a clock read per release.
+void rring_set_stamping(struct rring* r, int64_t everyNs);
+
+// (Consumer) The release time (CLOCK_MONOTONIC ns, or the Windows
+// performance counter in ns) of the oldest bytes not yet popped, at
+// the earliest; 0 if unknown.  A large message may be dated by the
+// ring bytes released after it.
+int64_t rring_oldest_ns(struct rring* r);
+
+// The clock of the timestamps.
+int64_t rring_now_ns();
+
+// (Producer) Record where messages end, so that a consumer taking
+// turns between rings can switch only between messages
+// (rring_next_boundary).  A boundary within everyBytes of the last
+// one recorded only replaces the latest, so the consumer sees them
+// about that far apart, or further while RRING_ENDS are outstanding.
+// 0 turns this off.
+void rring_set_boundaries(struct rring* r, int64_t everyBytes);
+
+// (Producer) Releases between these make up one message, which has no
+// boundary within it.  Otherwise each release ends a message.
+void rring_begin_message(struct rring* r);
+void rring_end_message(struct rring* r);
+
+// (Consumer) The first boundary recorded after "consumed", up to which
+// the consumer may send without stopping within a message; -1 if none
+// is known yet, as within a message still being released.
+int64_t rring_next_boundary(struct rring* r);
+
+// Bytes released into the ring and not yet popped, and the number of
+// large or by-reference messages queued beside it.  Either side may
+// ask; the answer is a snapshot.
+int64_t rring_used(struct rring* r);
+int     rring_queued_large(struct rring* r);
 
 
 // (Producer) Add "len" bytes to the tail and release the buffer.
 // This number must be less than or equal to the amount reserved.
 // 
 // ASSUMPTION: only call release to COMPLETE a message:
+void  rring_release(struct rring* r, int len);
+
+// (Producer) Append the len bytes at ptr without copying them: they
+// are handed to the consumer by reference, like a large message, after
+// everything released before them.  Once they have all been popped the
+// consumer calls done(ptr, len, arg); until then they must not change.
+// Not allowed between rring_reserve and rring_release.  Waits while
+// RRING_LARGE_QUEUE_SIZE of these and large messages are outstanding.
+void  rring_release_ref(struct rring* r, char* ptr, int len, rring_done_fn done, void* arg);
+
+// (Producer) Append everything that can be read from fd, up to its
+// end-of-file, after everything released before it, without waiting
+// for it to be written.  fd must be non-blocking: the consumer reads
+// it as data arrives, and sees nothing else until it ends.  Then the
+// consumer calls eof(fd, bytes, arg), which owns fd.  Not supported on
+// Windows.  Otherwise as rring_release_ref.
+void  rring_release_fd(struct rring* r, int fd, rring_eof_fn eof, void* arg);
+
+
+// Current and default rings
+//--------------------------------------------------------------------------------
+
+// The ring that the legacy API below operates on for this thread.
+struct rring* rring_current();
+
+// Make r current for the calling thread (NULL: back to the default).
+void rring_set_current(struct rring* r);
+
+// Replace the process-wide default ring (NULL: the built-in one).
+void rring_set_default(struct rring* r);
+
+
+// Legacy API: each is the rring_* function of the same purpose,
+// applied to rring_current().
+//--------------------------------------------------------------------------------
+
+void  new_buffer(int sz);
+int   new_buffer_flags(int sz, int flags);
+void  reset_buffer();
+void  free_buffer();
+int   buffer_capacity();
+char* buffer_region(size_t* len);
+void  pop_buffer(int numread);
+char* peek_buffer(int* numread);
+char* peek_buffer_next(int first, int* numread);
+char* reserve_buffer(int len); 
+char* try_reserve_buffer(int len);
 void  release_buffer(int len);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,52 @@
+// Static tracepoints (USDT) on the client's hot paths, for perf and
+// bpftrace.
+//
+// Built with -DAMBCLIENT_TRACE ("make trace"), each AMB_TRACE below is
+// a <sys/sdt.h> probe: a single nop where it stands, plus an ELF note
+// naming it "ambrosia:<name>" and saying where its arguments are, so it
+// costs next to nothing until a tracer attaches.  Otherwise (and on
+// Windows) they compile to nothing: their arguments are cast to void,
+// so must have no side effects, and count as used.  To list them:
+//
+//   bpftrace -l 'usdt:bin/libambrosia.so:ambrosia:*'
+//
+// See tools/trace/ for scripts.  The probes, and their arguments:
+//
+//   record_received      seqID, payload bytes: a whole log record is
+//                        in (on the thread that receives)
+//   dispatch_begin       methodID, argument bytes: a handler is called
+//   dispatch_end         methodID: ... and has returned
+//   reserve_stall_begin  ring, bytes: a reservation waits for space
+//   reserve_stall_end    ring, bytes: ... and has it
+//   early_wrap           ring, bytes left unused at the end of the ring
+//   flush_begin          bytes: a send to the coordinator starts
+//   flush_end            bytes: ... and is done
+//   checkpoint_begin     (none): the coordinator asks for a checkpoint
+//   checkpoint_end       bytes written meanwhile (0 if forked): the
+//                        processing loop resumes
+//
+// The arguments are all integers (a ring is its address).  Handlers
+// run from dispatchBatch are not traced one by one.
+
+#ifndef AMB_TRACE_HEADER
+#define AMB_TRACE_HEADER
+
+#if defined(AMBCLIENT_TRACE) && !defined(_WIN32)
+  #if defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+      #include <sys/sdt.h>
+    #endif
+  #endif
+  #ifndef DTRACE_PROBE
+    #error "AMBCLIENT_TRACE needs <sys/sdt.h> (systemtap-sdt-dev, or systemtap-sdt-devel)"
+  #endif
+  #define AMB_TRACE0(name)       DTRACE_PROBE(ambrosia, name)
+  #define AMB_TRACE1(name, a)    DTRACE_PROBE1(ambrosia, name, a)
+  #define AMB_TRACE2(name, a, b) DTRACE_PROBE2(ambrosia, name, a, b)
+#else
+  #define AMB_TRACE0(name)       do {} while (0)
+  #define AMB_TRACE1(name, a)    do { (void)(a); } while (0)
+  #define AMB_TRACE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+// An io_uring-based I/O engine (Linux) that drives both coordinator
+// connections from a single thread, in place of the network progress
+// thread and the receive thread.
+
+#ifndef AMB_URING_ENGINE_HEADER
+#define AMB_URING_ENGINE_HEADER
+
+#include "ambrosia/internal/runtime.h"
+
+// The engine
+// ------------------------------------------------------------
+
+// Set up an io_uring instance for the runtime's two connected
+// sockets: fixed files for both, a ring of provided buffers for a
+// multishot receive on the down socket, and (if the kernel allows) the
+// outbound ring buffer registered for zero-copy sends.  Call after the ring and
+// the receive queue have been allocated.
+//
+// RETURN: 1 on success, or 0 (with a warning) if io_uring or one of
+// the required features is unavailable, in which case the caller
+// should fall back to the threaded engine.
+int amb_uring_init(struct amb_runtime* rt);
+
+// The engine thread, whose argument is the runtime: sends whatever
+// the producer releases into the outbound ring (as linked sends, when
+// the ring is torn), and reassembles received bytes into log records
+// on the receive queue.
+#ifdef _WIN32
+  extern DWORD WINAPI amb_uring_thread( LPVOID lpParam );
+#else
+  extern void*        amb_uring_thread( void* lpParam );
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+// Sharded services: one process running several immortals (shards) of
+// one partitioned service, each with its own coordinator connections,
+// ring and processing loop, on a thread of its own pinned to a core
+// (see "Multiple runtimes per process" in client.h).
+//
+// Each shard owns the keys that hash to it (amb_shard_of), and sends
+// calls about other keys to the shard that owns them, by name, as it
+// would to any other immortal.  A shard's state is only touched by its
+// own thread, so within a shard handlers run one at a time, in log
+// order, exactly as in a single immortal, and recovery replays each
+// shard on its own.  Shards share nothing but the calls between them.
+//
+//   static struct my_state g_state[MAX_SHARDS]; // One per shard.
+//
+//   void dispatch(int32_t methodID, void* args, int argsLen) {
+//     struct my_state* s = & g_state[amb_current_shard()];
+//     ...
+//     char dest[64];
+//     int len = amb_shard_route(dest, sizeof(dest), "kv", key, keyLen, nshards);
+//     amb_send_rpc_iov(dest, len, ...); // To the shard that owns key.
+//   }
+//
+//   struct amb_shard_options so;
+//   amb_default_shard_options(&so);
+//   so.shards    = nshards;
+//   so.service   = "kv";     // Shards "kv0", "kv1", ...
+//   so.upports   = upports;  // One coordinator per shard.
+//   so.downports = downports;
+//   amb_shards* g = amb_shards_start(&so, &opts);
+//   amb_shards_join(g);
+//
+// Each shard is registered with its coordinator under its own name.
+
+#ifndef AMB_SHARDS_HEADER
+#define AMB_SHARDS_HEADER
+
+#include <stdint.h>
+
+#include "ambrosia/client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct amb_shards amb_shards;
+
+struct amb_shard_options {
+  int shards; // How many.  Default: 1.
+
+  // Shard i is named service followed by i ("kv0", "kv1", ...), which
+  // is its instanceName.  Required.
+  const char* service;
+
+  // Shard i's coordinator ports.  Required.
+  const int* upports;
+  const int* downports;
+
+  // The CPU that shard i's processing loop is pinned to (-1: none).
+  // NULL: CPU i, for as many shards as there are CPUs.  The runtime
+  // options' progressCpu and receiveCpu apply to every shard as given.
+  // Default: NULL.
+  const int* cpus;
+
+  // Called on each shard's thread before its runtime starts (and so
+  // before its checkpoint is loaded), e.g. to set up its state.
+  // Default: NULL.
+  void (*init)(int shard);
+};
+
+// Fill in the default settings.
+void amb_default_shard_options(struct amb_shard_options* so);
+
+// Start every shard, each with the given runtime options (except for
+// instanceName and appCpu, which are the shard's), and return once
+// all of them are connected, with their processing loops running.
+amb_shards* amb_shards_start(const struct amb_shard_options* so,
+                             const struct amb_client_options* opts);
+
+// Signal every shard's processing loop to exit, each after the log
+// record it is handling or waiting for.
+void amb_shards_shutdown(amb_shards* g);
+
+// Wait until every shard's processing loop has exited, then free g.
+void amb_shards_join(amb_shards* g);
+
+int          amb_shards_count(amb_shards* g);
+amb_runtime* amb_shards_runtime(amb_shards* g, int shard);
+const char*  amb_shards_name(amb_shards* g, int shard);
+
+// The shard whose thread this is, or -1.
+int amb_current_shard();
+
+// Routing
+// ------------------------------------------------------------
+
+// The shard, of nshards, that owns a key: a jump consistent hash of
+// the key's 64-bit FNV-1a hash.  The same on every platform, and when
+// a service grows from n to n+1 shards, only 1/(n+1) of the keys move.
+int amb_shard_of(const void* key, int keyLen, int nshards);
+
+// Write the destination name of the shard of service that owns key to
+// buf, NUL terminated.  A shard's own keys give "": a call to itself,
+// which needs no AttachTo.
+//
+// RETURN: the name's length, the destLen to send to it.
+int amb_shard_route(char* buf, int bufLen, const char* service,
+                    const void* key, int keyLen, int nshards);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
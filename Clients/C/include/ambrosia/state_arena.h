@@ -0,0 +1,156 @@
+// An arena for an immortal's durable state, whose checkpoint is a raw
+// dump of its pages.
+//
+// The arena is one range of virtual memory, always mapped at the same
+// address, and everything the allocator knows (free lists, the root
+// object) lives inside it.  So state allocated from it may use plain
+// pointers, and a byte copy of the used part of the range is a
+// complete checkpoint: writing one streams memory as is, and loading
+// one reads it straight back into place, with no serialization pass.
+//
+//   amb_arena* a = amb_arena_create(1L << 34, NULL);
+//   struct my_state* s = amb_arena_alloc(a, sizeof(*s));
+//   amb_arena_set_root(a, s);
+//   ...
+//   void my_checkpoint(int upfd) { amb_arena_checkpoint(a); }
+//
+// and on recovery, given a checkpoint of len bytes on fd:
+//
+//   amb_arena* a = amb_arena_load(fd, len);
+//   struct my_state* s = amb_arena_root(a);
+//
+// Pointers must not lead out of the arena (to the heap, or to code,
+// which may move between runs).  An arena is not thread safe.
+//
+// The coordinator keeps only the latest checkpoint, so what it gets is
+// always a full image.  Beside it, each checkpoint may also append to
+// a local chain of images (amb_arena_track, amb_arena_chain): a full
+// one now and then, and in between, deltas holding only the pages
+// written since the previous checkpoint, which amb_arena_load_chain
+// reads back.
+
+#ifndef AMB_STATE_ARENA_HEADER
+#define AMB_STATE_ARENA_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct amb_arena amb_arena;
+
+// Where arenas are mapped, unless amb_arena_create is told otherwise:
+// far from where the heap, stacks and libraries usually go.
+#define AMB_ARENA_DEFAULT_BASE ((void*)0x200000000000ULL)
+
+// Reserve capacity bytes of address space at base (NULL: the default)
+// for a new, empty arena.  Memory is only committed as it is used.
+//
+// RETURN: the arena, which starts at base.  Fails (aborts) if that
+// range is already in use.
+amb_arena* amb_arena_create(size_t capacity, void* base);
+
+// Unmap the arena.  Pointers into it become invalid.
+void amb_arena_destroy(amb_arena* a);
+
+// Allocate n bytes, 16-byte aligned.  Aborts when the arena is full.
+void* amb_arena_alloc(amb_arena* a, size_t n);
+
+// Return a block from amb_arena_alloc (NULL is ignored).
+void amb_arena_free(amb_arena* a, void* p);
+
+// The application's entry point into its state, kept in the arena,
+// so that it survives a checkpoint.  NULL until set.
+void  amb_arena_set_root(amb_arena* a, void* p);
+void* amb_arena_root(amb_arena* a);
+
+// The number of bytes a checkpoint of the arena holds now.
+int64_t amb_arena_used(amb_arena* a);
+
+// From the checkpoint callback: write a Checkpoint message holding the
+// arena's used bytes, through the current ring (amb_checkpoint_begin,
+// so compressed if the runtime says so).  With a local chain
+// (amb_arena_chain), also append this checkpoint's image to it.
+void amb_arena_checkpoint(amb_arena* a);
+
+// Map an arena at the address it was checkpointed at, and read its
+// image (len bytes, as written by amb_arena_checkpoint, compressed or
+// not) from fd straight into place.
+//
+// RETURN: the arena.  Fails (aborts) on a malformed image or if the
+// address range is taken.
+amb_arena* amb_arena_load(int fd, int64_t len);
+
+
+// Incremental checkpoints
+// ------------------------------------------------------------
+
+// How writes to the arena are found, from cheapest to dearest:
+#define AMB_ARENA_TRACK_AUTO          0 // The first of the two below that works.
+#define AMB_ARENA_TRACK_SOFT_DIRTY    1 // The kernel's soft-dirty page bits (Linux).
+#define AMB_ARENA_TRACK_WRITE_PROTECT 2 // Write-protect, and catch each page's first
+                                        // write (SIGSEGV).  Not Windows.
+#define AMB_ARENA_TRACK_EXPLICIT      3 // Only amb_arena_mark_dirty.
+
+// Track writes to the arena, for a local chain of images
+// (amb_arena_chain): every fullEvery-th image is full (1 or less: all
+// of them), the others are deltas.  Both automatic methods act
+// process-wide, so only one arena per process can use them; others
+// fall back to AMB_ARENA_TRACK_EXPLICIT.  With
+// write-protection, system calls must not write into the arena (they
+// fail with EFAULT), and a SIGSEGV handler is installed that passes
+// faults outside the arena on to the previous one.
+//
+// RETURN: the method in use.
+int amb_arena_track(amb_arena* a, int method, int fullEvery);
+
+// Record that len bytes at p changed.  The automatic methods need
+// this only for writes they cannot see (none, normally).
+void amb_arena_mark_dirty(amb_arena* a, const void* p, size_t len);
+
+// Append each checkpoint's image, full or delta, to fd (a file, say),
+// preceded by its length as an int64.  fd stays the caller's, and with
+// forkCheckpoint is written by the checkpoint process.  Call after
+// amb_arena_track.
+void amb_arena_chain(amb_arena* a, int fd);
+
+// Map the arena from a local chain of images on fd (as amb_arena_chain
+// wrote them, from its start): the last full image, with each delta
+// after it applied.  A torn image at the end is ignored, with a
+// warning.
+//
+// RETURN: the arena.  Fails (aborts) if fd holds no full image, or on
+// a malformed one.
+amb_arena* amb_arena_load_chain(int fd);
+
+// Capture what the next amb_arena_checkpoint writes to the chain, and
+// start a new record of changes.  amb_arena_checkpoint does this
+// itself, unless it runs in a forked process (forkCheckpoint): then
+// call this from amb_client_options.snapshot instead.
+void amb_arena_snapshot(amb_arena* a);
+
+// Apply a delta (len bytes on fd) to an arena loaded from the full
+// image, or the delta, before it.  Before calling amb_arena_track.
+// (amb_arena_load_chain does this for a whole chain.)
+void amb_arena_apply(amb_arena* a, int fd, int64_t len);
+
+// Of the images appended to the chain (the coordinator's are full):
+struct amb_arena_stats {
+  int64_t images;         // Checkpoints written, full or not.
+  int64_t deltas;
+  int64_t lastBytes;      // The size of the last image,
+  int64_t lastDirtyPages; // and the pages it holds.
+  int64_t totalBytes;
+  int64_t savedBytes;     // Compared with full images only.
+};
+
+// Statistics since amb_arena_track.
+void amb_arena_get_stats(amb_arena* a, struct amb_arena_stats* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
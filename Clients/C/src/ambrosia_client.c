@@ -1,6 +1,10 @@
 
 // See client.h header for function-level documentation.
 
+#ifndef _WIN32
+  #define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -22,28 +26,51 @@
   #include <netdb.h> // gethostbyname
   #include <sched.h>  // sched_yield
   #include <pthread.h> 
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/wait.h>
+  #include <poll.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h> // TCP_NODELAY, TCP_QUICKACK
+#endif
+#ifdef __linux__
+  #include <sys/eventfd.h>
 #endif
 
 #include "ambrosia/client.h"
+#include "ambrosia/compress.h"
 #include "ambrosia/internal/bits.h"
 
 // For network progress thread only:
 #include "ambrosia/internal/spsc_rring.h"
+#include "ambrosia/internal/runtime.h"
+#include "ambrosia/internal/uring_engine.h"
+#include "ambrosia/internal/trace.h"
 
 // Library-level (private) global variables:
 // --------------------------------------------------
 
-// FIXME: looks like we need a hashtable after all...
-int g_attached = 0;  // For now, ONE destination.
-
-// Global variables that should be initialized once for the library.
-// We can ONLY ever have ONE reliability coordinator.
+// The connections of the default runtime (below), for compatibility.
 int g_to_immortal_coord, g_from_immortal_coord;
 
+// The runtime started by amb_initialize_client_runtime(_opts), which
+// the single-instance API falls back on:
+struct amb_runtime* g_default_runtime = NULL;
 
-// An INTERNAL global representing whether the client is terminating
-// this AMBROSIA instance/network-endpoint.
-int g_amb_client_terminating = 0;
+// The runtime whose processing loop (or creation) runs on this thread:
+AMB_THREAD_LOCAL struct amb_runtime* t_current_runtime = NULL;
+
+// Runtimes sharing the one network progress thread (sharedIoThread):
+#define AMB_MAX_SHARED_IO 256
+struct amb_runtime* volatile g_shared_io[AMB_MAX_SHARED_IO];
+volatile long g_shared_io_count = 0;
+
+// Applications that pass callbacks in amb_client_options need not
+// define these at all:
+#ifndef _WIN32
+#pragma weak amb_dispatch_method
+#pragma weak send_dummy_checkpoint
+#endif
 
 #ifdef IPV4
 const char* coordinator_host = "127.0.0.1";
@@ -86,6 +113,21 @@ void amb_sleep_seconds(double n) {
 #endif
 }
 
+// Monotonic time, for statistics.
+static int64_t amb_now_ns()
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 void print_decimal_bytes(char* ptr, int len) {
   const int limit = 100; // Only print this many:
   int j;
@@ -136,6 +178,44 @@ int zigzag_int_size(int32_t value) {
   return retVal+1;
 }
 
+void* write_zigzag_long(void* ptr, int64_t value) {
+  char* bytes = (char*)ptr;
+  uint64_t zigZagEncoded = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  while ((zigZagEncoded & ~0x7FULL) != 0) {
+    *bytes++ = (char)((zigZagEncoded | 0x80) & 0xFF);
+    zigZagEncoded >>= 7;
+  }
+  *bytes++ = (char)zigZagEncoded;
+  return bytes;
+}
+
+void* read_zigzag_long(void* ptr, int64_t* ret) {
+  char* bytes = (char*)ptr;
+  uint64_t currentByte = (unsigned char)*bytes; bytes++;
+  char read = 1;
+  uint64_t result = currentByte & 0x7FULL;
+  int32_t  shift = 7;
+  while ((currentByte & 0x80) != 0) {
+    currentByte = (unsigned char)*bytes; bytes++;
+    read++;
+    result |= (currentByte & 0x7FULL) << shift;
+    shift += 7;
+    if (read > 10) return NULL; // Invalid encoding.
+  }
+  *ret = (int64_t) ((-(result & 1)) ^ ((result >> 1) & 0x7FFFFFFFFFFFFFFFULL));
+  return (void*)bytes;
+}
+
+int zigzag_long_size(int64_t value) {
+  int retVal = 0;
+  uint64_t zigZagEncoded = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  while ((zigZagEncoded & ~0x7FULL) != 0) {
+      retVal++;
+      zigZagEncoded >>= 7;
+  }
+  return retVal+1;
+}
+
 
 // AMBROSIA-specific messaging utilities
 // -------------------------------------
@@ -203,6 +283,45 @@ void* amb_write_outgoing_rpc(void* buf, char* dest, int32_t destLen, char RPC_or
   return (void*)cursor;
 }
 
+void* amb_write_outgoing_call_hdr(void* buf, char* dest, int32_t destLen, int32_t methodID,
+                                  char* sender, int32_t senderLen, int64_t seq, int argsLen) {
+  char* cursor = (char*)buf;
+  int totalSize = 1 // type tag
+    + zigzag_int_size(destLen) + destLen + 1 // RPC_or_RetVal
+    + zigzag_int_size(methodID) + 1 // fireForget
+    + zigzag_int_size(senderLen) + senderLen + zigzag_long_size(seq)
+    + argsLen;
+  cursor = write_zigzag_int(cursor, totalSize); // Size (message header)
+  *cursor++ = RPC;                            // Type (message header)
+  cursor = write_zigzag_int(cursor, destLen);   // Destination string size
+  memcpy(cursor, dest, destLen); cursor += destLen; // Registered name of dest service
+  *cursor++ = RetNone;                              // 1 byte
+  cursor = write_zigzag_int(cursor, methodID);        // 1-5 bytes
+  *cursor++ = RpcReturnValue;                       // 1 byte
+  cursor = write_zigzag_int(cursor, senderLen);       // Return address
+  memcpy(cursor, sender, senderLen); cursor += senderLen;
+  cursor = write_zigzag_long(cursor, seq);            // 1-10 bytes
+  return (void*)cursor;
+}
+
+void* amb_write_return_value_hdr(void* buf, char* dest, int32_t destLen, char retType,
+                                 char* sender, int32_t senderLen, int64_t seq, int valueLen) {
+  char* cursor = (char*)buf;
+  int totalSize = 1 // type tag
+    + zigzag_int_size(destLen) + destLen + 1 // RPC_or_RetVal
+    + zigzag_int_size(senderLen) + senderLen + zigzag_long_size(seq)
+    + valueLen;
+  cursor = write_zigzag_int(cursor, totalSize); // Size (message header)
+  *cursor++ = RPC;                            // Type (message header)
+  cursor = write_zigzag_int(cursor, destLen);   // Destination string size
+  memcpy(cursor, dest, destLen); cursor += destLen; // The caller
+  *cursor++ = retType;                              // 1 byte
+  cursor = write_zigzag_int(cursor, senderLen);       // Ourselves
+  memcpy(cursor, sender, senderLen); cursor += senderLen;
+  cursor = write_zigzag_long(cursor, seq);            // 1-10 bytes
+  return (void*)cursor;
+}
+
 // Direct socket sends/recvs
 // ------------------------------
 
@@ -253,14 +372,60 @@ void amb_recv_log_hdr(int sockfd, struct log_hdr* hdr) {
 // Manage the state of the client (networking/connections)
 // ==============================================================================
 
-void attach_if_needed(char* dest, int destLen) {
-  // HACK: only working for one dest atm...
-  if (!g_attached && destLen != 0) // If destName=="" we are sending to OURSELF and don't need attach.
+static struct amb_runtime* amb_current_or_default()
+{
+  return t_current_runtime != NULL ? t_current_runtime : g_default_runtime;
+}
+
+// Make rt (or nothing) current for the calling thread, returning the
+// previously current runtime.
+static struct amb_runtime* amb_set_current_runtime(struct amb_runtime* rt)
+{
+  struct amb_runtime* prev = t_current_runtime;
+  t_current_runtime = rt;
+  rring_set_current(rt != NULL ? rt->out : NULL);
+  return prev;
+}
+
+// Whether rt has attached to dest; if not, record that it is about to.
+static int amb_note_attached(struct amb_runtime* rt, const char* dest, int destLen)
+{
+  for (int n = 0, i = rt->attached_last; n < rt->attached_count; n++, i = (i + 1) % rt->attached_count) {
+    struct amb_attached* a = & rt->attached[i];
+    if (a->len == destLen && memcmp(a->name, dest, destLen) == 0) {
+      rt->attached_last = i;
+      return 1;
+    }
+  }
+  if (rt->attached_count == rt->attached_cap) {
+    rt->attached_cap = rt->attached_cap ? 2 * rt->attached_cap : 8;
+    rt->attached = (struct amb_attached*)realloc(rt->attached, rt->attached_cap * sizeof(struct amb_attached));
+  }
+  char* name = (char*)malloc(destLen);
+  if (rt->attached == NULL || name == NULL) {
+    fprintf(stderr, "ERROR: failed to record destination %d\n", rt->attached_count);
+    abort();
+  }
+  struct amb_attached* a = & rt->attached[rt->attached_count];
+  a->name = name;
+  memcpy(a->name, dest, destLen);
+  a->len = destLen;
+  a->compress = 0;
+  for (const char* const* to = rt->options.compressTo; to != NULL && *to != NULL; to++)
+    if ((int)strlen(*to) == destLen && memcmp(*to, dest, destLen) == 0) a->compress = 1;
+  rt->attached_last = rt->attached_count++;
+  return 0;
+}
+
+void amb_runtime_attach(struct amb_runtime* rt, char* dest, int destLen) {
+  // If destName=="" we are sending to OURSELF and don't need attach.
+  if (destLen != 0 && !amb_note_attached(rt, dest, destLen))
   {
       amb_debug_log("Sending attach message re: dest = %s...\n", dest);
-      char sendbuf[128];
+      // Through the ring, so it stays in order with the sends around it:
+      int dest_len = destLen; // Need not be null terminated.
+      char* sendbuf = rring_reserve(rt->out, 5 + 1 + dest_len);
       char* cur = sendbuf;
-      int dest_len = strlen(dest);
       cur = (char*)write_zigzag_int(cur, dest_len + 1); // Size
       *cur++ = (char)AttachTo;                        // Type
       memcpy(cur, dest, dest_len); cur+=dest_len;
@@ -269,12 +434,113 @@ void attach_if_needed(char* dest, int destLen) {
       print_hex_bytes(amb_dbg_fd, sendbuf, cur-sendbuf);
       fprintf(amb_dbg_fd,"\n");
 #endif
-      amb_socket_send_all(g_to_immortal_coord, sendbuf, cur-sendbuf, 0);
-      g_attached = 1;
+      rring_release(rt->out, cur-sendbuf);
       amb_debug_log("  attach message sent (%d bytes)\n", cur-sendbuf);
   }
 }
 
+void attach_if_needed(char* dest, int destLen) {
+  amb_runtime_attach(amb_current_or_default(), dest, destLen);
+}
+
+// Release functions for frames passed by reference (arg: the frame).
+static void amb_free_frame(void* ptr, int len, void* arg) {
+  (void)ptr; (void)len;
+  free(arg);
+}
+
+static void amb_no_release(void* ptr, int len, void* arg) {
+  (void)ptr; (void)len; (void)arg;
+}
+
+// Send the arguments as one compressed frame, if that makes them
+// smaller.
+//
+// RETURN: whether they were sent.
+static int amb_send_compressed(struct amb_runtime* rt, char* dest, int32_t destLen, int32_t methodID,
+                               char fireForget, const struct amb_iovec* iov, int iovcnt, int argsLen,
+                               amb_release_fn release, void* arg) {
+  struct amb_compress_stats* st = & rt->zstats;
+  int64_t t0 = amb_now_ns();
+  amb_zstream* z = amb_zstream_begin();
+  for (int i = 0; i < iovcnt; i++)
+    amb_zstream_write(z, iov[i].base, iov[i].len);
+  int64_t flen;
+  char* frame = amb_zstream_finish(z, &flen);
+  st->compressNs += amb_now_ns() - t0;
+  if (flen >= argsLen) {
+    free(frame);
+    st->incompressible++;
+    return 0;
+  }
+  st->frames++;
+  st->rawBytes += argsLen;
+  st->compressedBytes += flen;
+
+  int inl = flen < AMB_IOV_INLINE_MAX ? (int)flen : 0;
+  rring_begin_message(rt->out);
+  char* start = rring_reserve(rt->out, 5 + 1 + 5 + destLen + 1 + 5 + 1 + inl);
+  char* cur = amb_write_outgoing_rpc_hdr(start, dest, destLen, RetNone, methodID,
+                                         fireForget | AMB_ARGS_COMPRESSED, (int)flen);
+  memcpy(cur, frame, inl);
+  rring_release(rt->out, cur + inl - start);
+  if (inl > 0) free(frame);
+  else rring_release_ref(rt->out, frame, (int)flen, amb_free_frame, frame);
+  rring_end_message(rt->out);
+
+  // Nothing refers to the fragments any more:
+  if (release != NULL)
+    for (int i = 0; i < iovcnt; i++)
+      if (iov[i].len >= AMB_IOV_INLINE_MAX)
+        release(iov[i].base, iov[i].len, arg);
+  return 1;
+}
+
+void amb_send_rpc_iov(char* dest, int32_t destLen, int32_t methodID, char fireForget,
+                      const struct amb_iovec* iov, int iovcnt,
+                      amb_release_fn release, void* arg) {
+  struct amb_runtime* rt = amb_current_or_default();
+  int compress = rt->options.compressArgs > 0 && !(fireForget & AMB_NO_COMPRESS);
+  int argsLen = 0;
+  fireForget &= ~AMB_NO_COMPRESS;
+  for (int i = 0; i < iovcnt; i++) argsLen += iov[i].len;
+  amb_runtime_attach(rt, dest, destLen);
+  // Only receivers known to understand AMB_ARGS_COMPRESSED: itself, or
+  // those in compressTo (amb_runtime_attach just found dest's entry).
+  if (compress && destLen != 0) compress = rt->attached[rt->attached_last].compress;
+  if (compress && argsLen >= rt->options.compressArgs &&
+      amb_send_compressed(rt, dest, destLen, methodID, fireForget, iov, iovcnt, argsLen, release, arg))
+    return;
+
+  // The header, and each run of short fragments, is copied into the
+  // ring.  The long fragments between them go by reference.
+  int i = 0;
+  int hdrbound = 5 + 1 + 5 + destLen + 1 + 5 + 1;
+  rring_begin_message(rt->out);
+  while (1) {
+    int runLen = 0, j = i;
+    while (j < iovcnt && (release == NULL || iov[j].len < AMB_IOV_INLINE_MAX))
+      runLen += iov[j++].len;
+    if (hdrbound > 0 || runLen > 0) {
+      char* start = rring_reserve(rt->out, hdrbound + runLen);
+      char* cur = start;
+      if (hdrbound > 0)
+        cur = amb_write_outgoing_rpc_hdr(start, dest, destLen, RetNone, methodID, fireForget, argsLen);
+      for (; i < j; i++) {
+        memcpy(cur, iov[i].base, iov[i].len);
+        cur += iov[i].len;
+      }
+      rring_release(rt->out, cur - start);
+      hdrbound = 0;
+    }
+    if (i == iovcnt) break;
+    amb_debug_log(" Sending %d byte fragment %d by reference\n", iov[i].len, i);
+    rring_release_ref(rt->out, (char*)iov[i].base, iov[i].len, release, arg);
+    i++;
+  }
+  rring_end_message(rt->out);
+}
+
 // Hacky busy-wait by thread-yielding for now:
 // FIXME: NEED BACKOFF!
 static inline
@@ -287,23 +553,405 @@ void amb_yield_thread() {
 }
 
 
+// The send flags for a slice of numbytes just peeked: with
+// AMB_SOCKETS_THROUGHPUT, hold it back while more follows.
+static inline int amb_slice_flags(struct amb_runtime* rt, struct rring* ring, int numbytes)
+{
+  int coalesce = rt != NULL && rt->options.socketProfile == AMB_SOCKETS_THROUGHPUT;
+  return coalesce && rring_peeked_more(ring, numbytes) ? MSG_MORE : 0;
+}
+
+// Flush policy
+// --------------------------------------------------
+
+#define AMB_DEFAULT_LINGER_US 100
+
+// The built-in policy: amb_client_options.flushMinBytes and so on.
+static int amb_default_flush_policy(const struct amb_flush_state* st)
+{
+  const struct amb_client_options* o = st->options;
+  int64_t lingerNs = (o->flushLingerUs > 0 ? o->flushLingerUs : AMB_DEFAULT_LINGER_US) * 1000LL;
+  if (st->queuedBytes < o->flushMinBytes && st->oldestNs < lingerNs)
+    return 0;
+  if (o->flushMaxBytes > 0 && st->sliceBytes > o->flushMaxBytes)
+    return o->flushMaxBytes;
+  return st->sliceBytes;
+}
+
+// Choose rt's policy, and date releases if it needs them.
+static void amb_init_flush_policy(struct amb_runtime* rt)
+{
+  const struct amb_client_options* o = & rt->options;
+  if (o->flushPolicy != NULL)
+    rt->flush_policy = o->flushPolicy;
+  else if (o->flushMinBytes > 0 || o->flushMaxBytes > 0)
+    rt->flush_policy = amb_default_flush_policy;
+  if (rt->flush_policy == NULL) return;
+  // Precise to an eighth of the linger time:
+  int lingerUs = o->flushLingerUs > 0 ? o->flushLingerUs : AMB_DEFAULT_LINGER_US;
+  rring_set_stamping(& rt->ring, lingerUs * 1000LL / 8);
+  rt->flush_last_ns = amb_now_ns();
+}
+
+// How many of the numbytes just peeked from rt's ring to send now (0:
+// hold them), and how long the oldest of them has waited.
+static int amb_flush_amount(struct amb_runtime* rt, int numbytes, int64_t* age)
+{
+  *age = 0;
+  if (rt == NULL || rt->flush_policy == NULL) return numbytes;
+  struct amb_flush_state st;
+  int64_t now = amb_now_ns();
+  int64_t oldest = rring_oldest_ns(& rt->ring);
+  int64_t used = rring_used(& rt->ring);
+  st.sliceBytes  = numbytes;
+  st.queuedBytes = used > numbytes ? used : numbytes;
+  st.oldestNs    = oldest > 0 ? now - oldest : 0;
+  st.sinceSendNs = now - rt->flush_last_ns;
+  st.options     = & rt->options;
+  int n = rt->flush_policy(&st);
+  if (n <= 0) return 0;
+  *age = st.oldestNs;
+  rt->flush_last_ns = now;
+  return n < numbytes ? n : numbytes;
+}
+
+// Record a send of n bytes from the ring.
+static void amb_count_flush(struct amb_runtime* rt, int n, int64_t age)
+{
+  if (rt == NULL) return;
+  struct amb_flush_stats* st = & rt->flush_stats;
+  int bucket = 0;
+  for (int64_t limit = 256; n >= limit && bucket < AMB_FLUSH_SIZE_BUCKETS - 1; limit *= 4)
+    bucket++;
+  st->sends++;
+  st->bytes += n;
+  st->sizeHist[bucket]++;
+  if (n > st->maxSendBytes) st->maxSendBytes = n;
+  st->lastAgeNs = age;
+  if (age > st->maxAgeNs) st->maxAgeNs = age;
+}
+
+// Send one slice of whatever is in the ring (rt's, if not NULL, under
+// its flush policy).
+// RETURN: whether there was anything sent.
+static int amb_progress_ring(struct rring* ring, int upfd, struct amb_runtime* rt)
+{
+  int numbytes = -1;
+  int64_t age;
+  char* ptr = rring_peek(ring, &numbytes);
+  if (numbytes <= 0) return 0;
+  if ((numbytes = amb_flush_amount(rt, numbytes, &age)) == 0) return 0;
+  amb_debug_log(" network thread: sending slice of %d bytes\n", numbytes);
+  AMB_TRACE1(flush_begin, numbytes);
+  amb_socket_send_all(upfd, ptr, numbytes, amb_slice_flags(rt, ring, numbytes));
+  AMB_TRACE1(flush_end, numbytes);
+  rring_pop(ring, numbytes); // Must be at least this many.
+  amb_count_flush(rt, numbytes, age);
+  return 1;
+}
+
+// Priority lanes
+// --------------
+// (amb_client_options.lanes.)  The processing loop sends to one lane
+// at a time; the network progress thread takes turns between them,
+// and stays with a lane while it is within a message, as the rings
+// record where messages end (rring_set_boundaries).  A checkpoint
+// holds the lanes back: each is sent up to where it stood when the
+// checkpoint was taken, then lane 0 alone, through the checkpoint.
+
+static struct rring* amb_lane_ring(struct amb_runtime* rt, int lane)
+{
+  return lane == 0 ? & rt->ring : & rt->lanes[lane - 1];
+}
+
+// Send what the processing loop sends next through lane.
+static void amb_select_lane(struct amb_runtime* rt, int lane)
+{
+  rt->lane = lane;
+  rt->out  = amb_lane_ring(rt, lane);
+  if (amb_current_or_default() == rt)
+    rring_set_current(rt->out); // For reserve_buffer.
+}
+
+// Allocate rt's lanes, and have every lane's ring record where its
+// messages end.
+static void amb_init_lanes(struct amb_runtime* rt, int ringFlags)
+{
+  const struct amb_client_options* o = & rt->options;
+  int bufSz = o->laneBufSz > 0 ? o->laneBufSz : 1024 * 1024;
+  int weighted = 0;
+  for (int lane = 0; lane <= o->lanes; lane++) {
+    struct rring* r = amb_lane_ring(rt, lane);
+    if (lane > 0) {
+      rring_init(r, bufSz, ringFlags);
+      if (o->ringNode >= 0) rring_bind_node(r, o->ringNode);
+    }
+    rring_set_boundaries(r, AMB_LANE_QUANTUM);
+    weighted |= o->laneWeights[lane] > 0;
+  }
+  printf(" *** Lanes: %d beside the main ring, %d bytes each, %s", o->lanes, bufSz,
+         weighted ? "weighted" : "strict priority");
+  for (int lane = 0; weighted && lane <= o->lanes; lane++)
+    printf("%c%d", lane == 0 ? ' ' : '/', o->laneWeights[lane] > 0 ? o->laneWeights[lane] : 1);
+  printf("\n");
+}
+
+// How far lane may send: while the lanes are held for a checkpoint,
+// to its cut, and lane 0 past its own only once every other lane has
+// reached its cut.  INT64_MAX: no limit.
+static int64_t amb_lane_limit(struct amb_runtime* rt, int lane)
+{
+  if (!rt->lane_hold) return INT64_MAX;
+  if (lane > 0 || rt->ring.consumed < rt->lane_cut[0]) return rt->lane_cut[lane];
+  for (int i = 1; i <= rt->options.lanes; i++)
+    if (rt->lanes[i - 1].consumed < rt->lane_cut[i]) return rt->lane_cut[0];
+  return INT64_MAX;
+}
+
+// Send one slice from lane, stopping at the next message boundary
+// recorded, or at its limit.
+// RETURN: the bytes sent (0: none to send).
+static int amb_send_lane(struct amb_runtime* rt, int lane)
+{
+  struct rring* r = amb_lane_ring(rt, lane);
+  int numbytes = -1;
+  char* ptr = rring_peek(r, &numbytes);
+  if (numbytes <= 0) return 0;
+  int stream = rring_peeked_stream(r); // Checkpoints: none of the above apply.
+  int64_t limit = INT64_MAX, end = -1;
+  if (!stream) {
+    limit = amb_lane_limit(rt, lane);
+    end = rring_next_boundary(r);
+    int64_t upto = end > 0 && end < limit ? end : limit;
+    if (upto - r->consumed < numbytes) numbytes = (int)(upto - r->consumed);
+    if (numbytes <= 0) return 0;
+  }
+  amb_debug_log(" network thread: sending slice of %d bytes from lane %d\n", numbytes, lane);
+  AMB_TRACE1(flush_begin, numbytes);
+  amb_socket_send_all(rt->upfd, ptr, numbytes, amb_slice_flags(rt, r, numbytes));
+  AMB_TRACE1(flush_end, numbytes);
+  rring_pop(r, numbytes);
+  if (!stream)
+    rt->lane_midmsg = r->consumed != end && r->consumed != limit;
+  struct amb_lane_stats* st = & rt->lane_stats;
+  if (lane != rt->lane_last) st->switches++;
+  rt->lane_last = lane;
+  st->sends[lane]++;
+  st->bytes[lane] += numbytes;
+  amb_count_flush(rt, numbytes, 0);
+  return numbytes;
+}
+
+// Send one slice from whichever lane's turn it is.
+// RETURN: whether there was anything sent.
+static int amb_progress_lanes(struct amb_runtime* rt)
+{
+  const struct amb_client_options* o = & rt->options;
+  if (rt->lane_hold && !rt->retain_stream && rt->ring.consumed >= rt->lane_hold_end)
+    rt->lane_hold = 0; // The checkpoint is out.
+  if (rt->lane_midmsg)
+    return amb_send_lane(rt, rt->lane_last) > 0;
+  int weighted = 0;
+  for (int lane = 0; lane <= o->lanes; lane++) weighted |= o->laneWeights[lane] > 0;
+  if (!weighted) {
+    for (int lane = o->lanes; lane >= 0; lane--)
+      if (amb_send_lane(rt, lane) > 0) return 1;
+    return 0;
+  }
+  // Deficit round robin: a lane keeps its turn while it has credit and
+  // something to send; an idle lane forfeits what is left, and one
+  // that overdrew (finishing a message) waits for its credit to
+  // recover.  Until every lane is found idle:
+  for (int idle = 0; idle <= o->lanes; ) {
+    int lane = rt->lane_turn;
+    if (rt->lane_credit[lane] > 0) {
+      int sent = amb_send_lane(rt, lane);
+      if (sent > 0) {
+        rt->lane_credit[lane] -= sent;
+        return 1;
+      }
+      rt->lane_credit[lane] = 0;
+      idle++;
+    }
+    lane = rt->lane_turn = (lane + 1) % (o->lanes + 1);
+    int weight = o->laneWeights[lane] > 0 ? o->laneWeights[lane] : 1;
+    rt->lane_credit[lane] += (int64_t)weight * AMB_LANE_QUANTUM;
+  }
+  return 0;
+}
+
+// On the processing loop, before a checkpoint: cut every lane where it
+// stands, and send through lane 0.  RETURN: the lane to go back to.
+static int amb_hold_lanes(struct amb_runtime* rt)
+{
+  while (rt->lane_hold)
+    amb_yield_thread(); // The last checkpoint is still going out.
+  for (int lane = 0; lane <= rt->options.lanes; lane++)
+    rt->lane_cut[lane] = amb_lane_ring(rt, lane)->produced;
+  rt->lane_hold_end = INT64_MAX;
+  rt->lane_hold = 1; // Publish, after the cuts (total store order).
+  rt->lane_stats.checkpointHolds++;
+  int lane = rt->lane;
+  amb_select_lane(rt, 0);
+  return lane;
+}
+
+// Once the checkpoint is in lane 0: let the lanes go once it is sent.
+static void amb_release_lanes(struct amb_runtime* rt, int lane)
+{
+  rt->lane_hold_end = rt->ring.produced;
+  amb_select_lane(rt, lane);
+}
+
+static void amb_tune_sockets(struct amb_runtime* rt);
+
+#ifndef _WIN32
+static int amb_connect_up(int upport, int mayFail);
+static int amb_accept_down(int downport, int timeoutMs);
+
+// Resuming after a lost connection
+// --------------------------------
+// (reconnectTimeoutMs.)  The network progress thread notices, or is
+// told, that the connection is lost, and reconnects; meanwhile the
+// processing loop carries on with what it has received.  The
+// coordinator then recovers as it would after a restart of the
+// immortal: it sends its copy of the last checkpoint, and replays the
+// log after it.  The receiving side skips the checkpoint, the
+// processing loop skips the records it has handled already, and the
+// outputs of those records, which the coordinator counts on seeing
+// again, are sent again from the copy made here as they were sent.
+
+// Keep a copy of n bytes just sent, first dropping the copy of what
+// came before the last checkpoint, which is no longer needed.
+static void amb_retain(struct amb_runtime* rt, const char* p, int n)
+{
+  int64_t mark = rt->retain_mark;
+  if (!rt->retain_stream && mark > rt->retained_base && mark <= rt->sent) {
+    int64_t drop = mark - rt->retained_base;
+    memmove(rt->retained, rt->retained + drop, rt->retained_len - drop);
+    rt->retained_len -= drop;
+    rt->retained_base = mark;
+  }
+  if (rt->retained_len + n > rt->retained_cap) {
+    int64_t cap = rt->retained_cap ? 2 * rt->retained_cap : 1024 * 1024;
+    while (cap < rt->retained_len + n) cap *= 2;
+    rt->retained = (char*)realloc(rt->retained, cap);
+    if (rt->retained == NULL) {
+      fprintf(stderr, "ERROR: failed to grow the copy of output since the last checkpoint to %lld bytes\n",
+              (long long)cap);
+      abort();
+    }
+    rt->retained_cap = cap;
+  }
+  memcpy(rt->retained + rt->retained_len, p, n);
+  rt->retained_len += n;
+  rt->sent += n;
+  rt->reconnect_stats.retainedBytes = rt->retained_len;
+}
+
+// As amb_progress_ring, keeping a copy.  A failed send is left in the
+// ring, to be sent again once reconnected.
+static int amb_progress_resumable(struct amb_runtime* rt)
+{
+  int numbytes = -1;
+  int64_t age;
+  char* ptr = rring_peek(& rt->ring, &numbytes);
+  if (numbytes <= 0) return 0;
+  if ((numbytes = amb_flush_amount(rt, numbytes, &age)) == 0) return 0;
+  AMB_TRACE1(flush_begin, numbytes);
+  if (amb_socket_try_send_all(rt->upfd, ptr, numbytes, amb_slice_flags(rt, & rt->ring, numbytes))) {
+    rt->link_lost = 1;
+    return 1;
+  }
+  AMB_TRACE1(flush_end, numbytes);
+  if (!rring_peeked_stream(& rt->ring)) // Checkpoints, never sent again.
+    amb_retain(rt, ptr, numbytes);
+  rring_pop(& rt->ring, numbytes);
+  amb_count_flush(rt, numbytes, age);
+  return 1;
+}
+
+// Wait for the coordinator to come back, then send it again what it
+// has been sent since the last checkpoint.
+static void amb_reconnect(struct amb_runtime* rt)
+{
+  int64_t start = amb_now_ns();
+  int64_t deadline = start + rt->options.reconnectTimeoutMs * 1000000LL;
+  printf(" *** Lost the connection to the coordinator, reconnecting...\n");
+  shutdown(rt->upfd, SHUT_RDWR);
+  shutdown(rt->downfd, SHUT_RDWR); // Wakes the receiving side, which closes it.
+  close(rt->upfd);
+  if (rt->retain_stream || rt->retain_mark > rt->sent) {
+    fprintf(stderr, "ERROR: lost the connection to the coordinator while sending a checkpoint,"
+            " cannot resume\n");
+    abort();
+  }
+  int upfd, downfd;
+  while (1) {
+    while ((upfd = amb_connect_up(rt->upport, 1)) < 0 && amb_now_ns() < deadline)
+      amb_sleep_seconds(0.01);
+    int left = (int)((deadline - amb_now_ns()) / 1000000);
+    if (upfd < 0 || (downfd = amb_accept_down(rt->downport, left > 0 ? left : 0)) < 0) {
+      fprintf(stderr, "ERROR: the coordinator did not come back within %d ms\n",
+              rt->options.reconnectTimeoutMs);
+      abort();
+    }
+    int64_t from = rt->retain_mark;
+    rt->upfd   = upfd;
+    rt->downfd = downfd;
+    amb_tune_sockets(rt);
+    if (amb_socket_try_send_all(upfd, rt->retained + (from - rt->retained_base), rt->sent - from, 0) == 0) {
+      rt->reconnect_stats.resentBytes += rt->sent - from;
+      rt->resent_mark = from;
+      break;
+    }
+    close(upfd); // Lost again.
+    close(downfd);
+  }
+  if (rt == g_default_runtime) {
+    g_to_immortal_coord   = upfd;
+    g_from_immortal_coord = downfd;
+  }
+  rt->reconnect_stats.reconnects++;
+  rt->reconnect_stats.lastOutageNs = amb_now_ns() - start;
+  printf(" *** Reconnected to the coordinator\n");
+  rt->link_lost = 0;
+  rt->link_epoch++; // Publish, after the sockets (total store order).
+}
+#endif
+
 // Launch a background thread that progresses the network.
+//
+// The argument is the runtime.  NULL (the original way to start this
+// thread by hand) means the current ring and g_to_immortal_coord.
 #ifdef _WIN32
 DWORD WINAPI amb_network_progress_thread( LPVOID lpParam )
 #else
 void*        amb_network_progress_thread( void* lpParam )
 #endif
 {
+  struct amb_runtime* rt = (struct amb_runtime*)lpParam;
+  struct rring* ring = rt != NULL ? & rt->ring : rring_current();
+  int upfd = rt != NULL ? rt->upfd : g_to_immortal_coord;
   printf(" *** Network progress thread starting...\n");
   int hot_spin_amount = 1; // 100
   int spin_tries = hot_spin_amount;
+  int resumable = rt != NULL && rt->options.reconnectTimeoutMs > 0;
+  int lanes = rt != NULL && rt->options.lanes > 0;
   while(1) {
-    int numbytes = -1;
-    char* ptr = peek_buffer(&numbytes);    
-    if (numbytes > 0) {
-      amb_debug_log(" network thread: sending slice of %d bytes\n", numbytes);
-      amb_socket_send_all(g_to_immortal_coord, ptr, numbytes, 0);
-      pop_buffer(numbytes); // Must be at least this many.
+    int progress;
+#ifndef _WIN32
+    if (resumable) {
+      if (rt->link_lost) amb_reconnect(rt);
+      progress = amb_progress_resumable(rt);
+    } else
+#endif
+    if (lanes)
+      progress = amb_progress_lanes(rt);
+    else
+      progress = amb_progress_ring(ring, upfd, rt);
+    if (rt != NULL) amb_check_space(rt);
+    if (progress) {
       spin_tries = hot_spin_amount;
     } else if ( spin_tries == 0) {
       spin_tries = hot_spin_amount;
@@ -319,6 +967,30 @@ void*        amb_network_progress_thread( void* lpParam )
   return 0;
 }
 
+// One progress thread for all the runtimes in g_shared_io, round robin.
+#ifdef _WIN32
+DWORD WINAPI amb_shared_progress_thread( LPVOID lpParam )
+#else
+void*        amb_shared_progress_thread( void* lpParam )
+#endif
+{
+  printf(" *** Shared network progress thread starting...\n");
+  while(1) {
+    int progress = 0;
+    int count = (int)g_shared_io_count;
+    for (int i = 0; i < count; i++) {
+      struct amb_runtime* rt = g_shared_io[i];
+      if (rt != NULL) { // Still being registered, otherwise.
+        progress |= amb_progress_ring(& rt->ring, rt->upfd, rt);
+        amb_check_space(rt);
+      }
+    }
+    if (!progress)
+      amb_yield_thread();
+  }
+  return 0;
+}
+
 
 
 // Begin amb_connect_sockets:
@@ -506,9 +1178,11 @@ void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
 // Non-windows version:
 // ------------------------------------------------------------
 
-// Establish both connections with the reliability coordinator.
-// Takes two output parameters where it will write the resulting sockets.
-void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
+// Link up to the coordinator (send channel).
+//
+// RETURN: the socket, or -1 if the connection fails and mayFail is
+// set (otherwise that aborts).
+static int amb_connect_up(int upport, int mayFail) {
 #ifdef IPV4
   struct hostent* immortalCoord;
   struct sockaddr_in addr;
@@ -517,12 +1191,10 @@ void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
   struct sockaddr_in6 addr;
   int af_inet = AF_INET6;
 #endif
-  
-  // Link up to the coordinator (send channel)
-  // --------------------------------------------------
+  int upfd;
   memset((char*) &addr, 0, sizeof(addr));
   amb_debug_log("Creating to-AMBROSIA connection\n");  
-  if ((*upptr = socket(af_inet, SOCK_STREAM, 0)) < 0) {
+  if ((upfd = socket(af_inet, SOCK_STREAM, 0)) < 0) {
     fprintf(stderr, "\nERROR: Failed to create (send) socket.\n");
     abort();
   }
@@ -544,19 +1216,38 @@ void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
   addr.sin6_port = htons(upport);
 #endif
 
-  if (connect(*upptr, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+  if (connect(upfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (mayFail) {
+      close(upfd);
+      return -1;
+    }
     fprintf(stderr, "\nERROR: Failed to connect to-socket: %s:%d\n", coordinator_host, upport); 
     abort();
   }
+  return upfd;
+}
 
-  // Down link from the coordinator (recv channel)
-  // --------------------------------------------------
+// Down link from the coordinator (recv channel): listen on downport,
+// and wait for the coordinator to connect, for at most timeoutMs
+// (negative: forever).
+//
+// RETURN: the socket, or -1 on timeout.
+static int amb_accept_down(int downport, int timeoutMs) {
+#ifdef IPV4
+  struct sockaddr_in addr;
+  int af_inet = AF_INET;
+#else   
+  struct sockaddr_in6 addr;
+  int af_inet = AF_INET6;
+#endif
   amb_debug_log("Creating from-AMBROSIA connection\n");
-  int tempfd;
+  int tempfd, one = 1;
   if ((tempfd = socket(af_inet, SOCK_STREAM, 0)) < 0) {
     fprintf(stderr, "\nERROR: Failed to create (recv) socket.\n");
     abort();
   }
+  // So that it can be bound again, to reconnect:
+  setsockopt(tempfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
   memset((char*) &addr, 0, sizeof(addr));
 #ifdef IPV4
   addr.sin_family       = af_inet;
@@ -578,6 +1269,13 @@ void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
             coordinator_host, downport, strerror(errno));
     abort();
   }
+  if (timeoutMs >= 0) {
+    struct pollfd p = { tempfd, POLLIN, 0 };
+    if (poll(&p, 1, timeoutMs) <= 0) {
+      close(tempfd);
+      return -1;
+    }
+  }
 #ifdef IPV4  
   struct sockaddr_in clientaddr;
 #else
@@ -585,19 +1283,112 @@ void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
 #endif
 
   socklen_t addrlen = 0;
-  if ((*downptr = accept(tempfd, (struct sockaddr*) &clientaddr, &addrlen)) < 0) {
-    fprintf(stderr, "failed to accept connection, accept returned: %d", *downptr);
+  int downfd;
+  if ((downfd = accept(tempfd, (struct sockaddr*) &clientaddr, &addrlen)) < 0) {
+    fprintf(stderr, "failed to accept connection, accept returned: %d", downfd);
     abort();
   }
-  return;
+  close(tempfd);
+  return downfd;
+}
+
+// Establish both connections with the reliability coordinator.
+// Takes two output parameters where it will write the resulting sockets.
+void amb_connect_sockets(int upport, int downport, int* upptr, int* downptr) {
+  *upptr   = amb_connect_up(upport, 0);
+  *downptr = amb_accept_down(downport, -1);
 }
 #endif
 // End amb_connect_sockets
 
+static void amb_set_sockopt(int fd, int level, int name, int value, const char* what)
+{
+  if (setsockopt(fd, level, name, (const char*)&value, sizeof(value)) != 0)
+    fprintf(stderr, "WARNING: could not set %s on the connection to the coordinator: %s\n",
+            what, amb_get_error_string());
+}
+
+// Apply amb_client_options.socketProfile to rt's (new) connections.
+static void amb_tune_sockets(struct amb_runtime* rt)
+{
+  int profile = rt->options.socketProfile;
+  if (profile == AMB_SOCKETS_DEFAULT) return;
+  amb_set_sockopt(rt->upfd,   IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  amb_set_sockopt(rt->downfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  int bufBytes = rt->options.socketBufBytes;
+  int busyPollUs = rt->options.busyPollUs;
+  if (profile == AMB_SOCKETS_THROUGHPUT && bufBytes <= 0) bufBytes = 4 * 1024 * 1024;
+  if (profile == AMB_SOCKETS_LATENCY && busyPollUs <= 0) busyPollUs = 50;
+  if (bufBytes > 0) {
+    amb_set_sockopt(rt->upfd,   SOL_SOCKET, SO_SNDBUF, bufBytes, "SO_SNDBUF");
+    amb_set_sockopt(rt->downfd, SOL_SOCKET, SO_RCVBUF, bufBytes, "SO_RCVBUF");
+  }
+#ifdef __linux__
+  if (profile == AMB_SOCKETS_LATENCY) {
+    amb_set_sockopt(rt->upfd,   IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    amb_set_sockopt(rt->downfd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+  }
+  if (busyPollUs > 0)
+    amb_set_sockopt(rt->downfd, SOL_SOCKET, SO_BUSY_POLL, busyPollUs, "SO_BUSY_POLL");
+#endif
+  // What the kernel granted (it caps and doubles the sizes asked for):
+  int sndbuf = 0, rcvbuf = 0;
+  socklen_t len = sizeof(int);
+  getsockopt(rt->upfd, SOL_SOCKET, SO_SNDBUF, (char*)&sndbuf, &len);
+  len = sizeof(int);
+  getsockopt(rt->downfd, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, &len);
+  printf(" *** Sockets: %s profile, %d byte send buffer, %d byte receive buffer\n",
+         profile == AMB_SOCKETS_LATENCY ? "latency" : "throughput", sndbuf, rcvbuf);
+}
+
+// After reading a record: the kernel drops out of quick-ack mode by
+// itself, so renew it (AMB_SOCKETS_LATENCY).
+static inline void amb_renew_quickack(struct amb_runtime* rt)
+{
+#ifdef __linux__
+  if (rt->options.socketProfile == AMB_SOCKETS_LATENCY) {
+    int one = 1;
+    setsockopt(rt->downfd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+  }
+#endif
+}
+
 
 // (Runtime library) Startup.
 //------------------------------------------------------------------------------
 
+static struct amb_runtime* amb_current_or_default();
+
+// Restore the checkpoint that the coordinator opens a recovery with.
+// Its message (len bytes following the type) holds the checkpoint's
+// size, and the checkpoint itself follows the log record.  Then the
+// logged calls since the checkpoint are replayed, as usual.
+static int64_t amb_checkpoint_msg_len(char* msg, int len) {
+  int64_t ckptLen = 0;
+  if (len == 8)
+    memcpy(&ckptLen, msg, 8);        // A fixed 8 bytes, as written by this client,
+  else
+    read_zigzag_long(msg, &ckptLen); // or a varint, as other language bindings do.
+  return ckptLen;
+}
+
+static void amb_recover(int downfd, char* msg, int len) {
+  struct amb_runtime* rt = amb_current_or_default();
+  int64_t ckptLen = amb_checkpoint_msg_len(msg, len);
+  if (rt == NULL || rt->options.load == NULL) {
+    fprintf(stderr, "ERROR: recovering from a %lld byte checkpoint, but there is no"
+            " amb_client_options.load callback to read it\n", (long long)ckptLen);
+    abort();
+  }
+  rt->replaying = 1;
+  int64_t t0 = amb_now_ns();
+  rt->options.load(downfd, ckptLen);
+  rt->replay_start_ns = amb_now_ns();
+  rt->replay_stats.loadBytes = ckptLen;
+  rt->replay_stats.loadNs = rt->replay_start_ns - t0;
+  amb_debug_log("  Checkpoint of %lld bytes loaded, replaying\n", (long long)ckptLen);
+}
+
 // Execute the startup messaging protocol.
 void amb_startup_protocol(int upfd, int downfd) {
   struct log_hdr hdr; memset((void*) &hdr, 0, AMBROSIA_HEADERSIZE);
@@ -636,10 +1427,11 @@ void amb_startup_protocol(int upfd, int downfd) {
     break;
 
   case Checkpoint:
-    fprintf(stderr, "RECOVER mode ... not implemented yet.\n");
-    
-    abort();
-    break;
+    amb_debug_log("Recovering from a checkpoint\n");
+    amb_recover(downfd, buf2 + 1, msgsz - 1);
+    free(buf);
+    return;
+
   default:
     fprintf(stderr, "Protocol violation, did not expect this initial message type from server: %d", msgType);
     abort();
@@ -702,161 +1494,1464 @@ void amb_startup_protocol(int upfd, int downfd) {
   
   // Send Checkpoint message
   // ----------------------------------------
-  send_dummy_checkpoint(upfd);
+  struct amb_runtime* rt = amb_current_or_default();
+  if (rt != NULL)
+    rt->checkpoint(upfd);
+  else
+    send_dummy_checkpoint(upfd);
 
   return;
 }
 
-void amb_initialize_client_runtime(int upport, int downport, int bufSz)
-{
-  int upfd, downfd;
-  amb_connect_sockets(upport, downport, &upfd, &downfd);
-  amb_debug_log("Connections established (%d,%d), beginning protocol.\n", upfd, downfd);
-  amb_startup_protocol(upfd, downfd);
-
-  // Initialize global state that other API entrypoints use:
-  g_to_immortal_coord   = upfd;
-  g_from_immortal_coord = downfd;
-
-  // Set a default:
-  if (bufSz <= 0) bufSz = 20 * 1024 * 1024;
+#ifdef _WIN32
+typedef HANDLE amb_thread_handle;
+#else
+typedef pthread_t amb_thread_handle;
+#endif
 
-  // Initialize the SPSC ring 
-  new_buffer(bufSz);
+// Pin a thread to a CPU (cpu >= 0) and raise it to real-time priority
+// (prio > 0), as far as permitted; see amb_client_options.
+static void amb_place_thread(amb_thread_handle th, int cpu, int prio, const char* what)
+{
+#ifdef _WIN32
+  if (cpu >= 0 && SetThreadAffinityMask(th, (DWORD_PTR)1 << cpu) == 0)
+    fprintf(stderr, "WARNING: could not pin the %s thread to CPU %d (error %lu).\n",
+            what, cpu, GetLastError());
+  if (prio > 0 && !SetThreadPriority(th, THREAD_PRIORITY_TIME_CRITICAL))
+    fprintf(stderr, "WARNING: could not raise the priority of the %s thread (error %lu).\n",
+            what, GetLastError());
+#else
+  int err;
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((err = pthread_setaffinity_np(th, sizeof(set), &set)) != 0)
+      fprintf(stderr, "WARNING: could not pin the %s thread to CPU %d: %s\n",
+              what, cpu, strerror(err));
+  }
+  if (prio > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = prio;
+    if ((err = pthread_setschedparam(th, SCHED_FIFO, &param)) != 0)
+      fprintf(stderr, "WARNING: could not run the %s thread under SCHED_FIFO %d: %s\n",
+              what, prio, strerror(err));
+  }
+#endif
+}
 
+// Start a detached background thread, placed as given, or bail out.
+#ifdef _WIN32
+static void amb_startthread(LPTHREAD_START_ROUTINE fn, void* arg, const char* what, int cpu, int prio)
+#else
+static void amb_startthread(void* (*fn)(void*), void* arg, const char* what, int cpu, int prio)
+#endif
+{
 #ifdef _WIN32
   DWORD lpThreadId;
   HANDLE th = CreateThread(NULL, 0,
-                           amb_network_progress_thread,
-                           NULL, 0,
+                           fn,
+                           arg, 0,
                            & lpThreadId);
   if (th == NULL)
 #else
   pthread_t th;
-  int res = pthread_create(& th, NULL, amb_network_progress_thread, NULL);
+  int res = pthread_create(& th, NULL, fn, arg);
   if (res != 0)
 #endif
   {
-    fprintf(stderr, "ERROR: failed to create network progress thread.\n");
+    fprintf(stderr, "ERROR: failed to create %s thread.\n", what);
     abort();
   }
+  amb_place_thread(th, cpu, prio, what);
 }
 
-void amb_shutdown_client_runtime()
+static void amb_alloc_recv_slots(struct amb_runtime* rt);
+static void amb_free_recv_slots(struct amb_runtime* rt);
+static void amb_open_wake(struct amb_runtime* rt);
+static void amb_startreceive_thread(struct amb_runtime* rt);
+
+void amb_default_client_options(struct amb_client_options* opts)
 {
-  g_amb_client_terminating = 1;
+  memset(opts, 0, sizeof(*opts));
+  opts->bufSz = 0;
+  opts->ringFlags = 0;
+  opts->twoPhaseDispatch = 0;
+  opts->dispatchBatch = NULL;
+  opts->receiveThread = 0;
+  opts->receiveDepth = 0;
+  opts->ioUring = 0;
+  opts->dispatch = NULL;
+  opts->checkpoint = NULL;
+  opts->userData = NULL;
+  opts->sharedIoThread = 0;
+  opts->instanceName = NULL;
+  opts->forkCheckpoint = 0;
+  opts->snapshot = NULL;
+  opts->compressArgs = 0;
+  opts->compressTo = NULL;
+  opts->compressCheckpoints = 0;
+  opts->load = NULL;
+  opts->becomingPrimary = NULL;
+  opts->upgrade = NULL;
+  opts->reconnectTimeoutMs = 0;
+  opts->asyncShutdown = 0;
+  opts->progressCpu = -1;
+  opts->receiveCpu = -1;
+  opts->appCpu = -1;
+  opts->ringNode = -1;
+  opts->realtimePriority = 0;
+  opts->socketProfile = AMB_SOCKETS_DEFAULT;
+  opts->socketBufBytes = 0;
+  opts->busyPollUs = 0;
+  opts->flushMinBytes = 0;
+  opts->flushLingerUs = 0;
+  opts->flushMaxBytes = 0;
+  opts->flushPolicy = NULL;
+  opts->lanes = 0;
+  opts->laneBufSz = 0;
+  for (int lane = 0; lane < AMB_MAX_LANES; lane++) opts->laneWeights[lane] = 0;
+}
+
+void amb_initialize_client_runtime(int upport, int downport, int bufSz)
+{
+  struct amb_client_options opts;
+  amb_default_client_options(&opts);
+  opts.bufSz = bufSz;
+  amb_initialize_client_runtime_opts(upport, downport, &opts);
+}
+
+// Join the shared progress thread, starting it if this is the first.
+static void amb_share_io_thread(struct amb_runtime* rt)
+{
+#ifdef _WIN32
+  long slot = InterlockedIncrement(&g_shared_io_count) - 1;
+#else
+  long slot = __sync_fetch_and_add(&g_shared_io_count, 1);
+#endif
+  if (slot >= AMB_MAX_SHARED_IO) {
+    fprintf(stderr, "ERROR: more than %d runtimes sharing the network progress thread\n", AMB_MAX_SHARED_IO);
+    abort();
+  }
+  g_shared_io[slot] = rt;
+  if (slot == 0)
+    amb_startthread(amb_shared_progress_thread, NULL, "shared network progress",
+                    rt->options.progressCpu, rt->options.realtimePriority);
+}
+
+amb_runtime* amb_runtime_create(int upport, int downport,
+                                const struct amb_client_options* opts)
+{
+  struct amb_runtime* rt = (struct amb_runtime*)calloc(1, sizeof(struct amb_runtime));
+  int upfd, downfd;
+  int bufSz = opts->bufSz;
+  rt->options    = *opts;
+  rt->dispatch   = opts->dispatch   != NULL ? opts->dispatch   : amb_dispatch_method;
+  rt->checkpoint = opts->checkpoint != NULL ? opts->checkpoint : send_dummy_checkpoint;
+  if (rt->dispatch == NULL || rt->checkpoint == NULL) {
+    fprintf(stderr, "ERROR: no %s callback: set it in amb_client_options or define %s\n",
+            rt->dispatch == NULL ? "dispatch" : "checkpoint",
+            rt->dispatch == NULL ? "amb_dispatch_method" : "send_dummy_checkpoint");
+    abort();
+  }
+#ifdef _WIN32
+  if (opts->forkCheckpoint) {
+    fprintf(stderr, "WARNING: forkCheckpoint is not supported on Windows, checkpointing in place.\n");
+    rt->options.forkCheckpoint = 0;
+  }
+  if (opts->reconnectTimeoutMs > 0) {
+    fprintf(stderr, "WARNING: reconnectTimeoutMs is not supported on Windows, ignoring it.\n");
+    rt->options.reconnectTimeoutMs = 0;
+  }
+#endif
+  if (opts->reconnectTimeoutMs > 0 && (opts->ioUring || opts->sharedIoThread)) {
+    fprintf(stderr, "WARNING: reconnectTimeoutMs is not supported with %s, ignoring it.\n",
+            opts->ioUring ? "ioUring" : "sharedIoThread");
+    rt->options.reconnectTimeoutMs = 0;
+  }
+  if (opts->lanes > 0 && (opts->ioUring || opts->sharedIoThread || rt->options.reconnectTimeoutMs > 0)) {
+    fprintf(stderr, "WARNING: lanes are not supported with %s, ignoring them.\n",
+            opts->ioUring ? "ioUring" : opts->sharedIoThread ? "sharedIoThread" : "reconnectTimeoutMs");
+    rt->options.lanes = 0;
+  }
+  if (rt->options.lanes >= AMB_MAX_LANES) {
+    fprintf(stderr, "WARNING: at most %d lanes beside the main ring, not %d.\n",
+            AMB_MAX_LANES - 1, rt->options.lanes);
+    rt->options.lanes = AMB_MAX_LANES - 1;
+  }
+  if (rt->options.lanes > 0 && (opts->flushMinBytes > 0 || opts->flushMaxBytes > 0 || opts->flushPolicy != NULL)) {
+    fprintf(stderr, "WARNING: the flush policy is ignored with lanes.\n");
+    rt->options.flushMinBytes = rt->options.flushMaxBytes = 0;
+    rt->options.flushPolicy = NULL;
+  }
+#ifdef _WIN32
+  if (opts->ringNode >= 0) {
+    fprintf(stderr, "WARNING: ringNode is not supported on Windows, ignoring it.\n");
+    rt->options.ringNode = -1;
+  }
+  if (opts->appCpu >= 0) amb_place_thread(GetCurrentThread(), opts->appCpu, 0, "application");
+#else
+  if (opts->appCpu >= 0) amb_place_thread(pthread_self(), opts->appCpu, 0, "application");
+#endif
+  rt->upport   = upport;
+  rt->downport = downport;
+  rt->last_seq = -1;
+  rt->ckpt_next_seq = -1;
+  rt->space_fd = -1;
+  rt->wake_rd = rt->wake_wr = -1;
+  if (opts->asyncShutdown) amb_open_wake(rt);
+  rt->out = rt->space_ring = & rt->ring;
+  amb_connect_sockets(upport, downport, &upfd, &downfd);
+  rt->upfd   = upfd;
+  rt->downfd = downfd;
+  amb_tune_sockets(rt);
+
+  // Set a default:
+  if (bufSz <= 0) bufSz = 20 * 1024 * 1024;
+
+  // Initialize the SPSC ring before the protocol starts, so that the
+  // application may already enqueue its first checkpoint there.
+  int ringFlags = 0;
+  if (opts->ringFlags & AMB_RING_MIRRORED)  ringFlags |= RRING_MIRRORED;
+  if (opts->ringFlags & AMB_RING_HUGEPAGES) ringFlags |= RRING_HUGEPAGES;
+  ringFlags = rring_init(&rt->ring, bufSz, ringFlags);
+  if (rt->options.ringNode >= 0 && rring_bind_node(&rt->ring, rt->options.ringNode) != 0) {
+    fprintf(stderr, "WARNING: could not place the ring buffer on NUMA node %d: %s\n",
+            rt->options.ringNode, strerror(errno));
+    rt->options.ringNode = -1;
+  }
+  printf(" *** Ring buffer: %d bytes%s%s", rring_capacity(&rt->ring),
+         (ringFlags & RRING_MIRRORED)  ? ", mirrored" : "",
+         (ringFlags & RRING_HUGEPAGES) ? ", huge pages" : "");
+  if (rt->options.ringNode >= 0) printf(", on NUMA node %d", rt->options.ringNode);
+  printf("\n");
+  if ((opts->ringFlags & AMB_RING_HUGEPAGES) && !(ringFlags & RRING_HUGEPAGES))
+    fprintf(stderr, "WARNING: no reserved huge pages for the ring buffer (vm.nr_hugepages),"
+            " only a transparent-huge-page hint%s.\n", (ringFlags & RRING_MIRRORED) ?
+            ", which mirrored rings get only if transparent_hugepage/shmem_enabled allows" : "");
+  if (rt->options.lanes > 0) amb_init_lanes(rt, ringFlags);
+  amb_init_flush_policy(rt);
+
+  amb_debug_log("Connections established (%d,%d), beginning protocol.\n", upfd, downfd);
+  struct amb_runtime* prev = amb_set_current_runtime(rt); // For the checkpoint.
+  amb_startup_protocol(upfd, downfd);
+  amb_set_current_runtime(prev);
+  if (rt->options.lanes > 0) // The first checkpoint goes out first, too.
+    amb_release_lanes(rt, amb_hold_lanes(rt));
+
+  // One io_uring thread can stand in for both of the threads below:
+  if (opts->ioUring) {
+    amb_alloc_recv_slots(rt);
+    if (amb_uring_init(rt)) {
+      if (rt->flush_policy != NULL) {
+        fprintf(stderr, "WARNING: the flush policy is ignored with ioUring.\n");
+        rt->options.flushMinBytes = rt->options.flushMaxBytes = 0;
+        rt->options.flushPolicy = NULL;
+        rt->flush_policy = NULL;
+        rring_set_stamping(& rt->ring, 0); // Nothing reads the dates.
+      }
+      amb_startthread(amb_uring_thread, rt, "io_uring",
+                      opts->progressCpu, opts->realtimePriority);
+      return rt;
+    }
+    if (!opts->receiveThread) amb_free_recv_slots(rt);
+  }
+
+  if (opts->sharedIoThread)
+    amb_share_io_thread(rt);
+  else
+    amb_startthread(amb_network_progress_thread, rt, "network progress",
+                    opts->progressCpu, opts->realtimePriority);
+
+  if (opts->receiveThread)
+    amb_startreceive_thread(rt);
+  return rt;
+}
+
+void amb_initialize_client_runtime_opts(int upport, int downport,
+                                        const struct amb_client_options* opts)
+{
+  struct amb_runtime* rt = amb_runtime_create(upport, downport, opts);
+
+  // Initialize global state that other API entrypoints use:
+  if (g_default_runtime == NULL) {
+    g_default_runtime = rt;
+    rring_set_default(& rt->ring);
+    g_to_immortal_coord   = rt->upfd;
+    g_from_immortal_coord = rt->downfd;
+  }
+}
+
+void amb_runtime_shutdown(amb_runtime* rt)
+{
+  rt->terminating = 1;
+  if (rt->wake_wr >= 0) {
+    char one = 1;
+#ifdef _WIN32
+    send((SOCKET)rt->wake_wr, &one, 1, 0);
+#else
+    if (write(rt->wake_wr, &one, 1) < 0)
+      fprintf(stderr, "WARNING: failed to wake the processing loop: %s\n", strerror(errno));
+#endif
+  }
+}
+
+void amb_shutdown_client_runtime()
+{
+  amb_runtime_shutdown(amb_current_or_default());
+}
+
+int amb_is_replaying()
+{
+  struct amb_runtime* rt = amb_current_or_default();
+  return rt != NULL && rt->replaying;
+}
+
+void amb_get_replay_stats(struct amb_replay_stats* out)
+{
+  *out = amb_current_or_default()->replay_stats;
+}
+
+void amb_get_upgrade_stats(struct amb_upgrade_stats* out)
+{
+  *out = amb_current_or_default()->upgrade_stats;
+}
+
+void amb_get_reconnect_stats(struct amb_reconnect_stats* out)
+{
+  *out = amb_current_or_default()->reconnect_stats;
+}
+
+void amb_get_flush_stats(struct amb_flush_stats* out)
+{
+  *out = amb_current_or_default()->flush_stats;
+}
+
+int amb_set_lane(int lane)
+{
+  struct amb_runtime* rt = amb_current_or_default();
+  int prev = rt->lane;
+  if (lane < 0 || lane > rt->options.lanes) {
+    fprintf(stderr, "ERROR: no lane %d: there are lanes 0 to %d\n", lane, rt->options.lanes);
+    abort();
+  }
+  amb_select_lane(rt, lane);
+  return prev;
+}
+
+void amb_get_lane_stats(struct amb_lane_stats* out)
+{
+  *out = amb_current_or_default()->lane_stats;
+}
+
+void amb_get_ring_occupancy(struct amb_ring_occupancy* out)
+{
+  struct amb_runtime* rt = amb_current_or_default();
+  out->usedBytes   = rring_used(rt->out);
+  out->capacity    = rring_capacity(rt->out);
+  out->queuedLarge = rring_queued_large(rt->out);
+  out->stalls      = rt->out->stalls;
+}
+
+// A generation in space_wanted, bumped by each amb_notify_space, lets
+// amb_check_space take only the request whose fn and arg it read, even
+// when the next asks for the same number of bytes.
+#define AMB_SPACE_BYTES_BITS 40
+#define AMB_SPACE_BYTES_MASK (((int64_t)1 << AMB_SPACE_BYTES_BITS) - 1)
+
+int amb_notify_space(int64_t freeBytes, amb_space_fn fn, void* arg)
+{
+  struct amb_runtime* rt = amb_current_or_default();
+#ifdef __linux__
+  if (rt->space_fd < 0 && (rt->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    fprintf(stderr, "WARNING: could not create an eventfd for amb_notify_space: %s\n",
+            strerror(errno));
+#endif
+  int64_t capacity = rring_capacity(rt->out);
+  int64_t bytes = freeBytes < 1 ? 1 : freeBytes > capacity ? capacity : freeBytes;
+  if (bytes > AMB_SPACE_BYTES_MASK) bytes = AMB_SPACE_BYTES_MASK;
+  rt->space_gen = (rt->space_gen + 1) & (AMB_SPACE_BYTES_MASK >> 1); // Non-negative when shifted.
+  rt->space_wanted = 0; // Withdraw the last request while changing it.
+  rt->space_ring = rt->out;
+  rt->space_fn  = fn;
+  rt->space_arg = arg;
+#ifdef _WIN32
+  MemoryBarrier();
+#else
+  __sync_synchronize(); // The above before the request.
+#endif
+  rt->space_wanted = rt->space_gen << AMB_SPACE_BYTES_BITS | bytes;
+  return rt->space_fd;
+}
+
+void amb_check_space(struct amb_runtime* rt)
+{
+  int64_t wanted = rt->space_wanted;
+  int64_t bytes = wanted & AMB_SPACE_BYTES_MASK;
+  if (bytes == 0) return;
+#ifdef _WIN32
+  MemoryBarrier();
+#else
+  __sync_synchronize(); // The request before what it names.
+#endif
+  struct rring* ring = rt->space_ring;
+  amb_space_fn fn = rt->space_fn; // Before the application may ask again.
+  void* arg = rt->space_arg;
+  if (rring_capacity(ring) - rring_used(ring) < bytes) return;
+  // Take the request only if it is still the one read above, of the
+  // same generation: one the application has made since (whose ring,
+  // fn and arg may be half written) stands, and is checked next time.
+#ifdef _WIN32
+  if (InterlockedCompareExchange64(&rt->space_wanted, 0, wanted) != wanted) return;
+#else
+  if (__sync_val_compare_and_swap(&rt->space_wanted, wanted, 0) != wanted) return;
+#endif
+  if (fn != NULL) fn(arg);
+#ifdef __linux__
+  uint64_t one = 1;
+  if (rt->space_fd >= 0 && write(rt->space_fd, &one, sizeof(one)) < 0)
+    fprintf(stderr, "WARNING: failed to signal the amb_notify_space eventfd: %s\n", strerror(errno));
+#endif
+}
+
+amb_runtime* amb_current_runtime()
+{
+  return t_current_runtime;
+}
+
+void* amb_runtime_user_data(amb_runtime* rt)
+{
+  return rt->options.userData;
 }
 
 
 // Application loop (FIXME: Move into the client library!)
 //------------------------------------------------------------------------------
 
-// Handle the serialized RPC after the (Size,MsgType) have been read
-// off.
+// Decode the serialized RPC after the (Size,MsgType) have been read
+// off, filling in the descriptor without dispatching it.  Return
+// values are decoded the same way, with methodID -1 and the value as
+// the args.
 // 
 // ARGUMENT len: The length argument is an exact bound on the bytes
 // read by this function for this message, which is used in turn to
 // compute the byte size of the arguments at the tail of the payload.
-char* amb_handle_rpc(char* buf, int len) {
+//
+// RETURN: a pointer to the byte following this message.
+char* amb_decode_rpc(char* buf, int len, struct amb_rpc_desc* desc) {
   if (len < 0) {
-    fprintf(stderr, "ERROR: amb_handle_rpc, received negative length!: %d", len);
+    fprintf(stderr, "ERROR: amb_decode_rpc, received negative length!: %d", len);
     abort();
   }
   char* bufstart = buf;
-  char rpc_or_ret = *buf++;             // 1 Reserved byte.
-  int32_t methodID;
-  buf = read_zigzag_int(buf, &methodID);  // 1-5 bytes
-  char fire_forget = *buf++;            // 1 byte
-  int argsLen = len - (buf-bufstart);   // Everything left
-  if (argsLen < 0) {
-    fprintf(stderr, "ERROR: amb_handle_rpc, read past the end of the buffer: start %p, len %d", buf, len);
+  desc->rpcOrRetVal = *buf++;           // 1 byte
+  if (desc->rpcOrRetVal == RetNone) {
+    buf = read_zigzag_int(buf, &desc->methodID);  // 1-5 bytes
+    desc->fireForget = *buf++;            // 1 byte
+  } else {
+    desc->methodID = -1;
+    desc->fireForget = RpcReturnValue;    // Followed by sender and seq, too.
+  }
+  desc->sender = NULL;
+  desc->senderLen = 0;
+  desc->seq = 0;
+  if ((desc->fireForget & ~AMB_ARGS_COMPRESSED) == RpcReturnValue) {
+    buf = read_zigzag_int(buf, &desc->senderLen); // Return address
+    desc->sender = buf; buf += desc->senderLen;
+    buf = read_zigzag_long(buf, &desc->seq);      // 1-10 bytes
+  }
+  desc->argsLen = len - (buf-bufstart); // Everything left
+  desc->args = buf;
+  if (desc->argsLen < 0) {
+    fprintf(stderr, "ERROR: amb_decode_rpc, read past the end of the buffer: start %p, len %d", buf, len);
     abort();
   }
-  amb_debug_log("  Dispatching method %d (rpc/ret %d, fireforget %d) with %d bytes of args...\n",
-                methodID, rpc_or_ret, fire_forget, argsLen);
-  amb_dispatch_method(methodID, buf, argsLen);
-  return (buf+argsLen);
+  return (buf + desc->argsLen);
 }
 
-void amb_normal_processing_loop()
+// Outstanding calls
+// -----------------
+
+static void amb_calls_insert(struct amb_runtime* rt, int64_t seq, amb_result_fn done, void* arg);
+
+// Double the table (or create it), rehashing every entry.
+static void amb_calls_grow(struct amb_runtime* rt) {
+  struct amb_call_slot* old = rt->calls;
+  int oldcap = old == NULL ? 0 : rt->calls_mask + 1;
+  int cap = oldcap ? 2 * oldcap : 64;
+  rt->calls = (struct amb_call_slot*)calloc(cap, sizeof(struct amb_call_slot));
+  if (rt->calls == NULL) {
+    fprintf(stderr, "ERROR: failed to grow the outstanding call table to %d entries\n", cap);
+    abort();
+  }
+  rt->calls_mask = cap - 1;
+  rt->calls_count = 0;
+  for (int i = 0; i < oldcap; i++)
+    if (old[i].seq != 0)
+      amb_calls_insert(rt, old[i].seq, old[i].done, old[i].arg);
+  free(old);
+}
+
+// Sequence numbers are consecutive, so they hash to themselves: the
+// outstanding calls occupy a mostly contiguous run of slots.
+static void amb_calls_insert(struct amb_runtime* rt, int64_t seq, amb_result_fn done, void* arg) {
+  if (rt->calls == NULL || 2 * (rt->calls_count + 1) > rt->calls_mask + 1)
+    amb_calls_grow(rt);
+  int i = (int)(seq & rt->calls_mask);
+  while (rt->calls[i].seq != 0)
+    i = (i + 1) & rt->calls_mask;
+  rt->calls[i].seq  = seq;
+  rt->calls[i].done = done;
+  rt->calls[i].arg  = arg;
+  rt->calls_count++;
+}
+
+// Remove the call with this sequence number into *out.
+// RETURN: 1 if there was one, 0 otherwise.
+static int amb_calls_remove(struct amb_runtime* rt, int64_t seq, struct amb_call_slot* out) {
+  if (rt->calls == NULL) return 0;
+  int mask = rt->calls_mask;
+  int i = (int)(seq & mask);
+  while (rt->calls[i].seq != seq) {
+    if (rt->calls[i].seq == 0) return 0;
+    i = (i + 1) & mask;
+  }
+  *out = rt->calls[i];
+  // Backward-shift deletion (no tombstones): move each later entry of
+  // the probe run into the hole, unless that would put it before its
+  // home slot.
+  int hole = i;
+  for (int j = (i + 1) & mask; rt->calls[j].seq != 0; j = (j + 1) & mask) {
+    int home = (int)(rt->calls[j].seq & mask);
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      rt->calls[hole] = rt->calls[j];
+      hole = j;
+    }
+  }
+  rt->calls[hole].seq = 0;
+  rt->calls_count--;
+  return 1;
+}
+
+// Hand a return value to the call it answers.
+static void amb_complete_call(struct amb_runtime* rt, struct amb_rpc_desc* desc) {
+  struct amb_call_slot call;
+  if (!amb_calls_remove(rt, desc->seq, &call)) {
+    // E.g. one made before a checkpoint, and not restored by load.
+    amb_debug_log("  Ignoring return value for unknown call %lld\n", (long long)desc->seq);
+    return;
+  }
+  amb_debug_log("  Completing call %lld (return type %d) with %d bytes of value...\n",
+                (long long)desc->seq, desc->rpcOrRetVal, desc->argsLen);
+  call.done(desc->seq, desc->rpcOrRetVal, desc->args, desc->argsLen, call.arg);
+}
+
+int64_t amb_call_rpc(char* dest, int32_t destLen, int32_t methodID,
+                     void* args, int argsLen, amb_result_fn done, void* arg) {
+  struct amb_runtime* rt = amb_current_or_default();
+  char* sender = rt->options.instanceName != NULL ? rt->options.instanceName : "";
+  int32_t senderLen = strlen(sender);
+  int64_t seq = ++rt->next_seq;
+  amb_calls_insert(rt, seq, done, arg);
+  amb_runtime_attach(rt, dest, destLen);
+  char* start = rring_reserve(rt->out, 5 + 1 + 5 + destLen + 1 + 5 + 1
+                                      + 5 + senderLen + 10 + argsLen);
+  char* cur = amb_write_outgoing_call_hdr(start, dest, destLen, methodID,
+                                          sender, senderLen, seq, argsLen);
+  memcpy(cur, args, argsLen); cur += argsLen;
+  rring_release(rt->out, cur - start);
+  return seq;
+}
+
+static void amb_complete_future(int64_t seq, char retType, void* value, int valueLen, void* arg) {
+  struct amb_future* fut = (struct amb_future*)arg;
+  fut->value = NULL;
+  if (valueLen > 0) {
+    fut->value = malloc(valueLen);
+    if (fut->value == NULL) {
+      fprintf(stderr, "ERROR: failed to allocate %d bytes for the return value of call %lld\n",
+              valueLen, (long long)seq);
+      abort();
+    }
+    memcpy(fut->value, value, valueLen);
+  }
+  fut->valueLen = valueLen;
+  fut->retType  = retType;
+  fut->done = 1; // Publish (total store order).
+}
+
+int64_t amb_call_rpc_future(char* dest, int32_t destLen, int32_t methodID,
+                            void* args, int argsLen, struct amb_future* fut) {
+  fut->done = 0;
+  fut->retType = RetNone;
+  fut->value = NULL;
+  fut->valueLen = 0;
+  fut->seq = amb_call_rpc(dest, destLen, methodID, args, argsLen, amb_complete_future, fut);
+  return fut->seq;
+}
+
+void amb_future_release(struct amb_future* fut) {
+  free(fut->value);
+  fut->value = NULL;
+  fut->valueLen = 0;
+}
+
+int amb_outstanding_calls() {
+  return amb_current_or_default()->calls_count;
+}
+
+int64_t amb_get_call_seq() {
+  return amb_current_or_default()->next_seq;
+}
+
+int amb_get_outstanding_seqs(int64_t* seqs, int max) {
+  struct amb_runtime* rt = amb_current_or_default();
+  int n = 0;
+  for (int i = 0; rt->calls != NULL && i <= rt->calls_mask; i++)
+    if (rt->calls[i].seq != 0 && n++ < max)
+      seqs[n - 1] = rt->calls[i].seq;
+  return n;
+}
+
+void amb_set_call_seq(int64_t seq) {
+  amb_current_or_default()->next_seq = seq;
+}
+
+void amb_expect_return(int64_t seq, amb_result_fn done, void* arg) {
+  struct amb_runtime* rt = amb_current_or_default();
+  struct amb_call_slot old;
+  if (seq <= 0 || seq > rt->next_seq) {
+    fprintf(stderr, "ERROR: amb_expect_return for call %lld, which was never issued (last %lld)\n",
+            (long long)seq, (long long)rt->next_seq);
+    abort();
+  }
+  if (amb_calls_remove(rt, seq, &old))
+    fprintf(stderr, "WARNING: call %lld was already expected, replacing its callback\n", (long long)seq);
+  amb_calls_insert(rt, seq, done, arg);
+}
+
+void amb_send_return_value(char* dest, int32_t destLen, int64_t seq,
+                           char retType, void* value, int valueLen) {
+  struct amb_runtime* rt = amb_current_or_default();
+  char* sender = rt->options.instanceName != NULL ? rt->options.instanceName : "";
+  int32_t senderLen = strlen(sender);
+  amb_runtime_attach(rt, dest, destLen);
+  char* start = rring_reserve(rt->out, 5 + 1 + 5 + destLen + 1
+                                      + 5 + senderLen + 10 + valueLen);
+  char* cur = amb_write_return_value_hdr(start, dest, destLen, retType,
+                                         sender, senderLen, seq, valueLen);
+  memcpy(cur, value, valueLen); cur += valueLen;
+  rring_release(rt->out, cur - start);
+}
+
+const struct amb_rpc_desc* amb_current_call() {
+  struct amb_runtime* rt = amb_current_or_default();
+  return rt != NULL ? rt->current_call : NULL;
+}
+
+void amb_reply(char retType, void* value, int valueLen) {
+  const struct amb_rpc_desc* call = amb_current_call();
+  if (call == NULL || call->sender == NULL) return; // Fire and forget.
+  amb_send_return_value(call->sender, call->senderLen, call->seq, retType, value, valueLen);
+}
+
+// Dispatch one decoded RPC, making it the current call.
+static inline void amb_dispatch_one(struct amb_runtime* rt, struct amb_rpc_desc* desc) {
+  rt->current_call = desc;
+  AMB_TRACE2(dispatch_begin, desc->methodID, desc->argsLen);
+  rt->dispatch(desc->methodID, desc->args, desc->argsLen);
+  AMB_TRACE1(dispatch_end, desc->methodID);
+  rt->current_call = NULL;
+}
+
+// Two-phase dispatch
+// ------------------
+
+static inline void amb_push_pending(struct amb_runtime* rt, struct amb_rpc_desc* desc) {
+  if (rt->pending_count == rt->pending_capacity) {
+    rt->pending_capacity = rt->pending_capacity ? 2 * rt->pending_capacity : 256;
+    rt->pending_rpcs = (struct amb_rpc_desc*)
+      realloc(rt->pending_rpcs, rt->pending_capacity * sizeof(struct amb_rpc_desc));
+    if (rt->pending_rpcs == NULL) {
+      fprintf(stderr, "ERROR: failed to grow the RPC descriptor array to %d entries\n", rt->pending_capacity);
+      abort();
+    }
+  }
+  rt->pending_rpcs[rt->pending_count++] = *desc;
+}
+
+// How many descriptors ahead to prefetch argument bytes:
+#define AMB_PREFETCH_DISTANCE 4
+
+// Phase two: hand the decoded run of RPCs to the application.
+static void amb_flush_pending(struct amb_runtime* rt) {
+  int n = rt->pending_count;
+  if (n == 0) return;
+  rt->pending_count = 0;
+  amb_debug_log(" Dispatching a run of %d decoded RPCs\n", n);
+  if (rt->options.dispatchBatch != NULL) {
+    rt->options.dispatchBatch(rt->pending_rpcs, n);
+  } else {
+    for (int i = 0; i < n; i++) {
+      if (i + AMB_PREFETCH_DISTANCE < n)
+        amb_prefetch(rt->pending_rpcs[i + AMB_PREFETCH_DISTANCE].args);
+      amb_dispatch_one(rt, & rt->pending_rpcs[i]);
+    }
+  }
+  for (int i = 0; i < rt->unpacked_count; i++)
+    free(rt->unpacked[i]);
+  rt->unpacked_count = 0;
+}
+
+// If the RPC's arguments are compressed (AMB_ARGS_COMPRESSED), point
+// desc at them decompressed, and write them to *unpacked, for the
+// caller to free once dispatched (otherwise NULL).  A malformed or
+// oversized frame is dropped with a warning, rather than aborting:
+// it is in the log, so it would come back on every recovery.
+//
+// RETURN: whether to dispatch the RPC.
+static int amb_unpack_args(struct amb_runtime* rt, struct amb_rpc_desc* desc, char** unpacked) {
+  *unpacked = NULL;
+  if (!(desc->fireForget & AMB_ARGS_COMPRESSED)) return 1;
+  desc->fireForget &= ~AMB_ARGS_COMPRESSED;
+  int64_t raw = amb_frame_raw_size(desc->args, desc->argsLen);
+  if (raw < 0 || raw > AMB_MAX_UNPACKED_ARGS || raw > amb_frame_max_raw(desc->argsLen)) {
+    fprintf(stderr, "WARNING: dropping a call to method %d whose %d bytes of compressed arguments"
+            " are not a frame, or claim %lld bytes\n", desc->methodID, desc->argsLen, (long long)raw);
+    rt->zstats.rejected++;
+    return 0;
+  }
+  int64_t t0 = amb_now_ns();
+  char* args = (char*)malloc(raw > 0 ? raw : 1);
+  if (args == NULL) {
+    fprintf(stderr, "ERROR: failed to allocate %lld bytes for decompressed arguments\n", (long long)raw);
+    abort();
+  }
+  if (amb_try_decompress(desc->args, desc->argsLen, args) < 0) {
+    fprintf(stderr, "WARNING: dropping a call to method %d whose compressed arguments are malformed\n",
+            desc->methodID);
+    free(args);
+    rt->zstats.rejected++;
+    return 0;
+  }
+  rt->zstats.decompressNs += amb_now_ns() - t0;
+  rt->zstats.unpacked++;
+  rt->zstats.unpackedBytes += raw;
+  desc->args = args;
+  desc->argsLen = (int)raw;
+  *unpacked = args;
+  return 1;
+}
+
+static void amb_keep_unpacked(struct amb_runtime* rt, char* args) {
+  if (rt->unpacked_count == rt->unpacked_capacity) {
+    rt->unpacked_capacity = rt->unpacked_capacity ? 2 * rt->unpacked_capacity : 16;
+    rt->unpacked = (char**)realloc(rt->unpacked, rt->unpacked_capacity * sizeof(char*));
+    if (rt->unpacked == NULL) {
+      fprintf(stderr, "ERROR: failed to grow the decompressed arguments array to %d entries\n",
+              rt->unpacked_capacity);
+      abort();
+    }
+  }
+  rt->unpacked[rt->unpacked_count++] = args;
+}
+
+// Either dispatch an RPC now, or queue it for phase two.  Return
+// values complete their calls immediately.
+static inline char* amb_process_rpc(struct amb_runtime* rt, char* buf, int len, int two_phase) {
+  struct amb_rpc_desc desc;
+  char* next = amb_decode_rpc(buf, len, &desc);
+  if (desc.rpcOrRetVal != RetNone) {
+    if (two_phase) amb_flush_pending(rt); // Observe the RPCs before it.
+    amb_complete_call(rt, &desc);
+    return next;
+  }
+  if (rt->replaying) rt->replay_stats.replayed++;
+  char* unpacked;
+  if (!amb_unpack_args(rt, &desc, &unpacked)) return next;
+  if (!two_phase) {
+    amb_debug_log("  Dispatching method %d (rpc/ret %d, fireforget %d) with %d bytes of args...\n",
+                  desc.methodID, desc.rpcOrRetVal, desc.fireForget, desc.argsLen);
+    amb_dispatch_one(rt, &desc);
+    free(unpacked);
+    return next;
+  }
+  if (unpacked != NULL) amb_keep_unpacked(rt, unpacked);
+  if (rt->pending_count < AMB_PREFETCH_DISTANCE)
+    amb_prefetch(desc.args); // Early ones will not be covered during dispatch.
+  amb_push_pending(rt, &desc);
+  return next;
+}
+
+// Handle the serialized RPC after the (Size,MsgType) have been read
+// off: decode it and immediately dispatch it.
+char* amb_handle_rpc(char* buf, int len) {
+  return amb_process_rpc(amb_current_or_default(), buf, len, 0);
+}
+
+// Checkpoints
+// -----------
+
+static void amb_checkpoint_completed(struct amb_runtime* rt, int64_t start, int64_t bytes)
+{
+  struct amb_checkpoint_stats* st = & rt->ckpt_stats;
+  st->lastWriteNs = amb_now_ns() - start;
+  st->lastBytes   = bytes;
+  st->totalBytes += bytes;
+  st->completed++;
+}
+
+#ifndef _WIN32
+// A checkpoint being written by a child process.
+struct amb_checkpoint_job {
+  struct amb_runtime* rt;
+  pid_t   pid;
+  int64_t start;
+};
+
+static volatile int g_checkpoint_child_done = 0;
+
+// In the child: send the child's ring to the checkpoint socket.
+static void* amb_checkpoint_drain_thread(void* arg)
+{
+  struct amb_runtime* rt = (struct amb_runtime*)arg;
+  while (1) {
+    int done = g_checkpoint_child_done; // Before looking at the ring.
+    if (!amb_progress_ring(& rt->ring, rt->upfd, NULL) && done)
+      break;
+    if (!done) amb_yield_thread();
+  }
+  return NULL;
+}
+
+// In the child, which has a copy of the parent's memory but only this
+// thread: write the checkpoint to fd, and exit.
+static void amb_checkpoint_child(struct amb_runtime* rt, int fd)
+{
+  // The ring is shared with the parent if it is mirrored, and its
+  // contents are the parent's to send in any case.  Start a new one:
+  int cap = rring_capacity(& rt->ring);
+  memset(& rt->ring, 0, sizeof(rt->ring));
+  rring_init(& rt->ring, cap, 0);
+  rt->out = & rt->ring;
+  amb_set_current_runtime(rt);
+  rt->upfd = fd;
+
+  pthread_t th;
+  if (pthread_create(&th, NULL, amb_checkpoint_drain_thread, rt) != 0) {
+    fprintf(stderr, "ERROR: checkpoint process failed to create its send thread.\n");
+    _exit(1);
+  }
+  rt->checkpoint(fd);
+  g_checkpoint_child_done = 1;
+  pthread_join(th, NULL);
+  _exit(0); // Skip atexit handlers and stdio buffers: they are the parent's.
+}
+
+// Called by the ring's consumer once the child has closed its end.
+static void amb_checkpoint_stream_eof(int fd, int64_t bytes, void* arg)
+{
+  struct amb_checkpoint_job* job = (struct amb_checkpoint_job*)arg;
+  int status = 0;
+  close(fd);
+  if (waitpid(job->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "ERROR: checkpoint process %d failed (status %d) after %lld bytes\n",
+            (int)job->pid, status, (long long)bytes);
+    abort();
+  }
+  amb_debug_log("Checkpoint process %d finished, %lld bytes\n", (int)job->pid, (long long)bytes);
+  amb_checkpoint_completed(job->rt, job->start, bytes);
+  job->rt->retain_stream = 0;
+  free(job);
+}
+
+// Fork, and queue what the child writes to be sent next.
+static void amb_fork_checkpoint(struct amb_runtime* rt, int64_t start)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    fprintf(stderr, "ERROR: failed to create checkpoint socket: %s\n", amb_get_error_string());
+    abort();
+  }
+  fflush(stdout); // Otherwise the child may print what is buffered too.
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "ERROR: failed to fork checkpoint process: %s\n", amb_get_error_string());
+    abort();
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    amb_checkpoint_child(rt, sv[1]);
+  }
+  close(sv[1]);
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  struct amb_checkpoint_job* job = (struct amb_checkpoint_job*)malloc(sizeof(*job));
+  job->rt    = rt;
+  job->pid   = pid;
+  job->start = start;
+  rt->retain_stream = 1;
+  rring_release_fd(& rt->ring, sv[0], amb_checkpoint_stream_eof, job);
+  rt->retain_mark = rt->ring.produced;
+}
+#endif
+
+// Handle TakeCheckpoint.
+static void amb_take_checkpoint(struct amb_runtime* rt)
+{
+  struct amb_checkpoint_stats* st = & rt->ckpt_stats;
+  int64_t start = amb_now_ns();
+  int64_t before = rt->ring.produced;
+  AMB_TRACE0(checkpoint_begin);
+  int lane = rt->options.lanes > 0 ? amb_hold_lanes(rt) : 0;
+  if (rt->options.snapshot != NULL)
+    rt->options.snapshot();
+#ifndef _WIN32
+  if (rt->options.forkCheckpoint)
+    amb_fork_checkpoint(rt, start);
+  else
+#endif
+  {
+    rt->checkpoint(rt->upfd);
+    amb_checkpoint_completed(rt, start, rt->ring.produced - before);
+    rt->retain_mark = rt->ring.produced;
+  }
+  if (rt->options.lanes > 0) amb_release_lanes(rt, lane);
+  AMB_TRACE1(checkpoint_end, rt->ring.produced - before);
+  rt->ckpt_next_seq = -1;
+  int64_t pause = amb_now_ns() - start;
+  st->lastPauseNs   = pause;
+  st->totalPauseNs += pause;
+  if (pause > st->maxPauseNs) st->maxPauseNs = pause;
+  st->taken++;
+}
+
+void amb_get_checkpoint_stats(struct amb_checkpoint_stats* out)
+{
+  *out = amb_current_or_default()->ckpt_stats;
+}
+
+// Checkpoint streams
+// ------------------
+
+// Checkpoint bytes copied per ring reservation, at most:
+#define AMB_CHECKPOINT_CHUNK (1024 * 1024)
+
+struct amb_checkpoint_writer {
+  struct amb_runtime* rt; // NULL outside any runtime (never compressed).
+  int64_t len, written;
+  amb_zstream* z;         // NULL: copied into the ring as is.
+};
+
+static void amb_write_checkpoint_hdr(int64_t len) {
+  int32_t msgsize = 1 + 8;
+  char* buf = reserve_buffer(5 + msgsize);
+  char* cur = write_zigzag_int(buf, msgsize); // Size (including type tag)
+  *cur++ = Checkpoint;                         // Type
+  memcpy(cur, &len, 8);                        // 8 byte size
+  cur += 8;
+  release_buffer(cur - buf);
+}
+
+amb_checkpoint_writer* amb_checkpoint_begin(int64_t len, int flags) {
+  amb_checkpoint_writer* w = (amb_checkpoint_writer*)calloc(1, sizeof(amb_checkpoint_writer));
+  w->rt  = amb_current_or_default();
+  w->len = len;
+  if (w->rt != NULL && w->rt->options.compressCheckpoints && !(flags & AMB_NO_COMPRESS))
+    w->z = amb_zstream_begin();
+  else
+    amb_write_checkpoint_hdr(len);
+  return w;
+}
+
+void amb_checkpoint_write(amb_checkpoint_writer* w, const void* p, int64_t len) {
+  if (len > w->len - w->written) {
+    fprintf(stderr, "ERROR: checkpoint of %lld bytes overrun by %lld\n", (long long)w->len,
+            (long long)(w->written + len - w->len));
+    abort();
+  }
+  w->written += len;
+  if (w->z != NULL) {
+    int64_t t0 = amb_now_ns();
+    amb_zstream_write(w->z, p, len);
+    w->rt->zstats.compressNs += amb_now_ns() - t0;
+    return;
+  }
+  // Copy in pieces that fit the ring:
+  int chunk = buffer_capacity() / 4;
+  if (chunk > AMB_CHECKPOINT_CHUNK) chunk = AMB_CHECKPOINT_CHUNK;
+  if (chunk < 4096) chunk = 4096;
+  for (int64_t off = 0; off < len; off += chunk) {
+    int n = len - off < chunk ? (int)(len - off) : chunk;
+    char* dst = reserve_buffer(n);
+    memcpy(dst, (const char*)p + off, n);
+    release_buffer(n);
+  }
+}
+
+int64_t amb_checkpoint_end(amb_checkpoint_writer* w) {
+  int64_t sent = w->len;
+  if (w->written != w->len) {
+    fprintf(stderr, "ERROR: checkpoint of %lld bytes ended after %lld\n", (long long)w->len,
+            (long long)w->written);
+    abort();
+  }
+  if (w->z != NULL) {
+    struct amb_compress_stats* st = & w->rt->zstats;
+    int64_t t0 = amb_now_ns();
+    char* frame = amb_zstream_finish(w->z, &sent);
+    st->compressNs += amb_now_ns() - t0;
+    st->frames++;
+    st->rawBytes += w->len;
+    st->compressedBytes += sent;
+    amb_write_checkpoint_hdr(sent);
+    // By reference, in pieces a ring descriptor can hold:
+    struct rring* ring = rring_current();
+    for (int64_t off = 0; off < sent; off += 1 << 30) {
+      int n = sent - off < (1 << 30) ? (int)(sent - off) : (1 << 30);
+      rring_release_ref(ring, frame + off, n, off + n == sent ? amb_free_frame : amb_no_release, frame);
+    }
+    amb_debug_log("  Checkpoint of %lld bytes compressed to %lld\n", (long long)w->len, (long long)sent);
+  }
+  free(w);
+  return sent;
+}
+
+void amb_get_compress_stats(struct amb_compress_stats* out)
+{
+  *out = amb_current_or_default()->zstats;
+}
+
+// End replay: from the next message on, this is the primary.
+static void amb_become_primary(struct amb_runtime* rt, int checkpoint)
+{
+  int64_t t0 = amb_now_ns();
+  if (checkpoint) amb_take_checkpoint(rt);
+  if (!rt->replaying) return;
+  rt->replaying = 0;
+  rt->replay_stats.replayNs = t0 - rt->replay_start_ns;
+  if (rt->options.becomingPrimary != NULL)
+    rt->options.becomingPrimary();
+  rt->replay_stats.promoteNs = amb_now_ns() - t0;
+}
+
+// Migrate to the new version of the service (UpgradeService), and
+// with UpgradeTakeCheckpoint, checkpoint it and become the primary.
+static void amb_upgrade(struct amb_runtime* rt, int checkpoint)
+{
+  struct amb_upgrade_stats* st = & rt->upgrade_stats;
+  if (rt->options.upgrade == NULL) {
+    fprintf(stderr, "ERROR: received an upgrade message, but there is no"
+            " amb_client_options.upgrade callback to migrate the state\n");
+    abort();
+  }
+  int64_t start = amb_now_ns();
+  struct amb_client_options next = rt->options;
+  rt->options.upgrade(&next);
+  st->lastMigrateNs = amb_now_ns() - start;
+
+  rt->options.dispatch        = next.dispatch;
+  rt->options.dispatchBatch   = next.dispatchBatch;
+  rt->options.checkpoint      = next.checkpoint;
+  rt->options.snapshot        = next.snapshot;
+  rt->options.load            = next.load;
+  rt->options.becomingPrimary = next.becomingPrimary;
+  rt->options.upgrade         = next.upgrade;
+  if (next.dispatch != NULL)   rt->dispatch   = next.dispatch;
+  if (next.checkpoint != NULL) rt->checkpoint = next.checkpoint;
+
+  if (checkpoint) amb_become_primary(rt, 1);
+  int64_t window = amb_now_ns() - start;
+  st->lastWindowNs = window;
+  if (window > st->maxWindowNs) st->maxWindowNs = window;
+  st->upgrades++;
+  amb_debug_log(" Upgraded in %lld ns\n", (long long)window);
+}
+
+// The coordinator came back after a lost connection (see
+// amb_reconnect), and is about to replay the log after its last
+// checkpoint.
+static void amb_resume(struct amb_runtime* rt)
+{
+  if (rt->options.reconnectTimeoutMs <= 0) {
+    fprintf(stderr, "ERROR: unexpected Checkpoint message from the coordinator\n");
+    abort();
+  }
+  if (rt->retain_mark != rt->resent_mark) {
+    fprintf(stderr, "ERROR: a checkpoint was taken after the connection to the coordinator"
+            " was lost, cannot resume\n");
+    abort();
+  }
+  amb_debug_log(" Resuming after the last record handled, %lld\n", (long long)rt->last_seq);
+  rt->resuming = 1;
+  rt->replaying = 1;
+}
+
+// While resuming: whether the record with this seqID was handled
+// before the connection was lost.
+static int amb_resume_skip(struct amb_runtime* rt, int64_t seq)
+{
+  if (rt->resuming == 1) {
+    // The first record replayed must be the first after this process's
+    // last checkpoint, or the coordinator restarted from another one:
+    if (rt->ckpt_next_seq >= 0 ? seq != rt->ckpt_next_seq : seq <= rt->last_seq) {
+      fprintf(stderr, "ERROR: the coordinator replays from log record %lld, not after this"
+              " process's last checkpoint (%lld), cannot resume\n",
+              (long long)seq, (long long)rt->ckpt_next_seq);
+      abort();
+    }
+    rt->resuming = 2;
+  }
+  if (seq <= rt->last_seq) {
+    rt->reconnect_stats.skipped++;
+    return 1;
+  }
+  rt->resuming = 0;
+  return 0;
+}
+
+// Process every message in one log record (the bytes following the
+// log header).  RPCs keep their log order relative to each other and
+// to the control messages that are interleaved with them.
+static void amb_process_log_record(struct amb_runtime* rt, char* buf, int payloadsize)
+{
+  int two_phase = rt->options.twoPhaseDispatch || rt->options.dispatchBatch != NULL;
+
+  // Read a stream of messages from the log record:
+  int rawsize = 0;
+  char* bufcur = buf;
+  char* limit = buf + payloadsize;
+  int ind = 0;
+  while (bufcur < limit) {
+    amb_debug_log(" Processing message %d in log record, starting at offset %d (%p), remaining bytes %d\n",
+                  ind++, bufcur-buf, bufcur, limit-bufcur);
+    bufcur = read_zigzag_int(bufcur, &rawsize);  // Size
+    char tag = *bufcur++;                      // Type
+    rawsize--; // Discount type byte.
+
+    // Anything other than an RPC must observe the effects of all RPCs before it:
+    if (two_phase && tag != RPC && tag != RPCBatch)
+      amb_flush_pending(rt);
+
+    switch(tag) {
+
+    case RPC:
+      amb_debug_log(" It's an incoming RPC.. size without len/tag bytes: %d\n", rawsize);
+      // print_hex_bytes(bufcur,rawsize);printf("\n");
+      bufcur = amb_process_rpc(rt, bufcur, rawsize, two_phase);
+      break;
+
+    case InitialMessage:
+      amb_debug_log(" Received InitialMessage back from server.  Processing..\n");
+      // FIXME: InitialMessage should be an arbitrary blob...
+      // but here we're following the convention that it's an actual message.
+      break;
+
+    case RPCBatch:
+      { int32_t numMsgs = -1;
+        bufcur = read_zigzag_int(bufcur, &numMsgs);
+        amb_debug_log(" Receiving RPC batch of %d messages.\n", numMsgs);
+        char* batchstart = bufcur;
+        for (int i=0; i < numMsgs; i++) {
+          amb_debug_log(" Reading off message %d/%d of batch, current offset %d, bytes left: %d.\n",
+                        i+1, numMsgs, bufcur-batchstart, rawsize);
+          char* lastbufcur = bufcur;
+          int32_t msgsize = -100;
+          bufcur = read_zigzag_int(bufcur, &msgsize);  // Size (unneeded)            
+          char type = *bufcur++;                     // Type - IGNORED
+          amb_debug_log(" --> Read message, type %d, payload size %d\n", type, msgsize-1);
+          bufcur = amb_process_rpc(rt, bufcur, msgsize-1, two_phase);
+          amb_debug_log(" --> handling that message read %d bytes off the batch\n", (int)(bufcur - lastbufcur));
+          rawsize -= (bufcur - lastbufcur);
+        }
+      }
+      break;
+
+    case TakeCheckpoint:
+      amb_take_checkpoint(rt);
+      break;
+
+    case TakeBecomingPrimaryCheckpoint:
+      amb_become_primary(rt, 1);
+      break;
+
+    case BecomingPrimary:
+      amb_debug_log(" Becoming primary, replay is over\n");
+      amb_become_primary(rt, 0);
+      break;
+
+    case Checkpoint:
+      amb_resume(rt);
+      bufcur += rawsize; // Its bytes were skipped as it was received.
+      break;
+
+    case UpgradeTakeCheckpoint:
+    case UpgradeService:
+      amb_debug_log(" Upgrading the service%s\n", tag == UpgradeTakeCheckpoint ? ", then checkpointing" : "");
+      amb_upgrade(rt, tag == UpgradeTakeCheckpoint);
+      two_phase = rt->options.twoPhaseDispatch || rt->options.dispatchBatch != NULL;
+      break;
+
+    default:
+      fprintf(stderr, "ERROR: unexpected or unrecognized message type: %d", tag);
+      abort();
+      break;
+    }
+  }
+  if (two_phase) amb_flush_pending(rt);
+}
+
+// Handle a log record, keeping track of where in the log it is.
+static void amb_process_logged(struct amb_runtime* rt, struct log_hdr* hdr, char* buf)
+{
+  int64_t seq = hdr->seqID; // Negative for messages not from the log.
+  if (seq >= 0 && rt->resuming && amb_resume_skip(rt, seq))
+    return;
+  amb_process_log_record(rt, buf, hdr->totalSize - AMBROSIA_HEADERSIZE);
+  if (seq >= 0 && rt->resuming != 1) { // (Not the Checkpoint that starts a resume.)
+    rt->last_seq = seq;
+    if (rt->ckpt_next_seq < 0) rt->ckpt_next_seq = seq;
+  }
+}
+
+// Read one complete log record (header and payload) off the socket,
+// into a buffer that is grown as needed and reused.
+static void amb_recv_log_record(int downfd, struct log_hdr* hdr, char** buf, int* bufsize)
+{
+  amb_recv_log_hdr(downfd, hdr);
+  int payloadsize = hdr->totalSize - AMBROSIA_HEADERSIZE;
+  if (payloadsize > *bufsize) {
+    free(*buf);
+    *bufsize = payloadsize;
+    *buf = (char*)malloc(payloadsize);
+  }
+  if (recv(downfd, *buf, payloadsize, MSG_WAITALL) < payloadsize) {
+    fprintf(stderr,"\nERROR: connection interrupted. Did not receive all %d bytes of log record payload.\n",
+            payloadsize);
+    abort();
+  }
+#ifdef AMBCLIENT_DEBUG  
+  amb_debug_log("Entire Message Payload (%d bytes): ", payloadsize);
+  print_hex_bytes(amb_dbg_fd, *buf, payloadsize); fprintf(amb_dbg_fd,"\n");
+#endif
+}
+
+#ifndef _WIN32
+// Read exactly len bytes.  RETURN: 0, or -1 if the connection failed.
+static int amb_try_recv(int fd, void* buf, int64_t len)
+{
+  while (len > 0) {
+    int n = recv(fd, (char*)buf, len < (1 << 30) ? len : (1 << 30), MSG_WAITALL);
+    if (n <= 0) return -1;
+    buf = (char*)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+// As amb_recv_log_record, but a lost connection makes it wait for the
+// network progress thread to reconnect (amb_reconnect), and read from
+// the new one.  That starts with the coordinator's checkpoint, whose
+// bytes are read and dropped here: only the record announcing it is
+// passed on, to mark where the replay begins (amb_resume).
+static int amb_recv_resumable(int fd, struct log_hdr* hdr, char** buf, int* bufsize)
 {
-  int upfd   = g_to_immortal_coord;
-  int downfd = g_from_immortal_coord;
+  if (amb_try_recv(fd, hdr, AMBROSIA_HEADERSIZE)) return -1;
+  int payloadsize = hdr->totalSize - AMBROSIA_HEADERSIZE;
+  if (payloadsize > *bufsize) {
+    free(*buf);
+    *bufsize = payloadsize;
+    *buf = (char*)malloc(payloadsize);
+  }
+  if (amb_try_recv(fd, *buf, payloadsize)) return -1;
+  int32_t msgsz = 0;
+  char* msg = read_zigzag_int(*buf, &msgsz);
+  if (payloadsize > 1 && *msg == Checkpoint) {
+    int64_t left = amb_checkpoint_msg_len(msg + 1, msgsz - 1);
+    char scratch[64 * 1024];
+    amb_debug_log("Skipping the coordinator's checkpoint (%lld bytes)\n", (long long)left);
+    while (left > 0) {
+      int n = left < (int64_t)sizeof(scratch) ? (int)left : (int)sizeof(scratch);
+      if (amb_try_recv(fd, scratch, n)) return -1;
+      left -= n;
+    }
+  }
+  return 0;
+}
+#endif
+
+// Read the next log record for the processing loop, from whichever
+// thread receives.
+static void amb_recv_next_record(struct amb_runtime* rt, struct log_hdr* hdr, char** buf, int* bufsize)
+{
+#ifndef _WIN32
+  while (rt->options.reconnectTimeoutMs > 0) {
+    int epoch = rt->link_epoch;
+    int fd = rt->downfd;
+    if (amb_recv_resumable(fd, hdr, buf, bufsize) == 0) {
+      AMB_TRACE2(record_received, hdr->seqID, hdr->totalSize - AMBROSIA_HEADERSIZE);
+      amb_renew_quickack(rt);
+      return;
+    }
+    rt->link_lost = 1;
+    while (rt->link_epoch == epoch)
+      amb_sleep_seconds(0.001);
+    if (fd != rt->downfd) close(fd);
+  }
+#endif
+  amb_recv_log_record(rt->downfd, hdr, buf, bufsize);
+  AMB_TRACE2(record_received, hdr->seqID, hdr->totalSize - AMBROSIA_HEADERSIZE);
+  amb_renew_quickack(rt);
+}
+
+// Wait until the coordinator has sent more, or amb_runtime_shutdown
+// wakes the wait (asyncShutdown only).
+//
+// RETURN: 0 if the runtime is shutting down.
+static int amb_await_record(struct amb_runtime* rt)
+{
+  while (!rt->terminating) {
+#ifdef _WIN32
+    WSAPOLLFD p[2] = { { (SOCKET)rt->downfd, POLLIN, 0 }, { (SOCKET)rt->wake_rd, POLLIN, 0 } };
+    int n = WSAPoll(p, 2, -1);
+#else
+    struct pollfd p[2] = { { rt->downfd, POLLIN, 0 }, { rt->wake_rd, POLLIN, 0 } };
+    int n = poll(p, 2, -1);
+    if (n < 0 && errno == EINTR) continue;
+#endif
+    if (n < 0 || p[0].revents != 0) return 1; // Readable, or failed: recv reports which.
+  }
+  return 0;
+}
+
+// Read off any wake-ups, so that the loop may wait again.
+static void amb_drain_wake(struct amb_runtime* rt)
+{
+  char scratch[64];
+#ifdef _WIN32
+  u_long avail = 0;
+  while (ioctlsocket((SOCKET)rt->wake_rd, FIONREAD, &avail) == 0 && avail > 0)
+    recv((SOCKET)rt->wake_rd, scratch, sizeof(scratch), 0);
+#else
+  while (read(rt->wake_rd, scratch, sizeof(scratch)) > 0) ;
+#endif
+}
+
+static void amb_open_wake(struct amb_runtime* rt)
+{
+#ifdef _WIN32
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in a;
+  int alen = sizeof(a);
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (s == INVALID_SOCKET || bind(s, (struct sockaddr*)&a, sizeof(a)) ||
+      getsockname(s, (struct sockaddr*)&a, &alen) || connect(s, (struct sockaddr*)&a, sizeof(a))) {
+    fprintf(stderr, "ERROR: failed to create the asyncShutdown socket\n");
+    abort();
+  }
+  rt->wake_rd = rt->wake_wr = (int)s;
+#else
+  int fds[2];
+  if (pipe(fds) || fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+    fprintf(stderr, "ERROR: failed to create the asyncShutdown pipe: %s\n", strerror(errno));
+    abort();
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  rt->wake_rd = fds[0];
+  rt->wake_wr = fds[1];
+#endif
+}
+
+// Pipelined receive
+// -----------------
+// Optionally, a dedicated thread reads whole log records into a small
+// ring of slots while the application thread dispatches earlier ones.
+// Single producer (receive thread), single consumer (application).
+
+#ifdef _WIN32
+DWORD WINAPI amb_receive_thread( LPVOID lpParam )
+#else
+void*        amb_receive_thread( void* lpParam )
+#endif
+{
+  struct amb_runtime* rt = (struct amb_runtime*)lpParam;
+  printf(" *** Receive thread starting (%d records in flight)...\n", rt->recv_nslots - 1);
+  while(1) {
+    int next = (rt->recv_tail + 1) % rt->recv_nslots;
+    while (next == rt->recv_head) // All slots are awaiting dispatch.
+      amb_yield_thread();
+    struct amb_recv_slot* slot = & rt->recv_slots[rt->recv_tail];
+    amb_recv_next_record(rt, &slot->hdr, &slot->buf, &slot->bufsize);
+    rt->recv_tail = next; // Publish (total store order).
+  }
+  return 0;
+}
+
+static void amb_alloc_recv_slots(struct amb_runtime* rt)
+{
+  int depth = rt->options.receiveDepth > 0 ? rt->options.receiveDepth : 8;
+  rt->recv_nslots = depth + 1;
+  rt->recv_slots = (struct amb_recv_slot*)calloc(rt->recv_nslots, sizeof(struct amb_recv_slot));
+}
+
+static void amb_free_recv_slots(struct amb_runtime* rt)
+{
+  for (int i = 0; i < rt->recv_nslots; i++)
+    free(rt->recv_slots[i].buf);
+  free(rt->recv_slots);
+  rt->recv_slots = NULL;
+  rt->recv_nslots = 0;
+}
+
+static void amb_startreceive_thread(struct amb_runtime* rt)
+{
+  if (rt->recv_slots == NULL) amb_alloc_recv_slots(rt);
+  amb_startthread(amb_receive_thread, rt, "receive",
+                  rt->options.receiveCpu, rt->options.realtimePriority);
+}
+
+void amb_runtime_processing_loop(amb_runtime* rt)
+{
+  struct amb_runtime* prev = amb_set_current_runtime(rt);
   
   amb_debug_log("\n        .... Normal processing underway ....\n");
   struct log_hdr hdr;
   memset((void*) &hdr, 0, AMBROSIA_HEADERSIZE);
 
-  int round = 0;
-  while (!g_amb_client_terminating) {
-    amb_debug_log("Normal processing (iter %d): receive next log header..\n", round++);
-    amb_recv_log_hdr(downfd, &hdr);
+  // One receive buffer, grown as needed and reused for every record:
+  char* buf = NULL;
+  int bufsize = 0;
 
-    int payloadsize = hdr.totalSize - AMBROSIA_HEADERSIZE;
-    char* buf = calloc(payloadsize, 1);
-    recv(downfd, buf, payloadsize, MSG_WAITALL);
-#ifdef AMBCLIENT_DEBUG  
-    amb_debug_log("Entire Message Payload (%d bytes): ", payloadsize);
-    print_hex_bytes(amb_dbg_fd,buf, payloadsize); fprintf(amb_dbg_fd,"\n");
-#endif
-
-    // Read a stream of messages from the log record:
-    int rawsize = 0;
-    char* bufcur = buf;
-    char* limit = buf + payloadsize;
-    int ind = 0;
-    while (bufcur < limit) {
-      amb_debug_log(" Processing message %d in log record, starting at offset %d (%p), remaining bytes %d\n",
-                    ind++, bufcur-buf, bufcur, limit-bufcur);
-      bufcur = read_zigzag_int(bufcur, &rawsize);  // Size
-      char tag = *bufcur++;                      // Type
-      rawsize--; // Discount type byte.
-      switch(tag) {
-
-      case RPC:
-        amb_debug_log(" It's an incoming RPC.. size without len/tag bytes: %d\n", rawsize);
-        // print_hex_bytes(bufcur,rawsize);printf("\n");
-        bufcur = amb_handle_rpc(bufcur, rawsize);
-        break;
-
-      case InitialMessage:
-        amb_debug_log(" Received InitialMessage back from server.  Processing..\n");
-        // FIXME: InitialMessage should be an arbitrary blob...
-        // but here we're following the convention that it's an actual message.
-        break;
-
-      case RPCBatch:
-        { int32_t numMsgs = -1;
-          bufcur = read_zigzag_int(bufcur, &numMsgs);
-          amb_debug_log(" Receiving RPC batch of %d messages.\n", numMsgs);
-          char* batchstart = bufcur;
-          for (int i=0; i < numMsgs; i++) {
-            amb_debug_log(" Reading off message %d/%d of batch, current offset %d, bytes left: %d.\n",
-                          i+1, numMsgs, bufcur-batchstart, rawsize);
-            char* lastbufcur = bufcur;
-            int32_t msgsize = -100;
-            bufcur = read_zigzag_int(bufcur, &msgsize);  // Size (unneeded)            
-            char type = *bufcur++;                     // Type - IGNORED
-            amb_debug_log(" --> Read message, type %d, payload size %d\n", type, msgsize-1);
-            bufcur = amb_handle_rpc(bufcur, msgsize-1);
-            amb_debug_log(" --> handling that message read %d bytes off the batch\n", (int)(bufcur - lastbufcur));
-            rawsize -= (bufcur - lastbufcur);
-          }
-        }
-        break;
-
-      case TakeCheckpoint:
-        send_dummy_checkpoint(upfd);
-        break;
-      default:
-        fprintf(stderr, "ERROR: unexpected or unrecognized message type: %d", tag);
-        abort();
-        break;
-      }
+  int round = 0;
+  while (!rt->terminating) {
+    if (rt->recv_slots != NULL) {
+      amb_debug_log("Normal processing (iter %d): take next log record from receive queue..\n", round++);
+      while (rt->recv_head == rt->recv_tail && !rt->terminating)
+        amb_yield_thread();
+      if (rt->recv_head == rt->recv_tail) break;
+      struct amb_recv_slot* slot = & rt->recv_slots[rt->recv_head];
+      amb_process_logged(rt, &slot->hdr, slot->buf);
+      rt->recv_head = (rt->recv_head + 1) % rt->recv_nslots; // Hand the slot back.
+      continue;
     }
+    amb_debug_log("Normal processing (iter %d): receive next log header..\n", round++);
+    if (rt->wake_rd >= 0 && !amb_await_record(rt)) break;
+    amb_recv_next_record(rt, &hdr, &buf, &bufsize);
+    amb_process_logged(rt, &hdr, buf);
   }
+  free(buf);
+  if (rt->wake_rd >= 0) amb_drain_wake(rt);
+  rt->terminating = 0; // The loop may be entered again.
+  amb_set_current_runtime(prev);
   amb_debug_log("Client signaled shutdown, normal_processing_loop exiting cleanly...\n");
   return;
 }
 
-
+void amb_normal_processing_loop()
+{
+  amb_runtime_processing_loop(amb_current_or_default());
+}
@@ -0,0 +1,528 @@
+// See the corresponding header for function-level documentation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include "ambrosia/client.h"
+#include "ambrosia/compress.h"
+
+// The LZ4 block format: each sequence is a token (literal count in
+// the high nibble, match length - 4 in the low one, 15 meaning more
+// follows in 255-valued bytes), the literals, a 16-bit offset back to
+// the match, and the rest of the match length.  The last sequence has
+// only literals.
+#define LZ_MINMATCH 4
+#define LZ_MFLIMIT  12 // No match starts within this many bytes of the end,
+#define LZ_LASTLITERALS 5 // nor covers the last five.
+#define LZ_HASH_LOG 12
+
+static inline uint32_t lz_read32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// A literal count or match length beyond its nibble.
+static inline uint8_t* lz_write_length(uint8_t* op, int n)
+{
+  for (; n >= 255; n -= 255) *op++ = 255;
+  *op++ = (uint8_t)n;
+  return op;
+}
+
+// Compress one block (at most AMB_FRAME_BLOCK bytes, so that every
+// offset fits in 16 bits) into dst.
+//
+// RETURN: the compressed size, or 0 if that would be cap bytes or more.
+static int lz_compress_block(const uint8_t* src, int len, uint8_t* dst, int cap)
+{
+  uint16_t table[1 << LZ_HASH_LOG]; // Latest position of each hashed 4 bytes.
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src; // Start of the pending literals.
+  const uint8_t* end = src + len;
+  const uint8_t* mflimit = end - LZ_MFLIMIT;
+  const uint8_t* matchlimit = end - LZ_LASTLITERALS;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + cap;
+
+  memset(table, 0, sizeof(table));
+  if (len > LZ_MFLIMIT) {
+    ip++;
+    while (1) {
+      // Find a match, skipping ahead faster the longer there is none:
+      const uint8_t* ref;
+      int misses = 1 << 6;
+      while (1) {
+        if (ip > mflimit) goto last;
+        uint32_t h = lz_hash(lz_read32(ip));
+        ref = src + table[h];
+        table[h] = (uint16_t)(ip - src);
+        if (ref < ip && lz_read32(ref) == lz_read32(ip)) break;
+        ip += misses++ >> 6;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+
+      const uint8_t* mp = ip + LZ_MINMATCH;
+      const uint8_t* rp = ref + LZ_MINMATCH;
+      while (mp < matchlimit - 8) {
+        uint64_t a, b;
+        memcpy(&a, mp, 8);
+        memcpy(&b, rp, 8);
+        if (a != b) break;
+        mp += 8; rp += 8;
+      }
+      while (mp < matchlimit && *mp == *rp) { mp++; rp++; }
+
+      int lit = (int)(ip - anchor);
+      int ml  = (int)(mp - ip) - LZ_MINMATCH;
+      if (op + 1 + lit / 255 + 1 + lit + 2 + ml / 255 + 1 >= oend) return 0;
+      uint8_t* token = op++;
+      *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+      if (lit >= 15) op = lz_write_length(op, lit - 15);
+      memcpy(op, anchor, lit);
+      op += lit;
+      uint16_t off = (uint16_t)(ip - ref);
+      *op++ = (uint8_t)off;
+      *op++ = (uint8_t)(off >> 8);
+      *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+      if (ml >= 15) op = lz_write_length(op, ml - 15);
+
+      table[lz_hash(lz_read32(mp - 2))] = (uint16_t)(mp - 2 - src);
+      ip = anchor = mp;
+    }
+  }
+ last:
+  {
+    int lit = (int)(end - anchor);
+    if (op + 1 + lit / 255 + 1 + lit >= oend) return 0;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz_write_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+  }
+  return (int)(op - dst);
+}
+
+// Decode one compressed block of len bytes into exactly raw bytes.
+//
+// RETURN: 0, or -1 if it is malformed.
+static int lz_decompress_block(const uint8_t* src, int len, uint8_t* dst, int raw)
+{
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + len;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + raw;
+  while (ip < iend) {
+    int token = *ip++;
+    int64_t lit = token >> 4;
+    if (lit == 15) {
+      int b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > iend - ip || lit > oend - op) return -1;
+    if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+      memcpy(op, ip, 16); // Fixed size is faster; the excess is overwritten later.
+    else
+      memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) break; // The last sequence.
+
+    if (iend - ip < 2) return -1;
+    int off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    int64_t ml = token & 15;
+    if (ml == 15) {
+      int b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        ml += b;
+      } while (b == 255);
+    }
+    ml += LZ_MINMATCH;
+    if (off == 0 || off > op - dst || ml > oend - op) return -1;
+    const uint8_t* m = op - off;
+    if (off >= 16 && ml <= 16 && oend - op >= 16) {
+      memcpy(op, m, 16);
+      op += ml;
+    } else if (off >= ml) {
+      memcpy(op, m, ml);
+      op += ml;
+    } else {
+      // Overlapping: a repeating pattern, which doubles with each copy.
+      while (ml > 0) {
+        int64_t n = op - m < ml ? op - m : ml;
+        memcpy(op, m, n);
+        op += n;
+        ml -= n;
+      }
+    }
+  }
+  return op == oend ? 0 : -1;
+}
+
+// Frames
+// ------
+
+struct frame_header {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  reserved[3];
+  int64_t  raw;
+};
+
+static void frame_header(char* dst, int64_t raw)
+{
+  struct frame_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic   = AMB_FRAME_MAGIC;
+  h.version = AMB_FRAME_VERSION;
+  h.raw     = raw;
+  memcpy(dst, &h, AMB_FRAME_HEADER);
+}
+
+// Write one block of n bytes to dst, which has room for n plus its
+// header.
+//
+// RETURN: the bytes written.
+static int64_t frame_block(const char* src, int n, char* dst)
+{
+  uint32_t raw = (uint32_t)n;
+  uint32_t comp = (uint32_t)lz_compress_block((const uint8_t*)src, n,
+                                              (uint8_t*)dst + AMB_FRAME_OVERHEAD, n);
+  memcpy(dst, &raw, 4);
+  memcpy(dst + 4, &comp, 4);
+  if (comp == 0) {
+    memcpy(dst + AMB_FRAME_OVERHEAD, src, n);
+    return AMB_FRAME_OVERHEAD + n;
+  }
+  return AMB_FRAME_OVERHEAD + comp;
+}
+
+int64_t amb_compress_bound(int64_t len)
+{
+  int64_t blocks = (len + AMB_FRAME_BLOCK - 1) / AMB_FRAME_BLOCK;
+  return AMB_FRAME_HEADER + blocks * AMB_FRAME_OVERHEAD + len + 4;
+}
+
+int64_t amb_compress(const void* src, int64_t len, void* dst)
+{
+  const char* in = (const char*)src;
+  char* out = (char*)dst;
+  char* cur = out + AMB_FRAME_HEADER;
+  frame_header(out, len);
+  for (int64_t off = 0; off < len; off += AMB_FRAME_BLOCK) {
+    int n = len - off < AMB_FRAME_BLOCK ? (int)(len - off) : AMB_FRAME_BLOCK;
+    cur += frame_block(in + off, n, cur);
+  }
+  memset(cur, 0, 4); // End mark.
+  return cur + 4 - out;
+}
+
+int64_t amb_frame_raw_size(const void* src, int64_t len)
+{
+  struct frame_header h;
+  if (len < AMB_FRAME_HEADER + 4) return -1;
+  memcpy(&h, src, AMB_FRAME_HEADER);
+  if (h.magic != AMB_FRAME_MAGIC || h.version != AMB_FRAME_VERSION || h.raw < 0)
+    return -1;
+  return h.raw;
+}
+
+static void frame_corrupt(const char* what, int64_t at)
+{
+  fprintf(stderr, "ERROR: malformed compressed frame: %s at byte %lld\n", what, (long long)at);
+  abort();
+}
+
+// Decompress a frame, or say what is wrong with it (in *why, at byte
+// *at) and return -1.
+static int64_t decompress(const void* src, int64_t len, void* dst, const char** why, int64_t* at)
+{
+  const char* in = (const char*)src;
+  char* out = (char*)dst;
+  int64_t raw = amb_frame_raw_size(src, len);
+  int64_t pos = AMB_FRAME_HEADER, done = 0;
+  *why = NULL;
+  if (raw < 0) { *why = "no frame header"; pos = 0; }
+  while (*why == NULL) {
+    uint32_t n, comp;
+    if (len - pos < 4) { *why = "no end mark"; break; }
+    memcpy(&n, in + pos, 4);
+    if (n == 0) break;
+    if (len - pos < AMB_FRAME_OVERHEAD || n > AMB_FRAME_BLOCK || n > raw - done) {
+      *why = "bad block header";
+      break;
+    }
+    memcpy(&comp, in + pos + 4, 4);
+    pos += AMB_FRAME_OVERHEAD;
+    int64_t stored = comp == 0 ? n : comp;
+    if (stored > len - pos) { *why = "truncated block"; break; }
+    if (comp == 0)
+      memcpy(out + done, in + pos, n);
+    else if (lz_decompress_block((const uint8_t*)in + pos, comp, (uint8_t*)out + done, n) != 0) {
+      *why = "bad block";
+      break;
+    }
+    pos  += stored;
+    done += n;
+  }
+  if (*why == NULL && done != raw) *why = "short of its size";
+  *at = pos;
+  return *why == NULL ? done : -1;
+}
+
+int64_t amb_decompress(const void* src, int64_t len, void* dst)
+{
+  const char* why;
+  int64_t at, done = decompress(src, len, dst, &why, &at);
+  if (done < 0) frame_corrupt(why, at);
+  return done;
+}
+
+int64_t amb_try_decompress(const void* src, int64_t len, void* dst)
+{
+  const char* why;
+  int64_t at;
+  return decompress(src, len, dst, &why, &at);
+}
+
+int64_t amb_frame_max_raw(int64_t len)
+{
+  if (len < AMB_FRAME_HEADER + 4) return -1;
+  return (len - AMB_FRAME_HEADER - 4) / AMB_FRAME_OVERHEAD * AMB_FRAME_BLOCK;
+}
+
+// Streaming
+// ---------
+
+struct amb_zstream {
+  char*   out;  // The frame so far.
+  int64_t len, cap;
+  int64_t raw;
+  int     fill; // Bytes waiting in block.
+  char    block[AMB_FRAME_BLOCK];
+};
+
+// Make room for n more bytes of frame.
+static void zstream_reserve(amb_zstream* z, int64_t n)
+{
+  if (z->len + n > z->cap) {
+    z->cap = 2 * z->cap + n;
+    z->out = (char*)realloc(z->out, z->cap);
+    if (z->out == NULL) {
+      fprintf(stderr, "ERROR: failed to grow a compressed frame to %lld bytes\n", (long long)z->cap);
+      abort();
+    }
+  }
+}
+
+static void zstream_block(amb_zstream* z, const char* p, int n)
+{
+  zstream_reserve(z, AMB_FRAME_OVERHEAD + n);
+  z->len += frame_block(p, n, z->out + z->len);
+}
+
+amb_zstream* amb_zstream_begin()
+{
+  amb_zstream* z = (amb_zstream*)malloc(sizeof(amb_zstream));
+  z->cap  = 4 * AMB_FRAME_BLOCK;
+  z->out  = (char*)malloc(z->cap);
+  z->len  = AMB_FRAME_HEADER;
+  z->raw  = 0;
+  z->fill = 0;
+  if (z->out == NULL) {
+    fprintf(stderr, "ERROR: failed to allocate a compressed frame\n");
+    abort();
+  }
+  return z;
+}
+
+void amb_zstream_write(amb_zstream* z, const void* p, int64_t len)
+{
+  const char* in = (const char*)p;
+  z->raw += len;
+  while (len > 0) {
+    if (z->fill == 0 && len >= AMB_FRAME_BLOCK) { // Straight from the input.
+      zstream_block(z, in, AMB_FRAME_BLOCK);
+      in  += AMB_FRAME_BLOCK;
+      len -= AMB_FRAME_BLOCK;
+      continue;
+    }
+    int n = AMB_FRAME_BLOCK - z->fill;
+    if (n > len) n = (int)len;
+    memcpy(z->block + z->fill, in, n);
+    z->fill += n;
+    in  += n;
+    len -= n;
+    if (z->fill == AMB_FRAME_BLOCK) {
+      zstream_block(z, z->block, z->fill);
+      z->fill = 0;
+    }
+  }
+}
+
+char* amb_zstream_finish(amb_zstream* z, int64_t* len)
+{
+  if (z->fill > 0)
+    zstream_block(z, z->block, z->fill);
+  zstream_reserve(z, 4);
+  frame_header(z->out, z->raw);
+  memset(z->out + z->len, 0, 4);
+  char* out = z->out;
+  *len = z->len + 4;
+  free(z);
+  return out;
+}
+
+// Reading
+// -------
+
+struct amb_zreader {
+  int     fd;
+  int64_t left;   // Bytes not yet read off fd.
+  int64_t raw;    // Bytes to hand out in all,
+  int64_t given;  // and so far,
+  int64_t decoded; // and decoded (framed only).
+  int     framed;
+  char*   in;     // One block, as read (framed only).
+  char*   block;  // Bytes to hand out before reading more.
+  int     bpos, blen;
+};
+
+// Read exactly len bytes from fd, or bail out.
+static void zreader_fill(amb_zreader* r, char* p, int64_t len)
+{
+  if (len > r->left) {
+    fprintf(stderr, "ERROR: reading %lld bytes past the end of a %s\n", (long long)(len - r->left),
+            r->framed ? "compressed frame" : "stream");
+    abort();
+  }
+  r->left -= len;
+  while (len > 0) {
+    int n = len < (1 << 30) ? (int)len : (1 << 30);
+#ifdef _WIN32
+    int got = recv(r->fd, p, n, 0);
+#else
+    ssize_t got = read(r->fd, p, n);
+    if (got < 0 && errno == EINTR) continue;
+#endif
+    if (got <= 0) {
+      fprintf(stderr, "ERROR: input ended %lld bytes early: %s\n", (long long)len,
+              got < 0 ? amb_get_error_string() : "end of file");
+      abort();
+    }
+    p += got;
+    len -= got;
+  }
+}
+
+amb_zreader* amb_zreader_open(int fd, int64_t len)
+{
+  amb_zreader* r = (amb_zreader*)calloc(1, sizeof(amb_zreader));
+  r->fd    = fd;
+  r->left  = len;
+  r->block = (char*)malloc(AMB_FRAME_BLOCK);
+  if (r->block == NULL) {
+    fprintf(stderr, "ERROR: failed to allocate a read buffer\n");
+    abort();
+  }
+  // Look at the start, and if it is not a frame, hand it out as is:
+  r->blen = len < AMB_FRAME_HEADER + 4 ? (int)len : AMB_FRAME_HEADER;
+  zreader_fill(r, r->block, r->blen);
+  r->raw = amb_frame_raw_size(r->block, len);
+  if (r->raw < 0) {
+    r->raw = len;
+    return r;
+  }
+  r->framed = 1;
+  r->blen = 0;
+  r->in = (char*)malloc(AMB_FRAME_BLOCK);
+  if (r->in == NULL) {
+    fprintf(stderr, "ERROR: failed to allocate a read buffer\n");
+    abort();
+  }
+  return r;
+}
+
+int64_t amb_zreader_size(amb_zreader* r)
+{
+  return r->raw;
+}
+
+// Decode the next block of a frame into r->block.
+static void zreader_next_block(amb_zreader* r)
+{
+  uint32_t hdr[2];
+  zreader_fill(r, (char*)hdr, 4);
+  if (hdr[0] == 0 || hdr[0] > AMB_FRAME_BLOCK || hdr[0] > r->raw - r->decoded)
+    frame_corrupt("bad block header", r->left);
+  zreader_fill(r, (char*)&hdr[1], 4);
+  if (hdr[1] == 0) {
+    zreader_fill(r, r->block, hdr[0]);
+  } else {
+    if (hdr[1] > AMB_FRAME_BLOCK) frame_corrupt("bad block header", r->left);
+    zreader_fill(r, r->in, hdr[1]);
+    if (lz_decompress_block((const uint8_t*)r->in, hdr[1], (uint8_t*)r->block, hdr[0]) != 0)
+      frame_corrupt("bad block", r->left);
+  }
+  r->bpos = 0;
+  r->blen = hdr[0];
+  r->decoded += hdr[0];
+}
+
+void amb_zreader_read(amb_zreader* r, void* dst, int64_t n)
+{
+  char* out = (char*)dst;
+  if (n > r->raw - r->given) {
+    fprintf(stderr, "ERROR: reading %lld bytes, %lld left\n", (long long)n, (long long)(r->raw - r->given));
+    abort();
+  }
+  r->given += n;
+  while (n > 0) {
+    if (r->bpos < r->blen) {
+      int k = r->blen - r->bpos < n ? r->blen - r->bpos : (int)n;
+      memcpy(out, r->block + r->bpos, k);
+      r->bpos += k;
+      out += k;
+      n -= k;
+    } else if (!r->framed) {
+      zreader_fill(r, out, n); // Straight into place.
+      n = 0;
+    } else {
+      zreader_next_block(r);
+    }
+  }
+}
+
+void amb_zreader_close(amb_zreader* r)
+{
+  char scratch[4096];
+  while (r->left > 0) {
+    int n = r->left < (int64_t)sizeof(scratch) ? (int)r->left : (int)sizeof(scratch);
+    zreader_fill(r, scratch, n);
+  }
+  free(r->in);
+  free(r->block);
+  free(r);
+}
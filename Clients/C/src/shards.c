@@ -0,0 +1,226 @@
+// See the corresponding header for function-level documentation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <windows.h>
+#else
+  #include <pthread.h>
+  #include <unistd.h>
+#endif
+
+#include "ambrosia/client.h"
+#include "ambrosia/shards.h"
+#include "ambrosia/internal/bits.h"
+#include "ambrosia/internal/runtime.h" // AMB_THREAD_LOCAL
+
+#ifdef _WIN32
+typedef HANDLE amb_shard_thread;
+#else
+typedef pthread_t amb_shard_thread;
+#endif
+
+struct amb_shard {
+  struct amb_shards* group;
+  int index;
+  int cpu;
+  char* name;
+  amb_runtime* rt;
+  amb_shard_thread th;
+};
+
+struct amb_shards {
+  struct amb_shard_options so;
+  struct amb_client_options opts;
+  char* service;
+  struct amb_shard* shards;
+  volatile long started;
+};
+
+// The calling thread's shard, and the service it belongs to:
+static AMB_THREAD_LOCAL int t_shard = -1;
+static AMB_THREAD_LOCAL const char* t_service = NULL;
+
+void amb_default_shard_options(struct amb_shard_options* so)
+{
+  memset(so, 0, sizeof(*so));
+  so->shards = 1;
+  so->service = NULL;
+  so->upports = NULL;
+  so->downports = NULL;
+  so->cpus = NULL;
+  so->init = NULL;
+}
+
+static int amb_online_cpus()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+// A shard's thread: start its runtime, then run its processing loop.
+#ifdef _WIN32
+static DWORD WINAPI amb_shard_thread_main(LPVOID arg)
+#else
+static void* amb_shard_thread_main(void* arg)
+#endif
+{
+  struct amb_shard* sh = (struct amb_shard*)arg;
+  struct amb_shards* g = sh->group;
+  t_shard   = sh->index;
+  t_service = g->service;
+  if (g->so.init != NULL) g->so.init(sh->index);
+  struct amb_client_options o = g->opts;
+  o.instanceName = sh->name;
+  o.appCpu = sh->cpu; // Pins this thread.
+  o.asyncShutdown = 1;   // For amb_shards_shutdown.
+  sh->rt = amb_runtime_create(g->so.upports[sh->index], g->so.downports[sh->index], &o);
+#ifdef _WIN32
+  InterlockedIncrement(&g->started);
+#else
+  __sync_fetch_and_add(&g->started, 1);
+#endif
+  amb_runtime_processing_loop(sh->rt);
+  return 0;
+}
+
+amb_shards* amb_shards_start(const struct amb_shard_options* so,
+                             const struct amb_client_options* opts)
+{
+  if (so->shards < 1 || so->service == NULL || so->upports == NULL || so->downports == NULL) {
+    fprintf(stderr, "ERROR: amb_shards_start needs at least one shard, a service name, and ports\n");
+    abort();
+  }
+  struct amb_shards* g = (struct amb_shards*)calloc(1, sizeof(struct amb_shards));
+  int n = so->shards;
+  g->so   = *so;
+  g->opts = *opts;
+  g->service = strdup(so->service);
+  g->shards = (struct amb_shard*)calloc(n, sizeof(struct amb_shard));
+  if (g->service == NULL || g->shards == NULL) {
+    fprintf(stderr, "ERROR: failed to allocate %d shards\n", n);
+    abort();
+  }
+  int cpus = amb_online_cpus();
+  if (so->cpus == NULL && n > cpus)
+    fprintf(stderr, "WARNING: %d shards on %d CPUs, pinning only the first %d.\n", n, cpus, cpus);
+  printf(" *** Starting %d shards of %s\n", n, g->service);
+
+  for (int i = 0; i < n; i++) {
+    struct amb_shard* sh = & g->shards[i];
+    int len = snprintf(NULL, 0, "%s%d", g->service, i);
+    sh->group = g;
+    sh->index = i;
+    sh->cpu   = so->cpus != NULL ? so->cpus[i] : i < cpus ? i : -1;
+    sh->name  = (char*)malloc(len + 1);
+    if (sh->name == NULL) {
+      fprintf(stderr, "ERROR: failed to allocate %d shards\n", n);
+      abort();
+    }
+    snprintf(sh->name, len + 1, "%s%d", g->service, i);
+#ifdef _WIN32
+    sh->th = CreateThread(NULL, 0, amb_shard_thread_main, sh, 0, NULL);
+    if (sh->th == NULL)
+#else
+    if (pthread_create(& sh->th, NULL, amb_shard_thread_main, sh) != 0)
+#endif
+    {
+      fprintf(stderr, "ERROR: failed to create the thread of shard %s.\n", sh->name);
+      abort();
+    }
+  }
+  while (g->started < n)
+    amb_sleep_seconds(0.001);
+  printf(" *** All %d shards of %s started\n", n, g->service);
+  return g;
+}
+
+void amb_shards_shutdown(amb_shards* g)
+{
+  for (int i = 0; i < g->so.shards; i++)
+    amb_runtime_shutdown(g->shards[i].rt);
+}
+
+void amb_shards_join(amb_shards* g)
+{
+  for (int i = 0; i < g->so.shards; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(g->shards[i].th, INFINITE);
+    CloseHandle(g->shards[i].th);
+#else
+    pthread_join(g->shards[i].th, NULL);
+#endif
+    free(g->shards[i].name);
+  }
+  free(g->shards);
+  free(g->service);
+  free(g);
+}
+
+int amb_shards_count(amb_shards* g)
+{
+  return g->so.shards;
+}
+
+amb_runtime* amb_shards_runtime(amb_shards* g, int shard)
+{
+  return g->shards[shard].rt;
+}
+
+const char* amb_shards_name(amb_shards* g, int shard)
+{
+  return g->shards[shard].name;
+}
+
+int amb_current_shard()
+{
+  return t_shard;
+}
+
+// Routing
+// ------------------------------------------------------------
+
+int amb_shard_of(const void* key, int keyLen, int nshards)
+{
+  // FNV-1a:
+  const unsigned char* p = (const unsigned char*)key;
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < keyLen; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  // Jump consistent hash (Lamping and Veach):
+  int64_t b = -1, j = 0;
+  while (j < nshards) {
+    b = j;
+    h = h * 2862933555777941757ULL + 1;
+    j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((h >> 33) + 1)));
+  }
+  return (int)b;
+}
+
+int amb_shard_route(char* buf, int bufLen, const char* service,
+                    const void* key, int keyLen, int nshards)
+{
+  int shard = amb_shard_of(key, keyLen, nshards);
+  if (shard == t_shard && t_service != NULL && strcmp(service, t_service) == 0) {
+    if (bufLen > 0) buf[0] = 0;
+    return 0;
+  }
+  int len = snprintf(buf, bufLen, "%s%d", service, shard);
+  if (len >= bufLen) {
+    fprintf(stderr, "ERROR: shard name %s%d does not fit in %d bytes\n", service, shard, bufLen);
+    abort();
+  }
+  return len;
+}
@@ -1,33 +1,56 @@
 
 // See the corresponding header for function-level documentation.
 
+#ifndef _WIN32
+  #define _GNU_SOURCE // memfd_create, MAP_HUGETLB
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
+#include <errno.h>
 #include "ambrosia/internal/spsc_rring.h"
+#include "ambrosia/internal/trace.h"
 
 #if _WIN32
 #else
   #include <sched.h> // sched_yield
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h> // mbind
+  #include <time.h>
 #endif
 
+// Ring instances
 // ----------------------------------------------------------------------------
-// FIXME: replace globals with a proper API for dynamically allocating buffers:
-// ----------------------------------------------------------------------------
+// The legacy (instance-free) API below works on the calling thread's
+// current ring, or else on the default one.
 
-// TODO: FACTOR THESE INTO A STRUCT TO ALLOW MORE THAN ONE INSTANCE:
+#if _WIN32
+  #define RRING_THREAD_LOCAL __declspec(thread)
+#else
+  #define RRING_THREAD_LOCAL __thread
+#endif
 
-// Single-producer Single-consumer concurrent ring buffer:
-char* g_buffer = NULL;
-volatile int g_buffer_head = 0; // Byte offset into buffer, written by consumer.
-volatile int g_buffer_tail = 0; // Byte offset into buffer, written by producer.
-// volatile int g_buffer_msgs = 0; // Count of complete "messages" in g_buffer
-volatile int g_buffer_end = -1; // The current capacity, MODIFIED dynamically by PRODUCER.
+struct rring g_rring_storage;                  // The default, unless replaced.
+struct rring* g_rring_default = & g_rring_storage;
+RRING_THREAD_LOCAL struct rring* t_rring_current = NULL;
 
-int orig_buffer_end = -1; // Snapshot of the original buffer capacity.
+struct rring* rring_current()
+{
+  return t_rring_current != NULL ? t_rring_current : g_rring_default;
+}
 
-int g_buffer_last_reserved = -1; // The number of bytes in the last reserve call (producer-private)
+void rring_set_current(struct rring* r)
+{
+  t_rring_current = r;
+}
 
+void rring_set_default(struct rring* r)
+{
+  g_rring_default = r != NULL ? r : & g_rring_storage;
+}
 
 // Debugging
 //--------------------------------------------------------------------------------
@@ -56,98 +79,372 @@ void spsc_rring_debug_log(const char *format, ...)
 // Buffer life cycle
 // ------------------------------------------------------------
 
-void new_buffer(int sz)
+#ifdef __linux__
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static size_t round_up(size_t n, size_t unit) { return (n + unit - 1) / unit * unit; }
+
+// Map the same physical pages twice, back to back, so that any byte
+// range of up to the ring size starting within the ring is
+// contiguous in virtual memory.  Returns NULL if unsupported.
+static char* map_mirrored(size_t sz, int huge)
+{
+  int fd = memfd_create("ambrosia_rring", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+  if (fd < 0) return NULL;
+  if (ftruncate(fd, sz) != 0) { close(fd); return NULL; }
+
+  // Reserve the address range for both copies, then overlay it.
+  // Hugetlb mappings must start on a huge page boundary, which mmap
+  // does not promise, so reserve a huge page more, and trim it:
+  size_t align = huge ? HUGE_PAGE_SIZE : 0;
+  char* raw = mmap(NULL, 2*sz + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) { close(fd); return NULL; }
+  char* base = huge ? (char*)round_up((size_t)raw, align) : raw;
+  if (base > raw) munmap(raw, base - raw);
+  if (raw + align > base) munmap(base + 2*sz, raw + align - base);
+  if (mmap(base,      sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(base + sz, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, 2*sz);
+    close(fd);
+    return NULL;
+  }
+  close(fd); // The mappings keep the pages alive.
+  return base;
+}
+
+static char* map_flat(size_t sz, int huge)
 {
-  if (g_buffer != NULL) {
-    fprintf(stderr, "ERROR: tried to call new_buffer a second time\n");
-    fprintf(stderr, "Only one global ring buffer permitted for now.");
+  char* base = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | (huge ? MAP_HUGETLB : 0), -1, 0);
+  return base == MAP_FAILED ? NULL : base;
+}
+#endif
+
+int rring_init(struct rring* r, int sz, int flags)
+{
+  if (r->buffer != NULL) {
+    fprintf(stderr, "ERROR: tried to initialize a ring buffer a second time\n");
     abort();
   }
-  g_buffer = malloc(sz); 
-  orig_buffer_end = sz;  // Need room for the largest message.
-  spsc_rring_debug_log("Initialized global buffer, address %p\n", g_buffer);
+  r->head = r->tail = 0;
+  r->released = r->popped = 0;
+  r->produced = 0;
+  r->last_reserved = -1;
+  r->large_head = r->large_tail = 0;
+  r->large_reserved = NULL;
+  r->peeked_large = 0;
+  r->stalls = 0;
+  r->stamp_head = r->stamp_tail = 0;
+  r->stamp_every = 0;
+  r->end_head = r->end_tail = 0;
+  r->last_end = 0;
+  r->end_every = 0;
+  r->open = 0;
+  r->consumed = 0;
+  r->flags  = 0;
+  r->mapped = 0;
+#ifdef __linux__
+  // Try the most specific request first, then degrade gracefully:
+  // reserved hugetlb pages, then regular pages with a THP hint.
+  if (flags & RRING_MIRRORED) {
+    if (flags & RRING_HUGEPAGES) {
+      size_t len = round_up(sz, HUGE_PAGE_SIZE);
+      if ((r->buffer = map_mirrored(len, 1)) != NULL) {
+        r->flags = RRING_MIRRORED | RRING_HUGEPAGES;
+        r->mapped = 2*len;
+        sz = (int)len;
+      }
+    }
+    if (r->buffer == NULL) {
+      size_t len = round_up(sz, sysconf(_SC_PAGESIZE));
+      if ((r->buffer = map_mirrored(len, 0)) != NULL) {
+        r->flags = RRING_MIRRORED;
+        r->mapped = 2*len;
+        sz = (int)len;
+      }
+    }
+  } else if (flags & RRING_HUGEPAGES) {
+    size_t len = round_up(sz, HUGE_PAGE_SIZE);
+    if ((r->buffer = map_flat(len, 1)) != NULL)
+      r->flags = RRING_HUGEPAGES;
+    else
+      r->buffer = map_flat(len, 0);
+    if (r->buffer != NULL) {
+      r->mapped = len;
+      sz = (int)len;
+    }
+  }
+  if (r->buffer != NULL && (flags & RRING_HUGEPAGES) && !(r->flags & RRING_HUGEPAGES))
+    madvise(r->buffer, r->mapped, MADV_HUGEPAGE); // Best effort.
+#endif
+  if (r->buffer == NULL) {
+    if (flags != 0)
+      fprintf(stderr, "WARNING: could not map ring buffer with flags %d, falling back to malloc.\n", flags);
+    r->buffer = malloc(sz);
+  }
+  r->orig_end = sz;
+  r->end = sz;
+  spsc_rring_debug_log("Initialized ring buffer, address %p, flags %d\n", r->buffer, r->flags);
+  return r->flags;
+}
+
+void rring_reset(struct rring* r)
+{
+  r->end = r->orig_end;
+}
+
+// (Consumer) Done with the large message at the head of the queue.
+static void finish_large(struct rring* r, struct rring_large* msg)
+{
+  if (msg->fd >= 0) {
+    free(msg->ptr);
+    msg->eof(msg->fd, msg->streamed, msg->done_arg);
+  } else if (msg->done != NULL)
+    msg->done(msg->ptr, msg->len, msg->done_arg);
+  else
+    free(msg->ptr);
+  r->large_head = (r->large_head + 1) % RRING_LARGE_QUEUE_SIZE;
+}
+
+void rring_free(struct rring* r)
+{
+  spsc_rring_debug_log("Freeing buffer %p\n", r->buffer);
+#ifdef __linux__
+  if (r->mapped > 0)
+    munmap(r->buffer, r->mapped);
+  else
+#endif
+    free(r->buffer);
+  r->buffer = NULL;
+  r->orig_end = -1;
+  while (r->large_head != r->large_tail)
+    finish_large(r, & r->large_queue[r->large_head]);
+  free(r->large_reserved);
+  r->large_reserved = NULL;
 }
 
-void reset_buffer()
+int rring_capacity(struct rring* r)
 {
-  g_buffer_end = orig_buffer_end;
+  return r->orig_end;
 }
 
-void free_buffer()
+char* rring_region(struct rring* r, size_t* len)
 {
-  spsc_rring_debug_log("Freeing buffer %p\n", g_buffer);
-  free(g_buffer);
-  g_buffer = NULL;
-  orig_buffer_end = -1;
+  *len = r->mapped > 0 ? r->mapped : (size_t)r->orig_end;
+  return r->buffer;
 }
 
+#ifdef __linux__
+#define RRING_MPOL_BIND     2 // From <numaif.h>, so as not to need libnuma.
+#define RRING_MPOL_MF_MOVE  2
+#define RRING_MAX_NODES     1024
+
+int rring_bind_node(struct rring* r, int node)
+{
+  unsigned long mask[RRING_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+  if (node < 0 || node >= RRING_MAX_NODES) { errno = EINVAL; return -1; }
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+  // Whole pages only: a malloc'd ring may share its first and last
+  // pages with other data.
+  size_t len, page = sysconf(_SC_PAGESIZE);
+  char* base = rring_region(r, &len);
+  uintptr_t start = round_up((uintptr_t)base, page);
+  uintptr_t end = ((uintptr_t)base + len) / page * page;
+  if (end <= start) return 0;
+  return syscall(SYS_mbind, start, end - start, RRING_MPOL_BIND, mask,
+                 (unsigned long)RRING_MAX_NODES, RRING_MPOL_MF_MOVE) == 0 ? 0 : -1;
+}
+#else
+int rring_bind_node(struct rring* r, int node)
+{
+  (void)r; (void)node;
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
 // Buffer operations
 //--------------------------------------------------------------------------------
 
-char* peek_buffer(int* numread)
+char* rring_peek(struct rring* r, int* numread)
 {
   while (1)
   {
-    int observed_head = g_buffer_head; // We "own" the head (and _end)
-    int observed_tail = g_buffer_tail;
-    int observed_end  = g_buffer_end;
-    // spsc_rring_debug_log(" peek_buffer: head/tail/end: %d / %d / %d\n", observed_head, observed_tail, g_buffer_end);  
+    int observed_head = r->head; // We "own" the head (and _end)
+    int observed_tail = r->tail;
+    int observed_end  = r->end;
+    // spsc_rring_debug_log(" peek_buffer: head/tail/end: %d / %d / %d\n", observed_head, observed_tail, r->end);  
+
+    // Check the large-message queue only AFTER snapshotting the tail.
+    // Any descriptor positioned before the bytes we observed was
+    // enqueued before they were released, so it is visible by now.
+    struct rring_large* next = NULL;
+    if (r->large_head != r->large_tail)
+      next = & r->large_queue[r->large_head];
+    if (next != NULL && next->pos == r->popped) {
+#ifndef _WIN32
+      if (next->fd >= 0 && next->sent == next->len) {
+        // A stream: refill its buffer with whatever has been written.
+        ssize_t n = read(next->fd, next->ptr, RRING_STREAM_CHUNK);
+        if (n == 0) {
+          spsc_rring_debug_log(" peek_buffer: stream %d ended after %lld bytes\n",
+                               next->fd, (long long)next->streamed);
+          finish_large(r, next);
+          continue;
+        }
+        if (n < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "ERROR: failed to read a stream queued on the ring (fd %d, errno %d)\n",
+                    next->fd, errno);
+            abort();
+          }
+          // Not written yet, and everything after it must wait:
+          r->peeked_large = 0;
+          *numread = 0;
+          return NULL;
+        }
+        next->len  = (int)n;
+        next->sent = 0;
+      }
+#endif
+      spsc_rring_debug_log(" peek_buffer: returning large message %p (%d of %d bytes left)\n",
+                           next->ptr, next->len - next->sent, next->len);
+      r->peeked_large = 1;
+      *numread = next->len - next->sent;
+      return next->ptr + next->sent;
+    }
+    r->peeked_large = 0;
     
     if( observed_head == observed_tail ) {
       *numread = 0;
       return NULL;
     }
     // If we get past here we KNOW we are in torn/wrap-around tail<head
-    // state, which gives us priority to modify g_buffer_end an flip
+    // state, which gives us priority to modify r->end an flip
     // back to the "normal" head<=tail state.
     
     // A shrink may have left us with nothing to read at the end here:
     if (observed_head == observed_end) {
       spsc_rring_debug_log(" !!peek_buffer: FIXUP head==end==%d, resetting it, RESTORING end\n", observed_end);
-      g_buffer_end = orig_buffer_end; // Allowed to write INtorn state.
-      observed_end = orig_buffer_end;
-      g_buffer_head = 0; // Switch to natural state.
+      r->end = r->orig_end; // Allowed to write INtorn state.
+      observed_end = r->orig_end;
+      r->head = 0; // Switch to natural state.
       observed_head = 0;
       continue;
     }
 
-    char* start = g_buffer + observed_head;
+    char* start = r->buffer + observed_head;
     if ( observed_head < observed_tail ) {    
       *numread = observed_tail - observed_head;
+    } else if (r->flags & RRING_MIRRORED) {
+      // Wrapped, but the mirror makes it all contiguous:
+      *numread = observed_end - observed_head + observed_tail;
     } else {
       spsc_rring_debug_log(" ! peek_buffer: Torn state reading just from %d to end (%d)\n",
 		    observed_head, observed_end);
       *numread = observed_end - observed_head;
     }
+    // Stop short of the next large message, it goes out first:
+    if (next != NULL && r->popped + *numread > next->pos)
+      *numread = (int)(next->pos - r->popped);
     return start;
   }
 }
 
-void pop_buffer(int numread)
+char* rring_peek_next(struct rring* r, int first, int* numread)
+{
+  *numread = 0;
+  if (r->peeked_large || (r->flags & RRING_MIRRORED))
+    return NULL;
+  int observed_head = r->head;
+  int observed_tail = r->tail;
+  // Torn state (tail behind head) gives us ownership of _end:
+  if (observed_tail >= observed_head || observed_head + first != r->end)
+    return NULL;
+  int n = observed_tail;
+  // As in peek_buffer, stop short of the next large message:
+  if (r->large_head != r->large_tail) {
+    int64_t room = r->large_queue[r->large_head].pos - (r->popped + first);
+    if (room < n) n = (int)room;
+  }
+  if (n <= 0) return NULL;
+  spsc_rring_debug_log(" peek_buffer_next: %d more bytes from the start of the ring\n", n);
+  *numread = n;
+  return r->buffer;
+}
+
+int rring_peeked_stream(struct rring* r)
 {
-  int observed_head = g_buffer_head; // We "own" the head 
-  int observed_end  = g_buffer_end;  // We "own" the end
+  return r->peeked_large && r->large_queue[r->large_head].fd >= 0;
+}
+
+int rring_peeked_more(struct rring* r, int numread)
+{
+  int large = r->large_head;
+  if (r->peeked_large) {
+    if (r->large_queue[large].fd >= 0) return 0;
+    large = (large + 1) % RRING_LARGE_QUEUE_SIZE;
+    numread = 0; // The ring bytes behind it start at "popped".
+  }
+  if (r->released > r->popped + numread) return 1;
+  return large != r->large_tail && r->large_queue[large].fd < 0;
+}
+
+void rring_pop(struct rring* r, int numread)
+{
+  if (r->peeked_large) {
+    struct rring_large* msg = & r->large_queue[r->large_head];
+    assert(numread > 0 && msg->sent + numread <= msg->len);
+    msg->sent += numread;
+    if (msg->fd >= 0) { // A stream: the next peek refills it.
+      msg->streamed += numread;
+      return;
+    }
+    r->consumed += numread;
+    if (msg->sent == msg->len) {
+      spsc_rring_debug_log(" pop_buffer: finished large message %p, releasing\n", msg->ptr);
+      finish_large(r, msg);
+      r->peeked_large = 0;
+    }
+    return;
+  }
+  if (r->flags & RRING_MIRRORED) {
+    int new_head = r->head + numread;
+    assert(numread > 0);
+    if (new_head >= r->orig_end) new_head -= r->orig_end;
+    r->popped += numread;
+    r->consumed += numread;
+    r->head = new_head;
+    return;
+  }
+  int observed_head = r->head; // We "own" the head 
+  int observed_end  = r->end;  // We "own" the end
   spsc_rring_debug_log(" pop_buffer: advancing head (%d) by %d\n", observed_head, numread);
   assert(numread > 0);
   if (observed_head == observed_end) {
     spsc_rring_debug_log(" !!pop_buffer: FIXUP head==end, resetting it, RESTORING end\n");
-    g_buffer_end = orig_buffer_end; // Total store order!
-    g_buffer_head = 0;   // Flip the state back to in-order, release "lock" on _end
+    r->end = r->orig_end; // Total store order!
+    r->head = 0;   // Flip the state back to in-order, release "lock" on _end
     observed_head = 0;
   }
   
   if ( observed_head + numread < observed_end ) {
-    g_buffer_head += numread; // Clear the read bytes.
+    r->popped += numread;
+    r->consumed += numread;
+    r->head += numread; // Clear the read bytes.
     return;
   } else if ( observed_head + numread == observed_end ) {
-    spsc_rring_debug_log(" ! pop_buffer: Wrapping head back around, RESTORING end to %d\n", orig_buffer_end);
-    // Here, the tail is to our "left".  That state gives US ownership over g_buffer_end to write it:
-    g_buffer_end = orig_buffer_end; // Total store order!
-    g_buffer_head = 0;              // EXIT wrap-around state.
+    spsc_rring_debug_log(" ! pop_buffer: Wrapping head back around, RESTORING end to %d\n", r->orig_end);
+    // Here, the tail is to our "left".  That state gives US ownership over r->end to write it:
+    r->popped += numread;
+    r->consumed += numread;
+    r->end = r->orig_end; // Total store order!
+    r->head = 0;              // EXIT wrap-around state.
     return;
   } else {
     fprintf(stderr, "ERROR: tried to pop %d bytes past the end; head %d, tail %d, end %d",
-	    numread, observed_head, g_buffer_tail, observed_end);
+	    numread, observed_head, r->tail, observed_end);
     abort();
   }
 }
@@ -164,17 +461,89 @@ static inline void wait()
 }
 
 
-char* reserve_buffer(int len)
+// Wait for a free slot in the large-message queue.
+static void wait_large_slot(struct rring* r)
+{
+  while ((r->large_tail + 1) % RRING_LARGE_QUEUE_SIZE == r->large_head) {
+    spsc_rring_debug_log("! reserve_large: descriptor queue full, waiting\n");
+    wait();
+  }
+}
+
+// Count a reservation that had to wait, once (see rring_stalls).
+static inline void note_stall(struct rring* r, int* stalled, int len)
+{
+  if (!*stalled) {
+    r->stalls++;
+    AMB_TRACE2(reserve_stall_begin, r, len);
+  }
+  *stalled = 1;
+}
+
+// A reservation has its space, after waiting for it if stalled.
+static inline char* reserved(struct rring* r, int stalled, int len, char* ptr)
+{
+  r->last_reserved = len;
+  if (stalled) AMB_TRACE2(reserve_stall_end, r, len);
+  return ptr;
+}
+
+// A message that can never fit in the ring gets its own buffer.
+// Without block, return NULL rather than wait for a descriptor.
+static char* reserve_large(struct rring* r, int len, int block)
 {
-  if (len > orig_buffer_end) {
-    fprintf(stderr,"\nERROR: reserve_buffer request bigger than allocated buffer itself! %d", len);
+  if ((r->large_tail + 1) % RRING_LARGE_QUEUE_SIZE == r->large_head) {
+    if (!block) return NULL;
+    r->stalls++;
+    AMB_TRACE2(reserve_stall_begin, r, len);
+    wait_large_slot(r);
+    AMB_TRACE2(reserve_stall_end, r, len);
+  }
+  r->large_reserved = malloc(len);
+  if (r->large_reserved == NULL) {
+    fprintf(stderr,"\nERROR: reserve_buffer failed to allocate %d bytes for a large message\n", len);
     abort();
   }
+  spsc_rring_debug_log("  reserve_buffer: %d bytes exceeds ring, using large buffer %p\n",
+                       len, r->large_reserved);
+  r->last_reserved = len;
+  return r->large_reserved;
+}
+
+// With a mirrored mapping every reservation is contiguous, so there
+// is no early wrap: just wait for enough free space.
+static char* reserve_mirrored(struct rring* r, int len, int block)
+{
+  int stalled = 0;
+  while(1) {
+    int our_tail = r->tail;
+    int observed_head = r->head; // Only consumer changes this.
+    int used = (our_tail >= observed_head) ? our_tail - observed_head
+                                           : r->orig_end - observed_head + our_tail;
+    if (len < r->orig_end - used)
+      return reserved(r, stalled, len, r->buffer + our_tail);
+    if (!block) return NULL;
+    spsc_rring_debug_log("! reserve_buffer: (mirrored) waiting for %d bytes, %d in use\n", len, used);
+    note_stall(r, &stalled, len);
+    wait();
+  }
+}
+
+// Reserve, or without block, return NULL where that would wait.
+static char* reserve(struct rring* r, int len, int block)
+{
+  // The ring never fills completely, so a reservation of its whole
+  // capacity (or more) can only be satisfied out-of-band:
+  if (len >= r->orig_end)
+    return reserve_large(r, len, block);
+  if (r->flags & RRING_MIRRORED)
+    return reserve_mirrored(r, len, block);
+  int stalled = 0;
   while(1) // Retry loop.
     { 
-    int our_tail = g_buffer_tail;
-    int observed_head = g_buffer_head; // Only consumer changes this.
-    int observed_end = g_buffer_end;
+    int our_tail = r->tail;
+    int observed_head = r->head; // Only consumer changes this.
+    int observed_end = r->end;
     int headroom;
     if (our_tail < observed_head) // Torn/wrapped-around state.
          headroom = observed_head - our_tail;
@@ -183,25 +552,24 @@ char* reserve_buffer(int len)
     spsc_rring_debug_log("  reserve_buffer: headroom = %d  (head/tail/end %d / %d / %d)\n",
           headroom, observed_head, our_tail, observed_end);
     if (len < headroom)
-      {
-        g_buffer_last_reserved = len;
-        return g_buffer+our_tail; // good to go!
-      }
+      return reserved(r, stalled, len, r->buffer+our_tail); // good to go!
     else if (our_tail < observed_head) // Torn state
       {
         int clearpos = our_tail + len;
         if ( clearpos < observed_end ) {
           // Don't wait for state change, wait till we have just enough room:
-          // while( g_buffer_head < clearpos ) 
+          // while( r->head < clearpos ) 
           spsc_rring_debug_log("! reserve_buffer: wait for head to advance.  Head/tail/end: %d %d %d\n",
                                observed_head, our_tail, observed_end);
         } else {
           // Otherwise we have to wait for state change.  In natural
           // state the shrunk buffer is restored.
-          // while( g_buffer_head < our_tail ) 
+          // while( r->head < our_tail ) 
           spsc_rring_debug_log("! reserve_buffer: wait to exit torn state.  Head/tail/end: %d %d %d\n",
                                observed_head, our_tail, observed_end);
         }
+        if (!block) return NULL;
+        note_stall(r, &stalled, len);
         wait();
         continue;
       }
@@ -213,32 +581,260 @@ char* reserve_buffer(int len)
         while ( observed_head == 0 ) {
           spsc_rring_debug_log("! reserve_buffer: stalling EARLY WRAP (tail %d), until head moves off the start mark\n",
                                our_tail);
+          if (!block) return NULL;
+          note_stall(r, &stalled, len);
           wait();
-          observed_head = g_buffer_head;
+          observed_head = r->head;
         }
         
         spsc_rring_debug_log("! reserve_buffer: committing an EARLY WRAP, shrinking end from %d to %d\n",
                       observed_end, our_tail);
+        AMB_TRACE2(early_wrap, r, observed_end - our_tail);
         // We're in "natural" not "torn" state until *we* change it.
-        g_buffer_end = our_tail; // The state gives us "the lock" on this var.
+        r->end = our_tail; // The state gives us "the lock" on this var.
         our_tail      = 0;
-        g_buffer_tail = 0; // State change!  Torn state.
+        r->tail = 0; // State change!  Torn state.
         continue;
       }
   }
 }
 
-void release_buffer(int len)
+char* rring_reserve(struct rring* r, int len)
+{
+  return reserve(r, len, 1);
+}
+
+char* rring_try_reserve(struct rring* r, int len)
+{
+  return reserve(r, len, 0);
+}
+
+int64_t rring_used(struct rring* r)
+{
+  return r->released - r->popped;
+}
+
+int rring_queued_large(struct rring* r)
+{
+  return (r->large_tail - r->large_head + RRING_LARGE_QUEUE_SIZE) % RRING_LARGE_QUEUE_SIZE;
+}
+
+// Release timestamps
+// ----------------------------------------------------------------------------
+
+int64_t rring_now_ns()
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (int64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void rring_set_stamping(struct rring* r, int64_t everyNs)
+{
+  r->stamp_every = everyNs;
+}
+
+// (Producer) Date what is about to be released at r->released, unless
+// the last timestamp is recent enough to cover it, or the queue is
+// full (then the last one covers it, making it look older).
+static inline void stamp(struct rring* r)
+{
+  if (r->stamp_every <= 0) return;
+  int64_t now = rring_now_ns();
+  int tail = r->stamp_tail;
+  int last = (tail + RRING_STAMPS - 1) % RRING_STAMPS;
+  if (tail != r->stamp_head && now - r->stamps[last].ns < r->stamp_every) return;
+  int next = (tail + 1) % RRING_STAMPS;
+  if (next == r->stamp_head) return;
+  r->stamps[tail].pos = r->released;
+  r->stamps[tail].ns  = now;
+  r->stamp_tail = next; // Publish (total store order).
+}
+
+int64_t rring_oldest_ns(struct rring* r)
+{
+  int head = r->stamp_head;
+  if (head == r->stamp_tail) return 0;
+  // Drop timestamps passed by the consumer, but keep the last one
+  // at or before its position, which dates it:
+  while (1) {
+    int next = (head + 1) % RRING_STAMPS;
+    if (next == r->stamp_tail || r->stamps[next].pos > r->popped) break;
+    head = next;
+  }
+  r->stamp_head = head;
+  return r->stamps[head].ns;
+}
+
+// Message boundaries
+// ----------------------------------------------------------------------------
+
+void rring_set_boundaries(struct rring* r, int64_t everyBytes)
+{
+  r->end_every = everyBytes;
+}
+
+// (Producer) A message ends at r->produced, after what was just
+// published.  Queue it, unless the last one queued is close enough
+// behind, or the queue is full; either way it is the latest.
+static inline void mark_end(struct rring* r)
 {
-  spsc_rring_debug_log("  => release_buffer of %d bytes, new tail %d\n", len, g_buffer_tail + len);
+  if (r->end_every <= 0 || r->open) return;
+  int64_t pos = r->produced;
+  r->last_end = pos;
+  int tail = r->end_tail;
+  int last = (tail + RRING_ENDS - 1) % RRING_ENDS;
+  if (tail != r->end_head && pos - r->ends[last] < r->end_every) return;
+  int next = (tail + 1) % RRING_ENDS;
+  if (next == r->end_head) return;
+  r->ends[tail] = pos;
+  r->end_tail = next; // Publish (total store order).
+}
+
+void rring_begin_message(struct rring* r)
+{
+  r->open = 1;
+}
+
+void rring_end_message(struct rring* r)
+{
+  r->open = 0;
+  mark_end(r);
+}
+
+int64_t rring_next_boundary(struct rring* r)
+{
+  int head = r->end_head;
+  while (head != r->end_tail && r->ends[head] <= r->consumed)
+    head = (head + 1) % RRING_ENDS;
+  r->end_head = head;
+  if (head != r->end_tail) return r->ends[head];
+  int64_t last = r->last_end;
+  return last > r->consumed ? last : -1;
+}
+
+void rring_release(struct rring* r, int len)
+{
+  spsc_rring_debug_log("  => release_buffer of %d bytes, new tail %d\n", len, r->tail + len);
   
-  if (len > g_buffer_last_reserved) {
+  if (len > r->last_reserved) {
     fprintf(stderr, "ERROR: cannot finish/release %d bytes, only reserved %d\n",
-            len, g_buffer_last_reserved);
+            len, r->last_reserved);
     abort();
   }
-  g_buffer_tail += len;
-  g_buffer_last_reserved = -1;
+  stamp(r);
+  if (r->large_reserved != NULL) {
+    struct rring_large* msg = & r->large_queue[r->large_tail];
+    msg->ptr  = r->large_reserved;
+    msg->len  = len;
+    msg->sent = 0;
+    msg->pos  = r->released;
+    msg->done = NULL;
+    msg->fd   = -1;
+    r->large_reserved = NULL;
+    r->last_reserved = -1;
+    r->produced += len;
+    if (len > 0) // Publish the descriptor last (total store order).
+      r->large_tail = (r->large_tail + 1) % RRING_LARGE_QUEUE_SIZE;
+    else
+      free(msg->ptr);
+    mark_end(r);
+    return;
+  }
+  r->released += len;
+  r->produced += len;
+  if ((r->flags & RRING_MIRRORED) && r->tail + len >= r->orig_end)
+    r->tail = r->tail + len - r->orig_end;
+  else
+    r->tail += len;
+  r->last_reserved = -1;
+  mark_end(r);
   
   // g_buffer_msgs++; // Only a release counts as a real "message".
 }
+
+void rring_release_ref(struct rring* r, char* ptr, int len, rring_done_fn done, void* arg)
+{
+  if (r->last_reserved >= 0) {
+    fprintf(stderr, "ERROR: cannot release bytes by reference while %d bytes are reserved\n",
+            r->last_reserved);
+    abort();
+  }
+  if (len <= 0) {
+    done(ptr, len, arg);
+    return;
+  }
+  wait_large_slot(r);
+  stamp(r);
+  spsc_rring_debug_log("  => release_ref of %d bytes at %p\n", len, ptr);
+  struct rring_large* msg = & r->large_queue[r->large_tail];
+  msg->ptr  = ptr;
+  msg->len  = len;
+  msg->sent = 0;
+  msg->pos  = r->released;
+  msg->done = done;
+  msg->done_arg = arg;
+  msg->fd   = -1;
+  r->produced += len;
+  // Publish the descriptor last (total store order).
+  r->large_tail = (r->large_tail + 1) % RRING_LARGE_QUEUE_SIZE;
+  mark_end(r);
+}
+
+void rring_release_fd(struct rring* r, int fd, rring_eof_fn eof, void* arg)
+{
+#ifdef _WIN32
+  fprintf(stderr, "ERROR: rring_release_fd is not supported on Windows\n");
+  abort();
+#else
+  if (r->last_reserved >= 0) {
+    fprintf(stderr, "ERROR: cannot release a stream while %d bytes are reserved\n",
+            r->last_reserved);
+    abort();
+  }
+  wait_large_slot(r);
+  stamp(r);
+  spsc_rring_debug_log("  => release_fd of stream %d\n", fd);
+  struct rring_large* msg = & r->large_queue[r->large_tail];
+  msg->ptr  = malloc(RRING_STREAM_CHUNK);
+  if (msg->ptr == NULL) {
+    fprintf(stderr,"\nERROR: rring_release_fd failed to allocate its buffer\n");
+    abort();
+  }
+  msg->len  = 0; // Empty: the first peek fills it.
+  msg->sent = 0;
+  msg->pos  = r->released;
+  msg->done = NULL;
+  msg->fd   = fd;
+  msg->streamed = 0;
+  msg->eof  = eof;
+  msg->done_arg = arg;
+  // Publish the descriptor last (total store order).
+  r->large_tail = (r->large_tail + 1) % RRING_LARGE_QUEUE_SIZE;
+  mark_end(r);
+#endif
+}
+
+
+// Legacy API, on the current ring
+//--------------------------------------------------------------------------------
+
+int   new_buffer_flags(int sz, int flags) { return rring_init(rring_current(), sz, flags); }
+void  new_buffer(int sz)                  { rring_init(rring_current(), sz, 0); }
+void  reset_buffer()                      { rring_reset(rring_current()); }
+void  free_buffer()                       { rring_free(rring_current()); }
+int   buffer_capacity()                   { return rring_capacity(rring_current()); }
+char* buffer_region(size_t* len)          { return rring_region(rring_current(), len); }
+char* peek_buffer(int* numread)           { return rring_peek(rring_current(), numread); }
+char* peek_buffer_next(int first, int* numread) { return rring_peek_next(rring_current(), first, numread); }
+void  pop_buffer(int numread)             { rring_pop(rring_current(), numread); }
+char* try_reserve_buffer(int len)         { return rring_try_reserve(rring_current(), len); }
+char* reserve_buffer(int len)             { return rring_reserve(rring_current(), len); }
+void  release_buffer(int len)             { rring_release(rring_current(), len); }
@@ -0,0 +1,688 @@
+// See the corresponding header for function-level documentation.
+
+#ifndef _WIN32
+  #define _GNU_SOURCE // MAP_FIXED_NOREPLACE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <windows.h>
+  #include <io.h>
+#else
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <signal.h>
+  #include <sys/mman.h>
+#endif
+
+#include "ambrosia/client.h"
+#include "ambrosia/compress.h"
+#include "ambrosia/state_arena.h"
+#include "ambrosia/internal/spsc_rring.h"
+
+#define ARENA_MAGIC   0x414e455241424d41ULL // "AMBARENA"
+#define ARENA_DELTA_MAGIC 0x41544c4544424d41ULL // "AMBDELTA"
+#define ARENA_VERSION 2
+
+// Size classes: multiples of 16 bytes up to 64, then four per
+// doubling, so that rounding up wastes at most a quarter of a block.
+// This covers blocks up to 2^47 bytes.
+#define ARENA_CLASSES (4 + 4 * (47 - 6))
+
+// The arena's own state, at its base.  Offsets are from the base, and
+// 0 means none.
+struct amb_arena {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t base;     // The address the arena must be mapped at.
+  uint64_t capacity;
+  uint64_t used;     // Never-allocated bytes start here: the image ends here.
+  uint64_t root;
+  uint64_t gen;      // Snapshots taken: the image (or delta) written last.
+  uint64_t tracking; // struct arena_tracking*, or 0.  Not valid in an image.
+  uint64_t free_lists[ARENA_CLASSES]; // Freed blocks, by size class.
+};
+
+// A delta image: this header, nruns {offset, length} pairs, and then
+// the bytes of each run.  The first run starts with the arena's header.
+struct arena_delta {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t base;
+  uint64_t gen;
+  uint64_t prev_gen; // The image it applies to.
+  uint64_t used;
+  uint64_t nruns;
+};
+
+// Incremental checkpoints, in ordinary memory (transient, but like all
+// memory, seen by a forked checkpoint process):
+struct arena_tracking {
+  int      method;
+  int      full_every;
+  int      chain_fd;   // The local chain of images, or -1.
+  int64_t  pid;        // Where snapshots are taken.
+  uint64_t page;       // Tracking granularity: the system page size.
+  uint64_t* dirty;     // One bit per page, set between snapshots.
+  uint64_t last_used;  // a->used at the last snapshot, 0 before the first.
+  uint64_t last_full;  // The generation of the last full image.
+
+  // The last snapshot, until a checkpoint writes it:
+  int       pending;   // PENDING_*
+  uint64_t* runs;      // {offset, length} pairs.
+  int64_t   nruns, runs_cap;
+  int64_t   image_bytes;
+
+  struct amb_arena_stats stats;
+};
+
+enum { PENDING_NONE = 0, PENDING_FULL = 1, PENDING_DELTA = 2 };
+
+#define TRACKING(a) ((struct arena_tracking*)(uintptr_t)(a)->tracking)
+
+// Precedes every block; 16 bytes, to keep blocks 16-byte aligned.
+struct arena_block {
+  uint32_t cls;
+  uint32_t magic;
+  uint64_t next; // Offset of the next free block of this class, while free.
+};
+
+#define BLOCK_MAGIC 0xb10cb10c
+
+// The smallest class holding n bytes.
+static int size_class(size_t n)
+{
+  if (n <= 64) return n == 0 ? 0 : (int)((n + 15) / 16) - 1;
+  int k = 6; // 2^k < n <= 2^(k+1)
+  while (((size_t)2 << k) < n) k++;
+  return 4 + (k - 6) * 4 + (int)((n - 1 - ((size_t)1 << k)) >> (k - 2));
+}
+
+static uint64_t class_size(int c)
+{
+  if (c < 4) return 16 * (uint64_t)(c + 1);
+  int k = 6 + (c - 4) / 4;
+  return ((uint64_t)1 << k) + (uint64_t)((c - 4) % 4 + 1) * ((uint64_t)1 << (k - 2));
+}
+
+// Map capacity bytes at exactly base, or return NULL.
+static char* arena_map(void* base, size_t capacity)
+{
+#ifdef _WIN32
+  return (char*)VirtualAlloc(base, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_FIXED_NOREPLACE
+  flags |= MAP_FIXED_NOREPLACE;
+#endif
+  char* p = (char*)mmap(base, capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  if (p != (char*)base) { // Older kernels take the address as a hint only.
+    munmap(p, capacity);
+    return NULL;
+  }
+  return p;
+#endif
+}
+
+amb_arena* amb_arena_create(size_t capacity, void* base)
+{
+  if (base == NULL) base = AMB_ARENA_DEFAULT_BASE;
+  capacity = (capacity + 4095) & ~(size_t)4095;
+  if (capacity < sizeof(struct amb_arena)) capacity = 4096;
+  struct amb_arena* a = (struct amb_arena*)arena_map(base, capacity);
+  if (a == NULL) {
+    fprintf(stderr, "ERROR: state arena: could not map %llu bytes at %p: %s\n",
+            (unsigned long long)capacity, base, amb_get_error_string());
+    abort();
+  }
+  a->magic    = ARENA_MAGIC;
+  a->version  = ARENA_VERSION;
+  a->base     = (uint64_t)(uintptr_t)a;
+  a->capacity = capacity;
+  a->used     = (sizeof(struct amb_arena) + 15) & ~(uint64_t)15;
+  a->root     = 0;
+  a->gen      = 0;
+  a->tracking = 0;
+  return a;
+}
+
+void amb_arena_destroy(amb_arena* a)
+{
+#ifdef _WIN32
+  VirtualFree(a, 0, MEM_RELEASE);
+#else
+  munmap(a, a->capacity);
+#endif
+}
+
+void* amb_arena_alloc(amb_arena* a, size_t n)
+{
+  int c = n < a->capacity ? size_class(n) : ARENA_CLASSES;
+  struct arena_block* b;
+  if (c < ARENA_CLASSES && a->free_lists[c] != 0) {
+    b = (struct arena_block*)((char*)a + a->free_lists[c]);
+    a->free_lists[c] = b->next;
+    amb_arena_mark_dirty(a, b, sizeof(*b));
+  } else {
+    uint64_t need = c < ARENA_CLASSES ? sizeof(struct arena_block) + class_size(c) : UINT64_MAX;
+    if (need > a->capacity - a->used) {
+      fprintf(stderr, "ERROR: state arena: out of space for %llu more bytes (%llu of %llu used)\n",
+              (unsigned long long)n, (unsigned long long)a->used, (unsigned long long)a->capacity);
+      abort();
+    }
+    b = (struct arena_block*)((char*)a + a->used);
+    a->used += need;
+    b->cls   = c;
+    b->magic = BLOCK_MAGIC;
+  }
+  b->next = 0;
+  return b + 1;
+}
+
+void amb_arena_free(amb_arena* a, void* p)
+{
+  if (p == NULL) return;
+  struct arena_block* b = (struct arena_block*)p - 1;
+  if ((char*)b < (char*)a || (char*)p >= (char*)a + a->used || b->magic != BLOCK_MAGIC) {
+    fprintf(stderr, "ERROR: state arena: freeing %p, which is not an allocated block\n", p);
+    abort();
+  }
+  b->next = a->free_lists[b->cls];
+  a->free_lists[b->cls] = (uint64_t)((char*)b - (char*)a);
+  amb_arena_mark_dirty(a, b, sizeof(*b));
+}
+
+void amb_arena_set_root(amb_arena* a, void* p)
+{
+  a->root = p == NULL ? 0 : (uint64_t)((char*)p - (char*)a);
+}
+
+void* amb_arena_root(amb_arena* a)
+{
+  return a->root == 0 ? NULL : (char*)a + a->root;
+}
+
+int64_t amb_arena_used(amb_arena* a)
+{
+  return (int64_t)a->used;
+}
+
+static int64_t arena_pid()
+{
+#ifdef _WIN32
+  return (int64_t)GetCurrentProcessId();
+#else
+  return (int64_t)getpid();
+#endif
+}
+
+// Write exactly len bytes to fd, or bail out.
+static void arena_write_all(int fd, const void* buf, int64_t len)
+{
+  const char* p = (const char*)buf;
+  while (len > 0) {
+    int n = len < (1 << 30) ? (int)len : (1 << 30);
+#ifdef _WIN32
+    int done = _write(fd, p, n);
+#else
+    ssize_t done = write(fd, p, n);
+    if (done < 0 && errno == EINTR) continue;
+#endif
+    if (done <= 0) {
+      fprintf(stderr, "ERROR: state arena: failed to write the image chain: %s\n", amb_get_error_string());
+      abort();
+    }
+    p += done;
+    len -= done;
+  }
+}
+
+// Read up to len bytes from fd, stopping only at its end.
+// RETURN: the bytes read.
+static int64_t arena_read_some(int fd, void* buf, int64_t len)
+{
+  char* p = (char*)buf;
+  int64_t got = 0;
+  while (got < len) {
+    int n = len - got < (1 << 30) ? (int)(len - got) : (1 << 30);
+#ifdef _WIN32
+    int done = _read(fd, p + got, n);
+#else
+    ssize_t done = read(fd, p + got, n);
+    if (done < 0 && errno == EINTR) continue;
+#endif
+    if (done < 0) {
+      fprintf(stderr, "ERROR: state arena: failed to read the image chain: %s\n", amb_get_error_string());
+      abort();
+    }
+    if (done == 0) break;
+    got += done;
+  }
+  return got;
+}
+
+// Append the last snapshot's image (kind) to the chain.
+static void arena_write_chain(amb_arena* a, struct arena_tracking* t, int kind)
+{
+  int64_t len = t->image_bytes;
+  arena_write_all(t->chain_fd, &len, sizeof(len));
+  if (kind == PENDING_FULL) {
+    arena_write_all(t->chain_fd, a, len);
+    return;
+  }
+  struct arena_delta d;
+  d.magic    = ARENA_DELTA_MAGIC;
+  d.version  = ARENA_VERSION;
+  d.base     = a->base;
+  d.gen      = a->gen;
+  d.prev_gen = a->gen - 1;
+  d.used     = a->used;
+  d.nruns    = (uint64_t)t->nruns;
+  arena_write_all(t->chain_fd, &d, sizeof(d));
+  arena_write_all(t->chain_fd, t->runs, t->nruns * 16);
+  for (int64_t i = 0; i < t->nruns; i++)
+    arena_write_all(t->chain_fd, (const char*)a + t->runs[2*i], (int64_t)t->runs[2*i+1]);
+}
+
+void amb_arena_checkpoint(amb_arena* a)
+{
+  struct arena_tracking* t = TRACKING(a);
+  int64_t len = (int64_t)a->used;
+  if (t != NULL) {
+    if (t->pending == PENDING_NONE) {
+      if (t->pid != arena_pid()) {
+        fprintf(stderr, "ERROR: state arena: no snapshot to write in the checkpoint process;"
+                " set amb_client_options.snapshot to call amb_arena_snapshot\n");
+        abort();
+      }
+      amb_arena_snapshot(a);
+    }
+    if (t->chain_fd >= 0) {
+      arena_write_chain(a, t, t->pending);
+      amb_debug_log("  Arena image (%s) of %lld bytes appended to the chain\n",
+                    t->pending == PENDING_FULL ? "full" : "delta", (long long)t->image_bytes);
+    }
+    t->pending = PENDING_NONE;
+  }
+  // The coordinator keeps only this one, so it is always whole:
+  amb_checkpoint_writer* w = amb_checkpoint_begin(len, 0);
+  amb_checkpoint_write(w, a, len);
+  int64_t sent = amb_checkpoint_end(w);
+  amb_debug_log("  Arena checkpoint of %lld bytes queued as %lld\n", (long long)len, (long long)sent);
+  (void)sent;
+}
+
+amb_arena* amb_arena_load(int fd, int64_t len)
+{
+  struct amb_arena hdr;
+  amb_zreader* r = amb_zreader_open(fd, len);
+  len = amb_zreader_size(r);
+  if (len < (int64_t)sizeof(hdr)) {
+    fprintf(stderr, "ERROR: state arena: a %lld byte image is too short\n", (long long)len);
+    abort();
+  }
+  amb_zreader_read(r, &hdr, sizeof(hdr));
+  if (hdr.magic != ARENA_MAGIC || hdr.version != ARENA_VERSION ||
+      hdr.used != (uint64_t)len || hdr.used > hdr.capacity) {
+    fprintf(stderr, "ERROR: state arena: not an arena image (version %llu, %llu of %llu bytes used, %lld read)\n",
+            (unsigned long long)hdr.version, (unsigned long long)hdr.used,
+            (unsigned long long)hdr.capacity, (long long)len);
+    abort();
+  }
+  char* base = arena_map((void*)(uintptr_t)hdr.base, hdr.capacity);
+  if (base == NULL) {
+    fprintf(stderr, "ERROR: state arena: could not map the image back at %p: %s\n",
+            (void*)(uintptr_t)hdr.base, amb_get_error_string());
+    abort();
+  }
+  hdr.tracking = 0;
+  memcpy(base, &hdr, sizeof(hdr));
+  amb_zreader_read(r, base + sizeof(hdr), len - sizeof(hdr));
+  amb_zreader_close(r);
+  amb_debug_log("  Loaded arena of %lld bytes at %p\n", (long long)len, base);
+  return (amb_arena*)base;
+}
+
+// Incremental checkpoints
+// ------------------------------------------------------------
+
+#ifdef __linux__
+// Whether the kernel keeps soft-dirty bits: clear them, write a page,
+// and look.
+static int soft_dirty_works()
+{
+  int ok = 0;
+  int pm = open("/proc/self/pagemap", O_RDONLY);
+  int cr = open("/proc/self/clear_refs", O_WRONLY);
+  long pg = sysconf(_SC_PAGESIZE);
+  char* p = (char*)mmap(NULL, pg, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pm >= 0 && cr >= 0 && p != MAP_FAILED && write(cr, "4", 1) == 1) {
+    uint64_t e = 0;
+    p[0] = 1;
+    if (pread(pm, &e, 8, (off_t)((uintptr_t)p / pg) * 8) == 8)
+      ok = (e >> 55) & 1;
+  }
+  if (p != MAP_FAILED) munmap(p, pg);
+  if (pm >= 0) close(pm);
+  if (cr >= 0) close(cr);
+  return ok;
+}
+
+// Add the soft-dirty bits of the arena's first npages to t->dirty.
+static void soft_dirty_collect(amb_arena* a, struct arena_tracking* t, uint64_t npages)
+{
+  int pm = open("/proc/self/pagemap", O_RDONLY);
+  uint64_t entries[512];
+  uint64_t first = (uintptr_t)a / t->page;
+  for (uint64_t i = 0; i < npages; i += 512) {
+    uint64_t n = npages - i < 512 ? npages - i : 512;
+    if (pm < 0 || pread(pm, entries, n * 8, (off_t)((first + i) * 8)) != (ssize_t)(n * 8)) {
+      fprintf(stderr, "ERROR: state arena: failed to read /proc/self/pagemap\n");
+      abort();
+    }
+    for (uint64_t j = 0; j < n; j++)
+      if ((entries[j] >> 55) & 1)
+        t->dirty[(i + j) / 64] |= (uint64_t)1 << ((i + j) % 64);
+  }
+  close(pm);
+}
+
+static void soft_dirty_clear()
+{
+  int cr = open("/proc/self/clear_refs", O_WRONLY);
+  if (cr < 0 || write(cr, "4", 1) != 1) {
+    fprintf(stderr, "ERROR: state arena: failed to clear soft-dirty bits\n");
+    abort();
+  }
+  close(cr);
+}
+#endif
+
+// The arena automatic tracking is for (one per process), and for
+// write-protection, how much of it is protected:
+static amb_arena* volatile g_tracked_arena = NULL;
+static volatile uint64_t g_protected_len = 0;
+
+#ifndef _WIN32
+static struct sigaction g_prev_segv;
+
+// The first write to a protected page since the last snapshot.
+static void arena_segv_handler(int sig, siginfo_t* si, void* ctx)
+{
+  amb_arena* a = g_tracked_arena;
+  char* p = (char*)si->si_addr;
+  if (a != NULL && p >= (char*)a && p < (char*)a + g_protected_len) {
+    struct arena_tracking* t = TRACKING(a);
+    uint64_t page = (uint64_t)(p - (char*)a) / t->page;
+    __sync_fetch_and_or(&t->dirty[page / 64], (uint64_t)1 << (page % 64));
+    mprotect((char*)a + page * t->page, t->page, PROT_READ | PROT_WRITE);
+    return;
+  }
+  // Not ours: behave as if we were not here.
+  if (g_prev_segv.sa_flags & SA_SIGINFO)
+    g_prev_segv.sa_sigaction(sig, si, ctx);
+  else if (g_prev_segv.sa_handler == SIG_DFL || g_prev_segv.sa_handler == SIG_IGN)
+    signal(SIGSEGV, SIG_DFL); // The access faults again, fatally.
+  else
+    g_prev_segv.sa_handler(sig);
+}
+#endif
+
+int amb_arena_track(amb_arena* a, int method, int fullEvery)
+{
+  struct arena_tracking* t = TRACKING(a);
+  if (t != NULL) {
+    t->full_every = fullEvery;
+    return t->method;
+  }
+  t = (struct arena_tracking*)calloc(1, sizeof(*t));
+  t->full_every = fullEvery;
+  t->chain_fd = -1;
+  t->pid = arena_pid();
+#ifdef _WIN32
+  t->page = 4096;
+#else
+  t->page = (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+  t->dirty = (uint64_t*)calloc((a->capacity / t->page + 63) / 64, 8);
+  if (t->dirty == NULL) {
+    fprintf(stderr, "ERROR: state arena: failed to allocate the dirty page map\n");
+    abort();
+  }
+
+  int automatic = method == AMB_ARENA_TRACK_AUTO || method == AMB_ARENA_TRACK_SOFT_DIRTY ||
+                  method == AMB_ARENA_TRACK_WRITE_PROTECT;
+  t->method = AMB_ARENA_TRACK_EXPLICIT;
+  if (automatic && g_tracked_arena != NULL) {
+    fprintf(stderr, "WARNING: another arena is already tracked automatically, tracking this one explicitly.\n");
+    automatic = 0;
+  }
+#ifdef __linux__
+  if (automatic && method != AMB_ARENA_TRACK_WRITE_PROTECT && soft_dirty_works())
+    t->method = AMB_ARENA_TRACK_SOFT_DIRTY;
+#endif
+#ifndef _WIN32
+  if (automatic && t->method == AMB_ARENA_TRACK_EXPLICIT && method != AMB_ARENA_TRACK_SOFT_DIRTY) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = arena_segv_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &g_prev_segv) == 0)
+      t->method = AMB_ARENA_TRACK_WRITE_PROTECT;
+  }
+#endif
+  if (automatic && t->method == AMB_ARENA_TRACK_EXPLICIT)
+    fprintf(stderr, "WARNING: could not track arena writes automatically (method %d), tracking explicitly.\n",
+            method);
+  a->tracking = (uint64_t)(uintptr_t)t;
+  if (t->method != AMB_ARENA_TRACK_EXPLICIT)
+    g_tracked_arena = a;
+  return t->method;
+}
+
+void amb_arena_chain(amb_arena* a, int fd)
+{
+  struct arena_tracking* t = TRACKING(a);
+  if (t == NULL) {
+    fprintf(stderr, "ERROR: state arena: amb_arena_chain needs amb_arena_track first\n");
+    abort();
+  }
+  t->chain_fd = fd;
+}
+
+void amb_arena_mark_dirty(amb_arena* a, const void* p, size_t len)
+{
+  struct arena_tracking* t = TRACKING(a);
+  if (t == NULL || len == 0) return;
+  uint64_t off = (uint64_t)((const char*)p - (const char*)a);
+  for (uint64_t page = off / t->page; page <= (off + len - 1) / t->page; page++)
+    t->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+}
+
+// Append a page to the pending runs, extending the last run if it is
+// contiguous.
+static void arena_add_page(amb_arena* a, struct arena_tracking* t, uint64_t page)
+{
+  uint64_t off = page * t->page;
+  uint64_t len = a->used - off < t->page ? a->used - off : t->page;
+  if (t->nruns > 0 && t->runs[2*t->nruns - 2] + t->runs[2*t->nruns - 1] == off) {
+    t->runs[2*t->nruns - 1] += len;
+    return;
+  }
+  if (t->nruns == t->runs_cap) {
+    t->runs_cap = t->runs_cap > 0 ? 2 * t->runs_cap : 256;
+    t->runs = (uint64_t*)realloc(t->runs, t->runs_cap * 16);
+  }
+  t->runs[2*t->nruns]     = off;
+  t->runs[2*t->nruns + 1] = len;
+  t->nruns++;
+}
+
+void amb_arena_snapshot(amb_arena* a)
+{
+  struct arena_tracking* t = TRACKING(a);
+  if (t == NULL) return; // Every image is full.
+  uint64_t npages = (a->used + t->page - 1) / t->page;
+  a->gen++;
+
+#ifdef __linux__
+  if (t->method == AMB_ARENA_TRACK_SOFT_DIRTY)
+    soft_dirty_collect(a, t, npages);
+#endif
+  // Pages written since the last snapshot, those allocated since, and
+  // always the first, with the arena's header:
+  int64_t ndirty = 0;
+  t->nruns = 0;
+  uint64_t fresh = t->last_used / t->page;
+  for (uint64_t page = 0; page < npages; page++)
+    if (page == 0 || page >= fresh || ((t->dirty[page / 64] >> (page % 64)) & 1)) {
+      arena_add_page(a, t, page);
+      ndirty++;
+    }
+  int64_t delta = (int64_t)(sizeof(struct arena_delta) + t->nruns * 16);
+  for (int64_t i = 0; i < t->nruns; i++)
+    delta += (int64_t)t->runs[2*i + 1];
+
+  int full = t->last_used == 0 || t->full_every <= 1 ||
+             a->gen - t->last_full >= (uint64_t)t->full_every || delta >= (int64_t)a->used;
+  if (full) {
+    t->pending = PENDING_FULL;
+    t->image_bytes = (int64_t)a->used;
+    t->last_full = a->gen;
+    ndirty = (int64_t)npages;
+  } else {
+    t->pending = PENDING_DELTA;
+    t->image_bytes = delta;
+    t->stats.deltas++;
+  }
+  t->stats.images++;
+  t->stats.lastBytes      = t->image_bytes;
+  t->stats.lastDirtyPages = ndirty;
+  t->stats.totalBytes    += t->image_bytes;
+  t->stats.savedBytes    += (int64_t)a->used - t->image_bytes;
+  t->last_used = a->used;
+  t->pid = arena_pid();
+
+  // Start afresh:
+  memset(t->dirty, 0, (npages + 63) / 64 * 8);
+#ifdef __linux__
+  if (t->method == AMB_ARENA_TRACK_SOFT_DIRTY)
+    soft_dirty_clear();
+#endif
+#ifndef _WIN32
+  if (t->method == AMB_ARENA_TRACK_WRITE_PROTECT) {
+    g_protected_len = npages * t->page;
+    if (mprotect(a, g_protected_len, PROT_READ) != 0) {
+      fprintf(stderr, "ERROR: state arena: failed to write-protect: %s\n", amb_get_error_string());
+      abort();
+    }
+  }
+#endif
+}
+
+void amb_arena_apply(amb_arena* a, int fd, int64_t len)
+{
+  struct arena_delta d;
+  amb_zreader* r = amb_zreader_open(fd, len);
+  len = amb_zreader_size(r);
+  if (len < (int64_t)sizeof(d)) {
+    fprintf(stderr, "ERROR: state arena: a %lld byte delta is too short\n", (long long)len);
+    abort();
+  }
+  amb_zreader_read(r, &d, sizeof(d));
+  if (d.magic != ARENA_DELTA_MAGIC || d.version != ARENA_VERSION || d.base != a->base ||
+      d.prev_gen != a->gen || d.used > a->capacity || d.nruns == 0 ||
+      d.nruns > (uint64_t)(len - sizeof(d)) / 16) {
+    fprintf(stderr, "ERROR: state arena: delta %llu does not apply to image %llu (version %llu, %llu runs)\n",
+            (unsigned long long)d.gen, (unsigned long long)a->gen,
+            (unsigned long long)d.version, (unsigned long long)d.nruns);
+    abort();
+  }
+  uint64_t* runs = (uint64_t*)malloc(d.nruns * 16);
+  amb_zreader_read(r, runs, d.nruns * 16);
+  int64_t total = (int64_t)(sizeof(d) + d.nruns * 16);
+  for (uint64_t i = 0; i < d.nruns; i++) {
+    total += (int64_t)runs[2*i + 1];
+    if (runs[2*i] > d.used || runs[2*i + 1] > d.used - runs[2*i] ||
+        (i == 0 && (runs[0] != 0 || runs[1] < sizeof(struct amb_arena)))) {
+      fprintf(stderr, "ERROR: state arena: delta %llu has a bad run %llu\n",
+              (unsigned long long)d.gen, (unsigned long long)i);
+      abort();
+    }
+  }
+  if (total != len) {
+    fprintf(stderr, "ERROR: state arena: delta %llu holds %lld bytes, not %lld\n",
+            (unsigned long long)d.gen, (long long)total, (long long)len);
+    abort();
+  }
+  // The header comes first, in the first run:
+  uint64_t tracking = a->tracking;
+  for (uint64_t i = 0; i < d.nruns; i++)
+    amb_zreader_read(r, (char*)a + runs[2*i], (int64_t)runs[2*i + 1]);
+  a->tracking = tracking;
+  amb_zreader_close(r);
+  free(runs);
+  amb_debug_log("  Applied arena delta %llu (%lld bytes)\n", (unsigned long long)d.gen, (long long)len);
+}
+
+amb_arena* amb_arena_load_chain(int fd)
+{
+  amb_arena* a = NULL;
+  int64_t len, images = 0;
+#ifdef _WIN32
+  int64_t end = _lseeki64(fd, 0, SEEK_END);
+  _lseeki64(fd, 0, SEEK_SET);
+#else
+  int64_t end = (int64_t)lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+#endif
+  int64_t at = 0;
+  while (arena_read_some(fd, &len, sizeof(len)) == sizeof(len)) {
+    at += sizeof(len);
+    if (len <= 0 || (end >= 0 && len > end - at)) {
+      fprintf(stderr, "WARNING: state arena: ignoring a torn image at the end of the chain (%lld bytes)\n",
+              (long long)len);
+      break;
+    }
+    uint64_t magic = 0;
+    int64_t got = arena_read_some(fd, &magic, sizeof(magic));
+#ifdef _WIN32
+    _lseeki64(fd, -got, SEEK_CUR);
+#else
+    lseek(fd, -got, SEEK_CUR);
+#endif
+    if (magic == ARENA_DELTA_MAGIC) {
+      if (a == NULL) {
+        fprintf(stderr, "ERROR: state arena: the chain starts with a delta\n");
+        abort();
+      }
+      amb_arena_apply(a, fd, len);
+    } else {
+      if (a != NULL) amb_arena_destroy(a);
+      a = amb_arena_load(fd, len);
+    }
+    at += len;
+    images++;
+  }
+  if (a == NULL) {
+    fprintf(stderr, "ERROR: state arena: no full image in the chain\n");
+    abort();
+  }
+  amb_debug_log("  Loaded arena at %p from a chain of %lld images\n", (void*)a, (long long)images);
+  return a;
+}
+
+void amb_arena_get_stats(amb_arena* a, struct amb_arena_stats* out)
+{
+  struct arena_tracking* t = TRACKING(a);
+  if (t != NULL) *out = t->stats;
+  else memset(out, 0, sizeof(*out));
+}
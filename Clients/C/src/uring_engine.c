@@ -0,0 +1,469 @@
+
+// See the corresponding header for function-level documentation.
+
+#ifndef _WIN32
+  #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <windows.h>
+#else
+  #include <sys/socket.h>
+  #include <sched.h> // sched_yield
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+  #endif
+#endif
+
+// Multishot receive and zero-copy send arrived together (Linux 6.0):
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_CQE_F_NOTIF)
+  #define AMB_HAVE_IO_URING
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+#endif
+
+#include "ambrosia/client.h"
+#include "ambrosia/internal/spsc_rring.h"
+#include "ambrosia/internal/uring_engine.h"
+#include "ambrosia/internal/trace.h"
+
+#ifndef AMB_HAVE_IO_URING
+
+int amb_uring_init(struct amb_runtime* rt)
+{
+  fprintf(stderr, "WARNING: io_uring engine not supported by this build, using threads.\n");
+  return 0;
+}
+
+#ifdef _WIN32
+DWORD WINAPI amb_uring_thread( LPVOID lpParam )
+#else
+void*        amb_uring_thread( void* lpParam )
+#endif
+{
+  return 0;
+}
+
+#else
+
+#define UR_ENTRIES    64          // Submission queue depth.
+#define UR_RECV_BUFS  16          // Provided receive buffers (a power of two).
+#define UR_RECV_BUFSZ (64 * 1024) // Bytes per provided receive buffer.
+#define UR_ZC_MIN     (16 * 1024) // Smallest ring range worth sending zero-copy.
+
+#define UR_FD_UP   0 // Indices into the registered (fixed) files.
+#define UR_FD_DOWN 1
+#define UR_BGID    0 // Provided buffer group for receives.
+
+// The low byte of user_data says which operation completed.  A send
+// keeps its expected byte count in the bits above.
+#define UR_RECV 1
+#define UR_SEND 2
+
+// A received buffer, held until its bytes are copied into the queue:
+struct ur_held {
+  int bid;
+  int len;
+  int off;
+};
+
+// All engine state is private to the engine thread after init.
+struct ur_state {
+  struct amb_runtime* rt;
+  struct rring* ring;
+  int fd;
+
+  // Submission queue:
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_flags;
+  struct io_uring_sqe* sqes;
+  unsigned sq_local_tail; // Includes prepared, unsubmitted entries.
+  unsigned sq_unsubmitted;
+  int taskrun_flag;       // Must we enter the kernel to run completions?
+
+  // Completion queue:
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Receive side:
+  struct io_uring_buf_ring* br;
+  unsigned br_tail;
+  char* recv_mem;
+  int   recv_armed;
+  struct ur_held held[UR_RECV_BUFS]; // FIFO, in arrival order.
+  int   held_head;
+  int   held_count;
+  int   rec_have; // Bytes of the log record under assembly (header included).
+
+  // Send side:
+  char*  ring_base;   // The outbound ring's memory,
+  size_t ring_len;    //   and its length.
+  int    fixed_buf;   // Is it registered as buffer 0?
+  int    send_cqes;   // Completions still due for the sends in flight.
+  int    send_seg[2]; // Ring ranges covered by those sends.
+};
+
+static int ur_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ur_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Setup
+// ------------------------------------------------------------
+
+static int ur_map_rings(struct ur_state* u, struct io_uring_params* p)
+{
+  size_t sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  size_t cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = (sq_len > cq_len ? sq_len : cq_len);
+
+  char* sq = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return 0;
+  char* cq = sq;
+  if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return 0;
+  }
+  u->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) return 0;
+
+  u->sq_head  = (unsigned*)(sq + p->sq_off.head);
+  u->sq_tail  = (unsigned*)(sq + p->sq_off.tail);
+  u->sq_mask  = (unsigned*)(sq + p->sq_off.ring_mask);
+  u->sq_flags = (unsigned*)(sq + p->sq_off.flags);
+  u->cq_head  = (unsigned*)(cq + p->cq_off.head);
+  u->cq_tail  = (unsigned*)(cq + p->cq_off.tail);
+  u->cq_mask  = (unsigned*)(cq + p->cq_off.ring_mask);
+  u->cqes     = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+
+  // Submission slot i always holds sqe i:
+  unsigned* array = (unsigned*)(sq + p->sq_off.array);
+  for (unsigned i = 0; i < p->sq_entries; i++) array[i] = i;
+  u->sq_local_tail = *u->sq_tail;
+  return 1;
+}
+
+// Hand a provided buffer (back) to the kernel.
+static void ur_provide(struct ur_state* u, int bid)
+{
+  struct io_uring_buf* b = & u->br->bufs[u->br_tail & (UR_RECV_BUFS - 1)];
+  b->addr = (uint64_t)(uintptr_t)(u->recv_mem + (size_t)bid * UR_RECV_BUFSZ);
+  b->len  = UR_RECV_BUFSZ;
+  b->bid  = bid;
+  u->br_tail++;
+  __atomic_store_n(& u->br->tail, (uint16_t)u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int ur_setup_recv_buffers(struct ur_state* u)
+{
+  size_t br_len = UR_RECV_BUFS * sizeof(struct io_uring_buf);
+  u->br = mmap(NULL, br_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED) return 0;
+  u->recv_mem = malloc((size_t)UR_RECV_BUFS * UR_RECV_BUFSZ);
+  if (u->recv_mem == NULL) return 0;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uint64_t)(uintptr_t)u->br;
+  reg.ring_entries = UR_RECV_BUFS;
+  reg.bgid         = UR_BGID;
+  if (ur_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return 0;
+
+  for (int i = 0; i < UR_RECV_BUFS; i++) ur_provide(u, i);
+  return 1;
+}
+
+int amb_uring_init(struct amb_runtime* rt)
+{
+  struct ur_state* u = (struct ur_state*)calloc(1, sizeof(struct ur_state));
+  u->rt = rt;
+  u->ring = & rt->ring;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // Only run completion work when we ask for it, rather than by interrupt:
+  p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+  u->fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  if (u->fd < 0 && errno == EINVAL) { // Older kernel.
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  }
+  if (u->fd < 0) {
+    fprintf(stderr, "WARNING: io_uring_setup failed (%s), using threads.\n", strerror(errno));
+    free(u);
+    return 0;
+  }
+  u->taskrun_flag = (p.flags & IORING_SETUP_TASKRUN_FLAG) != 0;
+
+  const char* failed = NULL;
+  int fds[2] = { rt->upfd, rt->downfd }; // Indexed by UR_FD_UP, UR_FD_DOWN.
+  if (!ur_map_rings(u, &p))
+    failed = "mapping the queues";
+  else if (ur_register(u->fd, IORING_REGISTER_FILES, fds, 2) < 0)
+    failed = "registering the sockets";
+  else if (!ur_setup_recv_buffers(u))
+    failed = "registering provided receive buffers";
+  if (failed != NULL) {
+    fprintf(stderr, "WARNING: io_uring engine unavailable (%s: %s), using threads.\n",
+            failed, strerror(errno));
+    close(u->fd); // Releases everything registered with it.
+    free(u->recv_mem);
+    free(u);
+    return 0;
+  }
+
+  // Optional: send straight out of the outbound ring's pinned pages.
+  struct iovec iov;
+  u->ring_base = rring_region(u->ring, &u->ring_len);
+  iov.iov_base = u->ring_base;
+  iov.iov_len  = u->ring_len;
+  u->fixed_buf = ur_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  rt->uring = u;
+  return 1;
+}
+
+// Submission and completion
+// ------------------------------------------------------------
+
+static struct io_uring_sqe* ur_get_sqe(struct ur_state* u)
+{
+  if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= UR_ENTRIES) {
+    fprintf(stderr, "ERROR: io_uring submission queue overflow\n");
+    abort();
+  }
+  struct io_uring_sqe* sqe = & u->sqes[u->sq_local_tail & *u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_local_tail++;
+  u->sq_unsubmitted++;
+  return sqe;
+}
+
+// One syscall submits everything prepared, and (if the kernel has
+// flagged it) runs deferred completion work.  Otherwise, no syscall.
+static void ur_submit(struct ur_state* u)
+{
+  unsigned flags = 0;
+  if (u->taskrun_flag && (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_TASKRUN))
+    flags |= IORING_ENTER_GETEVENTS;
+  if (u->sq_unsubmitted == 0 && flags == 0) return;
+
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  int n = ur_enter(u->fd, u->sq_unsubmitted, 0, flags);
+  if (n < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return; // Retry next time.
+    fprintf(stderr, "ERROR: io_uring_enter failed: %s\n", strerror(errno));
+    abort();
+  }
+  u->sq_unsubmitted -= n;
+}
+
+static void ur_arm_recv(struct ur_state* u)
+{
+  struct io_uring_sqe* sqe = ur_get_sqe(u);
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = UR_FD_DOWN;
+  sqe->flags     = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->buf_group = UR_BGID;
+  sqe->user_data = UR_RECV;
+  u->recv_armed = 1;
+}
+
+static void ur_prep_send(struct ur_state* u, char* ptr, int len, int link)
+{
+  int in_ring = ptr >= u->ring_base && ptr < u->ring_base + u->ring_len;
+  struct io_uring_sqe* sqe = ur_get_sqe(u);
+  if (u->fixed_buf && in_ring && len >= UR_ZC_MIN) {
+    sqe->opcode    = IORING_OP_SEND_ZC;
+    sqe->ioprio    = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = 0;
+  } else
+    sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = UR_FD_UP;
+  sqe->flags     = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+  sqe->addr      = (uint64_t)(uintptr_t)ptr;
+  sqe->len       = len;
+  sqe->msg_flags = MSG_WAITALL; // No short sends, which would break the link.
+  sqe->user_data = ((uint64_t)len << 8) | UR_SEND;
+  u->send_cqes++;
+}
+
+// Send everything visible in the outbound ring, popping it only once
+// the kernel is done with it.  A torn ring goes out as two linked
+// sends, so its halves stay in order without a second round trip.
+static int ur_start_send(struct ur_state* u)
+{
+  int first = 0, second = 0;
+  char* ptr = rring_peek(u->ring, &first);
+  if (first <= 0) return 0;
+  char* ptr2 = rring_peek_next(u->ring, first, &second);
+  amb_debug_log(" io_uring: sending %d + %d bytes\n", first, second);
+  AMB_TRACE1(flush_begin, first + second);
+  ur_prep_send(u, ptr, first, second > 0);
+  if (second > 0)
+    ur_prep_send(u, ptr2, second, 0);
+  u->send_seg[0] = first;
+  u->send_seg[1] = second;
+  return 1;
+}
+
+static void ur_send_done(struct ur_state* u, struct io_uring_cqe* cqe)
+{
+  if (cqe->flags & IORING_CQE_F_NOTIF) { // Zero-copy: pages released.
+    u->send_cqes--;
+  } else {
+    int expected = (int)(cqe->user_data >> 8);
+    if (cqe->res != expected) {
+      fprintf(stderr, "\nERROR: io_uring send of %d bytes returned %d (%s)\n", expected, cqe->res,
+              cqe->res < 0 ? strerror(-cqe->res) : "short send");
+      abort();
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) // A notification is due otherwise.
+      u->send_cqes--;
+  }
+  if (u->send_cqes == 0) {
+    AMB_TRACE1(flush_end, u->send_seg[0] + u->send_seg[1]);
+    rring_pop(u->ring, u->send_seg[0]);
+    if (u->send_seg[1] > 0)
+      rring_pop(u->ring, u->send_seg[1]);
+  }
+}
+
+static void ur_recv_done(struct ur_state* u, struct io_uring_cqe* cqe)
+{
+  if (cqe->res > 0) {
+    struct ur_held* h = & u->held[(u->held_head + u->held_count) % UR_RECV_BUFS];
+    h->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    h->len = cqe->res;
+    h->off = 0;
+    u->held_count++;
+  } else if (cqe->res == 0) {
+    fprintf(stderr, "\nERROR: connection interrupted. The coordinator closed the down socket.\n");
+    abort();
+  } else if (cqe->res != -ENOBUFS) { // Out of buffers just pauses receiving.
+    fprintf(stderr, "\nERROR: io_uring receive failed: %s\n", strerror(-cqe->res));
+    abort();
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    u->recv_armed = 0; // The multishot receive ended, re-arm it later.
+}
+
+static int ur_reap(struct ur_state* u)
+{
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) return 0;
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = & u->cqes[head & *u->cq_mask];
+    if ((cqe->user_data & 0xff) == UR_RECV)
+      ur_recv_done(u, cqe);
+    else
+      ur_send_done(u, cqe);
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Copy held bytes into the receive queue, one log record per slot,
+// returning each buffer to the kernel once it is used up.  When the
+// queue is full, buffers stay held, and the kernel eventually runs
+// out and pauses the receive: that is our backpressure.
+static int ur_drain(struct ur_state* u)
+{
+  struct amb_runtime* rt = u->rt;
+  int progress = 0;
+  while (u->held_count > 0) {
+    int next = (rt->recv_tail + 1) % rt->recv_nslots;
+    if (next == rt->recv_head) break; // All slots are awaiting dispatch.
+    struct amb_recv_slot* slot = & rt->recv_slots[rt->recv_tail];
+    struct ur_held* h = & u->held[u->held_head];
+    char* src = u->recv_mem + (size_t)h->bid * UR_RECV_BUFSZ + h->off;
+    int avail = h->len - h->off;
+    int take;
+
+    if (u->rec_have < AMBROSIA_HEADERSIZE) {
+      take = AMBROSIA_HEADERSIZE - u->rec_have;
+      if (take > avail) take = avail;
+      memcpy((char*)&slot->hdr + u->rec_have, src, take);
+      u->rec_have += take;
+      if (u->rec_have == AMBROSIA_HEADERSIZE) {
+        int payloadsize = slot->hdr.totalSize - AMBROSIA_HEADERSIZE;
+        if (payloadsize < 0) {
+          fprintf(stderr, "\nERROR: received a log header with an invalid size: %d\n", slot->hdr.totalSize);
+          abort();
+        }
+        if (payloadsize > slot->bufsize) {
+          free(slot->buf);
+          slot->bufsize = payloadsize;
+          slot->buf = (char*)malloc(payloadsize);
+        }
+      }
+    } else {
+      take = slot->hdr.totalSize - u->rec_have;
+      if (take > avail) take = avail;
+      memcpy(slot->buf + (u->rec_have - AMBROSIA_HEADERSIZE), src, take);
+      u->rec_have += take;
+    }
+
+    h->off += take;
+    if (h->off == h->len) {
+      ur_provide(u, h->bid);
+      u->held_head = (u->held_head + 1) % UR_RECV_BUFS;
+      u->held_count--;
+    }
+    if (u->rec_have >= AMBROSIA_HEADERSIZE && u->rec_have == slot->hdr.totalSize) {
+      u->rec_have = 0;
+      AMB_TRACE2(record_received, slot->hdr.seqID, slot->hdr.totalSize - AMBROSIA_HEADERSIZE);
+      rt->recv_tail = next; // Publish (total store order).
+    }
+    progress = 1;
+  }
+  return progress;
+}
+
+void* amb_uring_thread( void* lpParam )
+{
+  struct amb_runtime* rt = (struct amb_runtime*)lpParam;
+  struct ur_state* u = (struct ur_state*)rt->uring;
+  printf(" *** io_uring engine starting (%d x %d byte receive buffers%s)...\n",
+         UR_RECV_BUFS, UR_RECV_BUFSZ, u->fixed_buf ? ", registered send ring" : "");
+  while(1) {
+    int progress = 0;
+    if (u->send_cqes == 0)
+      progress |= ur_start_send(u);
+    if (!u->recv_armed && u->held_count < UR_RECV_BUFS)
+      ur_arm_recv(u);
+    ur_submit(u);
+    progress |= ur_reap(u);
+    progress |= ur_drain(u);
+    amb_check_space(rt);
+    if (!progress)
+      sched_yield();
+  }
+  return 0;
+}
+
+#endif
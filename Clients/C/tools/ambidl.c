@@ -0,0 +1,325 @@
+// ambidl: generates zero-copy C accessors for RPC argument schemas.
+//
+//   ambidl schema.idl > schema.h
+//
+// A schema declares one or more structs:
+//
+//   # Comments run to the end of the line ('#' or '//').
+//   struct Point {
+//     i32   x;
+//     f64   w;
+//     bytes payload;
+//   }
+//
+// Field types: i8 u8 i16 u16 i32 u32 i64 u64 f32 f64, and the variable
+// sized bytes and string.
+//
+// Encoded layout of a struct (host byte order):
+//
+//   [fixed part][variable data]
+//
+// The fixed part holds every fixed-size field at its natural alignment
+// (largest first, so there is no padding between them), then for each
+// variable-size field a pair of u32s, {offset from the start of the
+// struct, length}, and is padded to a multiple of 8 bytes.  The data of
+// the variable-size fields follows, in declaration order.  So every
+// field is at a constant offset, and a reader goes straight to it:
+//
+//   static inline double Point_w(const void* msg);
+//   static inline const void* Point_payload(const void* msg, int32_t* len);
+//   static inline int Point_verify(const void* msg, int len);
+//
+// and a writer fills in a buffer (such as one from reserve_buffer) of
+// Point_size(payload_len) bytes with Point_write, or field by field
+// with the Point_set_* functions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_NAME   64
+#define MAX_FIELDS 256
+
+struct type_info {
+  const char* idl;   // Name in the schema.
+  const char* ctype; // C type of the accessor.
+  int size;          // Bytes in the fixed part; 0 for variable-size.
+};
+
+static const struct type_info g_types[] = {
+  { "i8",  "int8_t",   1 }, { "u8",  "uint8_t",  1 },
+  { "i16", "int16_t",  2 }, { "u16", "uint16_t", 2 },
+  { "i32", "int32_t",  4 }, { "u32", "uint32_t", 4 },
+  { "i64", "int64_t",  8 }, { "u64", "uint64_t", 8 },
+  { "f32", "float",    4 }, { "f64", "double",   8 },
+  { "bytes",  "void", 0 },
+  { "string", "char", 0 },
+};
+
+struct field {
+  char name[MAX_NAME];
+  const struct type_info* type;
+  int offset; // In the fixed part.
+};
+
+struct schema_struct {
+  char name[MAX_NAME];
+  struct field fields[MAX_FIELDS];
+  int nfields;
+  int fields_end; // End of the fixed-size fields.
+  int refs_start; // The {offset, length} pairs, 4-aligned.
+  int refs_end;
+  int fixed_size;
+};
+
+// Lexer
+// ------------------------------------------------------------
+
+static FILE* g_in;
+static const char* g_path;
+static int g_line = 1;
+
+static void fail(const char* msg, const char* tok)
+{
+  fprintf(stderr, "%s:%d: error: %s%s%s\n", g_path, g_line, msg,
+          tok ? ": " : "", tok ? tok : "");
+  exit(1);
+}
+
+// Read the next token (an identifier or one punctuation character)
+// into tok.  RETURN: 0 at the end of the input.
+static int next_token(char* tok)
+{
+  int c;
+  while (1) {
+    c = fgetc(g_in);
+    if (c == '\n') g_line++;
+    if (c == '/' && fgetc(g_in) != '/') fail("stray '/'", NULL);
+    if (c == '#' || c == '/') {
+      while ((c = fgetc(g_in)) != EOF && c != '\n') ;
+      if (c == EOF) return 0;
+      g_line++;
+      continue;
+    }
+    if (c == EOF) return 0;
+    if (!isspace(c)) break;
+  }
+  int n = 0;
+  if (isalnum(c) || c == '_') {
+    while (isalnum(c) || c == '_') {
+      if (n == MAX_NAME - 1) fail("name too long", NULL);
+      tok[n++] = (char)c;
+      c = fgetc(g_in);
+    }
+    ungetc(c, g_in);
+  } else {
+    tok[n++] = (char)c;
+  }
+  tok[n] = 0;
+  return 1;
+}
+
+static void expect(const char* want)
+{
+  char tok[MAX_NAME];
+  if (!next_token(tok) || strcmp(tok, want) != 0)
+    fail("expected", want);
+}
+
+static const struct type_info* lookup_type(const char* name)
+{
+  for (size_t i = 0; i < sizeof(g_types) / sizeof(g_types[0]); i++)
+    if (strcmp(g_types[i].idl, name) == 0) return &g_types[i];
+  return NULL;
+}
+
+// Parse "{ type name; ... }" after "struct Name".
+static void parse_struct(struct schema_struct* s)
+{
+  char tok[MAX_NAME];
+  expect("{");
+  s->nfields = 0;
+  while (1) {
+    if (!next_token(tok)) fail("unterminated struct", s->name);
+    if (strcmp(tok, "}") == 0) break;
+    if (s->nfields == MAX_FIELDS) fail("too many fields in struct", s->name);
+    struct field* f = &s->fields[s->nfields++];
+    if ((f->type = lookup_type(tok)) == NULL) fail("unknown type", tok);
+    if (!next_token(tok) || !(isalpha((unsigned char)tok[0]) || tok[0] == '_'))
+      fail("expected a field name", NULL);
+    for (int i = 0; i < s->nfields - 1; i++)
+      if (strcmp(s->fields[i].name, tok) == 0) fail("duplicate field", tok);
+    strcpy(f->name, tok);
+    expect(";");
+  }
+}
+
+// Layout
+// ------------------------------------------------------------
+
+static void lay_out(struct schema_struct* s)
+{
+  int off = 0;
+  for (int size = 8; size >= 1; size /= 2) // Largest first: no padding.
+    for (int i = 0; i < s->nfields; i++)
+      if (s->fields[i].type->size == size) {
+        s->fields[i].offset = off;
+        off += size;
+      }
+  s->fields_end = off;
+  off = s->refs_start = (off + 3) & ~3;
+  for (int i = 0; i < s->nfields; i++)
+    if (s->fields[i].type->size == 0) {
+      s->fields[i].offset = off;
+      off += 8;
+    }
+  s->refs_end = off;
+  s->fixed_size = (off + 7) & ~7;
+}
+
+// Code generation
+// ------------------------------------------------------------
+
+// The lengths of the variable-size fields, as parameters, e.g.
+// "int32_t symbol_len, int32_t payload_len".
+static void print_len_params(const struct schema_struct* s)
+{
+  int first = 1;
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size != 0) continue;
+    printf("%sint32_t %s_len", first ? "" : ", ", f->name);
+    first = 0;
+  }
+}
+
+static void emit_struct(const struct schema_struct* s)
+{
+  const char* n = s->name;
+  int nvar = 0;
+  for (int i = 0; i < s->nfields; i++)
+    if (s->fields[i].type->size == 0) nvar++;
+
+  printf("\n// struct %s\n", n);
+  printf("// ------------------------------------------------------------\n\n");
+  printf("#define %s_FIXED_SIZE %d\n\n", n, s->fixed_size);
+
+  printf("// Readers: msg is an encoded %s, e.g. the args of an RPC.\n", n);
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size != 0) {
+      printf("static inline %s %s_%s(const void* msg) {\n", f->type->ctype, n, f->name);
+      printf("  %s v; memcpy(&v, (const char*)msg + %d, %d); return v;\n", f->type->ctype, f->offset, f->type->size);
+      printf("}\n");
+    } else {
+      printf("static inline const %s* %s_%s(const void* msg, int32_t* len) {\n", f->type->ctype, n, f->name);
+      printf("  uint32_t r[2]; memcpy(r, (const char*)msg + %d, 8);\n", f->offset);
+      printf("  *len = (int32_t)r[1]; return (const %s*)((const char*)msg + r[0]);\n", f->type->ctype);
+      printf("}\n");
+    }
+  }
+
+  printf("\n// Whether len bytes at msg hold a well-formed %s, whose fields\n", n);
+  printf("// all lie within them.  Readers assume this.\n");
+  printf("static inline int %s_verify(const void* msg, int len) {\n", n);
+  printf("  if (len < %d) return 0;\n", s->fixed_size);
+  if (nvar > 0) printf("  uint32_t r[2];\n");
+  else printf("  (void)msg;\n");
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size != 0) continue;
+    printf("  memcpy(r, (const char*)msg + %d, 8);\n", f->offset);
+    printf("  if (r[0] < %d || r[0] > (uint32_t)len || r[1] > (uint32_t)len - r[0]) return 0;\n", s->fixed_size);
+  }
+  printf("  return 1;\n}\n");
+
+  printf("\n// Writers\n");
+  printf("static inline int %s_size(", n);
+  if (nvar == 0) printf("void");
+  print_len_params(s);
+  printf(") {\n  return %d", s->fixed_size);
+  for (int i = 0; i < s->nfields; i++)
+    if (s->fields[i].type->size == 0) printf(" + %s_len", s->fields[i].name);
+  printf(";\n}\n");
+
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size == 0) continue;
+    printf("static inline void %s_set_%s(void* msg, %s v) { memcpy((char*)msg + %d, &v, %d); }\n",
+           n, f->name, f->type->ctype, f->offset, f->type->size);
+  }
+
+  printf("\n// Encode a whole %s at buf, which has room for %s_size(...)\n", n, n);
+  printf("// bytes.  RETURN: the number of bytes written.\n");
+  printf("static inline int %s_write(void* buf", n);
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size != 0)
+      printf(", %s %s", f->type->ctype, f->name);
+    else
+      printf(", const %s* %s, int32_t %s_len", f->type->ctype, f->name, f->name);
+  }
+  printf(") {\n");
+  printf("  char* msg = (char*)buf;\n");
+  for (int size = 8; size >= 1; size /= 2)
+    for (int i = 0; i < s->nfields; i++) {
+      const struct field* f = &s->fields[i];
+      if (f->type->size == size)
+        printf("  memcpy(msg + %d, &%s, %d);\n", f->offset, f->name, size);
+    }
+  // Zero the padding, so that encodings are deterministic:
+  if (s->fields_end < s->refs_start)
+    printf("  memset(msg + %d, 0, %d);\n", s->fields_end, s->refs_start - s->fields_end);
+  if (s->refs_end < s->fixed_size)
+    printf("  memset(msg + %d, 0, %d);\n", s->refs_end, s->fixed_size - s->refs_end);
+  printf("  uint32_t pos = %d;\n", s->fixed_size);
+  for (int i = 0; i < s->nfields; i++) {
+    const struct field* f = &s->fields[i];
+    if (f->type->size != 0) continue;
+    printf("  { uint32_t r[2] = { pos, (uint32_t)%s_len }; memcpy(msg + %d, r, 8);\n", f->name, f->offset);
+    printf("    memcpy(msg + pos, %s, %s_len); pos += %s_len; }\n", f->name, f->name, f->name);
+  }
+  printf("  return (int)pos;\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s schema.idl > schema.h\n", argv[0]);
+    return 1;
+  }
+  g_path = argv[1];
+  if ((g_in = fopen(g_path, "r")) == NULL) {
+    fprintf(stderr, "ERROR: cannot open %s\n", g_path);
+    return 1;
+  }
+
+  // Include guard, from the schema's file name:
+  char guard[MAX_NAME * 2];
+  const char* base = strrchr(g_path, '/');
+  base = base ? base + 1 : g_path;
+  int g = sprintf(guard, "AMBIDL_");
+  for (const char* p = base; *p && *p != '.' && g < (int)sizeof(guard) - 3; p++)
+    guard[g++] = isalnum((unsigned char)*p) ? (char)toupper((unsigned char)*p) : '_';
+  strcpy(guard + g, "_H");
+
+  printf("// Generated by ambidl from %s.  Do not edit.\n\n", base);
+  printf("#ifndef %s\n#define %s\n\n", guard, guard);
+  printf("#include <stdint.h>\n#include <string.h>\n");
+
+  char tok[MAX_NAME];
+  static struct schema_struct s;
+  while (next_token(tok)) {
+    if (strcmp(tok, "struct") != 0) fail("expected struct", tok);
+    if (!next_token(tok) || !(isalpha((unsigned char)tok[0]) || tok[0] == '_'))
+      fail("expected a struct name", NULL);
+    strcpy(s.name, tok);
+    parse_struct(&s);
+    lay_out(&s);
+    emit_struct(&s);
+  }
+  printf("\n#endif\n");
+  fclose(g_in);
+  return 0;
+}
@@ -55,9 +55,6 @@ double* g_pingpong_latencies = NULL; // Array of latencies.
 
 int g_waiting_final_ack = 0;
 
-// An INTERNAL global representing whether the client is terminating this AMBROSIA endpoint.
-int g_client_terminating = 0;
-
 int g_is_dummy_round = 1; // We do one dummy round before starting the measurement rounds.
 int g_trials_remaining = 1; // Perform the whole experiment multiple times.
 
@@ -66,6 +63,21 @@ int64_t g_totalExpected = -1; // Expected messages.
 double g_startTimeRound = 0.0;
 int g_numRPCBytes = 0;
 
+double g_recvStartTimeRound = 0.0; // Receiver's time of the first message this round.
+int64_t g_recvRoundMsgs = 0;
+
+// Simulated per-message handler cost: passes over the message bytes.
+int g_handler_work = 0;
+volatile uint32_t g_handler_sink = 0;
+
+// Runtime configuration, set from command line flags.
+struct amb_client_options g_options;
+
+const char* socket_profile_name(int profile) {
+  return profile == AMB_SOCKETS_LATENCY ? "latency"
+       : profile == AMB_SOCKETS_THROUGHPUT ? "throughput" : "default";
+}
+
 
 // Library-level Global constants
 // --------------------------------------------------
@@ -203,7 +215,16 @@ static inline void set_total_expected() {
 
 // Receiver side.
 void receive_message(char* msg, int64_t len) {
+  if (g_recvRoundMsgs == 0) g_recvStartTimeRound = amb_current_time_seconds();
+  g_recvRoundMsgs++;
   g_totalExpected--;
+
+  if (g_handler_work > 0) { // Stand-in for a CPU-heavy handler.
+    uint32_t acc = 0;
+    for (int w=0; w < g_handler_work; w++)
+      for (int i=0; i < len; i++) acc = acc * 31 + (unsigned char)msg[i];
+    g_handler_sink += acc;
+  }
   
   amb_debug_log("GOT THE MESSAGE: %ld bytes, %ld remaining expected messages this round\n", len, g_totalExpected);
 #ifdef AMBCLIENT_DEBUG
@@ -222,6 +243,13 @@ void receive_message(char* msg, int64_t len) {
 
   if(g_totalExpected == 0) {
     amb_debug_log(" That's all the expected messages this round.\n");
+    if (!g_pingpong_mode) {
+      double duration = amb_current_time_seconds() - g_recvStartTimeRound;
+      double throughput = ((double)g_recvRoundMsgs * len / (double)ONE_GIBIBYTE) / duration;
+      printf(" *R*  %d\t %lf\t %lf\t %ld\n", (int)len, throughput, duration, (long int)g_recvRoundMsgs);
+      fflush(stdout);
+    }
+    g_recvRoundMsgs = 0;
     if (SEND_ACK || g_pingpong_mode) {
       send_ack();
       amb_debug_log("Sent ACK.\n");
@@ -237,7 +265,7 @@ void receive_message(char* msg, int64_t len) {
 	printf("Since we are not sending ACKs of every round, send a final shut-down ACK..\n");
 	send_ack();
       }
-      g_client_terminating = 1; // exit_or_restart();
+      amb_shutdown_client_runtime(); // exit_or_restart();
     }
   }
 }
@@ -256,7 +284,7 @@ void startup() {
   }
 }
 
-// Mutates: g_client_terminating.
+// May signal the runtime to shut down.
 // Can send a startup message to ourselves to continue the next round.
 void end_round(int numRPCBytes) {
   if (g_moderate_chatter && SEND_ACK)
@@ -273,15 +301,15 @@ void end_round(int numRPCBytes) {
   // Tail call to the next round.
   if (advance_round()) {
     if (g_moderate_chatter) printf("receive ACK: bouncing a startup message to ourselves\n");
-    char sendbuf[16];
+    // Through the ring, behind this round's messages.  A direct socket
+    // send could interleave with the network thread's sends.
+    char* sendbuf = reserve_buffer(16);
     char* endbuf = amb_write_outgoing_rpc(sendbuf, "", 0, 0, STARTUP_ID, 1, NULL,0);
-
-    // Audit: is this needed?
-    amb_socket_send_all(g_to_immortal_coord, sendbuf, endbuf-sendbuf, 0);
+    release_buffer(endbuf-sendbuf);
   } else {
     if (SEND_ACK) {
       printf("Finished last round, exiting...\n");
-      g_client_terminating = 1; // exit_or_restart();
+      amb_shutdown_client_runtime(); // exit_or_restart();
     } else {
       printf("Finished last round, waiting for shutdown ACK (SEND_ACK on each round is off)\n");
       g_waiting_final_ack = 1;
@@ -293,7 +321,7 @@ void end_round(int numRPCBytes) {
 void receive_ack(int numRPCBytes) {
   if (g_waiting_final_ack) {
     printf("  Sender received final shutdown ACK, shutting down\n");
-    g_client_terminating = 1; // exit_or_restart();
+    amb_shutdown_client_runtime(); // exit_or_restart();
   }
   else if (g_pingpong_mode) {
     assert(numRPCBytes == 1);
@@ -308,7 +336,8 @@ void receive_ack(int numRPCBytes) {
       send_loop(1);
     } else {
       printf("Time to shut down these ping-pongs..\n");
-      printf("Last 10000 Microsecond latencies:\n");
+      printf("Last 10000 Microsecond latencies (socket profile %s):\n",
+             socket_profile_name(g_options.socketProfile));
       int start = g_total_pingpongs - 10000;
       if (start < 0) start=0;
       for(int i= start; i<g_total_pingpongs; i++) {
@@ -343,9 +372,9 @@ void bounce(int64_t n) {
 //------------------------------------------------------------------------------
 
 void send_ack() {
-  char sendbuf[16];
+  char* sendbuf = reserve_buffer(16 + destLen);
   char* newpos = amb_write_outgoing_rpc(sendbuf, destName, destLen, 0, ACK_MSG_ID, 1, NULL, 0);
-  amb_socket_send_all(g_to_immortal_coord, sendbuf, newpos-sendbuf, 0);
+  release_buffer(newpos-sendbuf);
 }
 
 void send_dummy_checkpoint(int upfd) {
@@ -354,7 +383,7 @@ void send_dummy_checkpoint(int upfd) {
 
   // New protocol, the payload is just a 64 bit size:
   int   msgsize = 1 + 8;
-  char* buf = alloca(msgsize + 5 + strsize);
+  char* buf = reserve_buffer(msgsize + 5 + strsize + 1); // + sprintf's NUL
   char* bufcur = write_zigzag_int(buf, msgsize); // Size (including type tag)
   *bufcur++ = Checkpoint;                        // Type
   *((int64_t*)bufcur) = strsize;                 // 8 byte size
@@ -365,14 +394,14 @@ void send_dummy_checkpoint(int upfd) {
   // Then write the checkpoint itself AFTER the regular message:
   bufcur += sprintf(bufcur, "%s", dummy_checkpoint); // Dummy checkpoint.
 
-  amb_socket_send_all(upfd, buf, bufcur-buf, 0);
-  
 #ifdef AMBCLIENT_DEBUG  
   amb_debug_log("  Trivial checkpoint message sent to coordinator (%lld bytes), checkpoint %d bytes\n",
                 (int64_t)(bufcur-buf), strsize);
   amb_debug_log("    Message was: ");
   print_hex_bytes(amb_dbg_fd,buf, bufcur-buf); fprintf(amb_dbg_fd,"\n");
 #endif
+
+  release_buffer(bufcur-buf); // In order with the RPCs sent before it.
 }
 
 
@@ -400,114 +429,9 @@ void amb_dispatch_method(int32_t methodID, void* args, int argsLen) {
   }
 }
 
-// Handle the serialized RPC after the (Size,MsgType) have been read
-// off.
-// 
-// ARGUMENT len: The length argument is an exact bound on the bytes
-// read by this function for this message, which is used in turn to
-// compute the byte size of the arguments at the tail of the payload.
-char* handle_rpc(char* buf, int len) {
-  if (len < 0) {
-    fprintf(stderr, "ERROR: handle_rpc, received negative length!: %d", len);
-    abort();
-  }
-  char* bufstart = buf;
-  char rpc_or_ret = *buf++;             // 1 Reserved byte.
-  int32_t methodID;
-  buf = read_zigzag_int(buf, &methodID);  // 1-5 bytes
-  char fire_forget = *buf++;            // 1 byte
-  int argsLen = len - (buf-bufstart);   // Everything left
-  if (argsLen < 0) {
-    fprintf(stderr, "ERROR: handle_rpc, read past the end of the buffer: start %p, len %d", buf, len);
-    abort();
-  }
-  amb_debug_log("  Dispatching method %d (rpc/ret %d, fireforget %d) with %d bytes of args...\n",
-		methodID, rpc_or_ret, fire_forget, argsLen);
-  amb_dispatch_method(methodID, buf, argsLen);
-  return (buf+argsLen);
-}
-
-// Application loop (FIXME: Move into the client library!)
-//------------------------------------------------------------------------------
-
-
-// The heart of the runtime: enter the processing loop and make
-// up-calls into the application.
-void normal_processing_loop(int upfd, int downfd)
-{  
-  amb_debug_log("\n        .... Normal processing underway ....\n");
-  struct log_hdr hdr;
-  memset((void*) &hdr, 0, AMBROSIA_HEADERSIZE);
-
-  int round = 0;
-  while (!g_client_terminating) {
-    amb_debug_log("Normal processing (iter %d): receive next log header..\n", round++);
-    amb_recv_log_hdr(downfd, &hdr);
-
-    int payloadsize = hdr.totalSize - AMBROSIA_HEADERSIZE;
-    char* buf = calloc(payloadsize, 1);
-    recv(downfd, buf, payloadsize, MSG_WAITALL);
-#ifdef AMBCLIENT_DEBUG  
-    amb_debug_log("Entire Message Payload (%d bytes): ", payloadsize);
-    print_hex_bytes(amb_dbg_fd,buf, payloadsize); fprintf(amb_dbg_fd,"\n");
-#endif
-
-    // Read a stream of messages from the log record:
-    int rawsize = 0;
-    char* bufcur = buf;
-    char* limit = buf + payloadsize;
-    int ind = 0;
-    while (bufcur < limit) {
-      amb_debug_log(" Processing message %d in log record, starting at offset %d (%p), remaining bytes %d\n",
-		    ind++, bufcur-buf, bufcur, limit-bufcur);
-      bufcur = read_zigzag_int(bufcur, &rawsize);  // Size
-      char tag = *bufcur++;                      // Type
-      rawsize--; // Discount type byte.
-      switch(tag) {
-
-      case RPC:
-	amb_debug_log(" It's an incoming RPC.. size without len/tag bytes: %d\n", rawsize);
-	// print_hex_bytes(bufcur,rawsize);printf("\n");
-	bufcur = handle_rpc(bufcur, rawsize);
-	break;
-
-      case InitialMessage:
-	amb_debug_log(" Received InitialMessage back from server.  Processing..\n");
-	// FIXME: InitialMessage should be an arbitrary blob... but here we're following the convention that it's an actual message.
-	break;
-
-      case RPCBatch:
-	{ int32_t numMsgs = -1;
-	  bufcur = read_zigzag_int(bufcur, &numMsgs);
-	  amb_debug_log(" Receiving RPC batch of %d messages.\n", numMsgs);
-	  char* batchstart = bufcur;
-	  for (int i=0; i < numMsgs; i++) {
-	    amb_debug_log(" Reading off message %d/%d of batch, current offset %d, bytes left: %d.\n",
-			  i+1, numMsgs, bufcur-batchstart, rawsize);
-	    char* lastbufcur = bufcur;
-	    int32_t msgsize = -100;
-	    bufcur = read_zigzag_int(bufcur, &msgsize);  // Size (unneeded)	    
-	    char type = *bufcur++;                     // Type - IGNORED
-	    amb_debug_log(" --> Read message, type %d, payload size %d\n", type, msgsize-1);
-	    bufcur = handle_rpc(bufcur, msgsize-1);
-	    amb_debug_log(" --> handling that message read %d bytes off the batch\n", (int)(bufcur - lastbufcur));
-	    rawsize -= (bufcur - lastbufcur);
-	  }
-	}
-	break;
-
-      case TakeCheckpoint:
-	send_dummy_checkpoint(upfd);
-	break;
-      default:
-	fprintf(stderr, "ERROR: unexpected or unrecognized message type: %d", tag);
-	abort();
-	break;
-      }
-    }
-  }
-  
-
+// Called each time the runtime's processing loop returns.
+void end_trial()
+{
   g_trials_remaining--;
   if (g_trials_remaining == 0) {
     printf(" *** processing loop: Last trial finished; exiting.\n");
@@ -540,7 +464,7 @@ void reset_trial_state() {
   
   if (PREFILL) g_is_dummy_round = 0;
   g_waiting_final_ack = 0;
-  g_client_terminating = 0;
+  g_recvRoundMsgs = 0;
 
   // HACKY - twisting stuff here to work for pingpong too:
   if (g_pingpong_mode) {
@@ -566,14 +490,41 @@ int main(int argc, char** argv)
   
   printf("Begin simple native-client experiment, interacting with ImmortalCoordinator...\n");
 
+  // Leading --flags configure the runtime; positional arguments follow.
+  amb_default_client_options(&g_options);
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--recv-thread") == 0) {
+      g_options.receiveThread = 1;
+    } else if (strcmp(argv[1], "--io-uring") == 0) {
+      g_options.ioUring = 1;
+    } else if (strcmp(argv[1], "--socket-profile") == 0 && argc > 2) {
+      if (strcmp(argv[2], "latency") == 0)
+        g_options.socketProfile = AMB_SOCKETS_LATENCY;
+      else if (strcmp(argv[2], "throughput") == 0)
+        g_options.socketProfile = AMB_SOCKETS_THROUGHPUT;
+      else if (strcmp(argv[2], "default") != 0) {
+        fprintf(stderr, "ERROR: unknown socket profile %s (default, latency or throughput)\n", argv[2]);
+        abort();
+      }
+      argv++; argc--;
+    } else if (strcmp(argv[1], "--handler-work") == 0 && argc > 2) {
+      g_handler_work = atoi(argv[2]);
+      argv++; argc--;
+    } else {
+      fprintf(stderr, "ERROR: unrecognized flag %s\n", argv[1]);
+      abort();
+    }
+    argv++; argc--;
+  }
+
   if (argc == 8) {
     buffer_bytes_allocated = 1 << atoi(argv[7]);
     printf(" *** Overriding default bufsize to %d.\n", buffer_bytes_allocated);
     argc--;
   } else {
-    int maxPlus = maxMessageSize + 64; // Allow for header.
-    buffer_bytes_allocated = AMBCLIENT_DEFAULT_BUFSIZE > maxPlus ?
-                               AMBCLIENT_DEFAULT_BUFSIZE : maxPlus;
+    // Messages larger than the ring go out-of-band, so this need not
+    // be sized for maxMessageSize:
+    buffer_bytes_allocated = AMBCLIENT_DEFAULT_BUFSIZE;
   }
   if (argc == 7) {
     g_trials_remaining = atoi(argv[6]);
@@ -598,7 +549,7 @@ int main(int argc, char** argv)
     downport = atoi(argv[4]);
     
   } else {
-    fprintf(stderr, "Usage: this executable expects args: <role=0/1/2/3> <destination> <port> <port> [roundsz] [trials] [bufsz]\n");
+    fprintf(stderr, "Usage: this executable expects args: [flags] <role=0/1/2/3> <destination> <port> <port> [roundsz] [trials] [bufsz]\n");
     fprintf(stderr, "  where <role> is 0/1 for sender/receiver throughput mode\n");
     fprintf(stderr, "     OR <role> is 2/3 for sender/receiver ping-pong mode\n");
     fprintf(stderr, "  where <destination> is e.g. 'native1' or 'native2' and is the name of the OTHER party\n");
@@ -606,6 +557,12 @@ int main(int argc, char** argv)
     fprintf(stderr, "  optional [trials] argument repeats the entire experiment\n");    
     fprintf(stderr, "  optional [bufsz] is the log base 2 of the buffer byte size\n");
     fprintf(stderr, "  \n");    
+    fprintf(stderr, "  [flags] may be any of:\n");
+    fprintf(stderr, "    --recv-thread      read log records on a dedicated thread, overlapped with dispatch\n");
+    fprintf(stderr, "    --io-uring         drive both connections from one io_uring thread (Linux)\n");
+    fprintf(stderr, "    --socket-profile P tune the coordinator connections: default, latency or throughput\n");
+    fprintf(stderr, "    --handler-work N   make each received message cost N passes over its bytes\n");
+    fprintf(stderr, "  \n");    
     fprintf(stderr, "  NOTE: in ping-pong mode [roundsz] determines the number of pingpongs written to pingpongs.txt\n");
     abort();
   }
@@ -627,15 +584,9 @@ int main(int argc, char** argv)
   /* printf("  Ambrosia/bin/x64/Release/net46/LocalAmbrosiaRuntime.exe  native2 50002 50003 native2 logs/ nativetestbins a n y 1000 n 0 0\n"); */
   /* printf("(You need four ports, in the above example: 50000-50003 .)\n"); */
 
-  int upfd, downfd;
-  amb_connect_sockets(upport, downport, &upfd, &downfd);
-  amb_debug_log("Connections established (%d,%d), beginning protocol.\n", upfd, downfd);
-  amb_startup_protocol(upfd, downfd);
-
-  g_to_immortal_coord = upfd;
-  g_from_immortal_coord = downfd;
-
-  new_buffer(buffer_bytes_allocated);
+  // Connects, runs the startup protocol, and starts the network threads:
+  g_options.bufSz = buffer_bytes_allocated;
+  amb_initialize_client_runtime_opts(upport, downport, &g_options);
   
   reset_trial_state();
 
@@ -644,29 +595,17 @@ int main(int argc, char** argv)
   printf(" *** SEND_ACK: %d\n", SEND_ACK);
   printf(" *** PREFILL: %d\n", PREFILL);
   printf(" *** PINGPONG mode: %d\n", g_pingpong_mode);  
+  printf(" *** RECEIVE THREAD: %d\n", g_options.receiveThread);
+  printf(" *** IO_URING: %d\n", g_options.ioUring);
+  printf(" *** SOCKET PROFILE: %s\n", socket_profile_name(g_options.socketProfile));
+  printf(" *** HANDLER WORK: %d\n", g_handler_work);
   printf(" *** startup: Beginning experiment, first trial of: %d.\n", g_trials_remaining);
   if ( g_is_sender || destLen == 0)
     printf("Bytes per RPC,  Throughput (GiB/sec),  Round-Time,  Round-Msgs\n");  
 
-#ifdef _WIN32
-  DWORD lpThreadId;
-  HANDLE th = CreateThread(NULL, 0,
-			   amb_network_progress_thread,
-			   NULL, 0,
-			   & lpThreadId);
-  if (th == NULL)
-#else
-  pthread_t th;
-  int res = pthread_create(& th, NULL, amb_network_progress_thread, NULL);
-  if (res != 0)
-#endif
-  {
-    fprintf(stderr, "ERROR: failed to create network progress thread.\n");
-    abort();
-  }
-
   while (g_trials_remaining > 0) {
-    normal_processing_loop(upfd,downfd);
+    amb_normal_processing_loop();
+    end_trial();
     reset_trial_state();
     // First time we are driven by a startup message from LAR.  Subsequently we run it ourselves:
     startup();